@@ -8,6 +8,97 @@ static const cyaml_strval_t nosdk_messaging_interface_strings[] = {
     {"http", HTTP},
 };
 
+static const cyaml_strval_t nosdk_fifo_framing_strings[] = {
+    {"none", FRAMING_NONE},
+    {"lines", FRAMING_LINES},
+    {"length", FRAMING_LENGTH},
+};
+
+static const cyaml_strval_t nosdk_fifo_headers_strings[] = {
+    {"file", HEADERS_FILE},
+    {"inline", HEADERS_INLINE},
+    {"none", HEADERS_NONE},
+};
+
+static const cyaml_schema_field_t nosdk_producer_tuning_schema[] = {
+    CYAML_FIELD_STRING_PTR(
+        "compression",
+        CYAML_FLAG_POINTER | CYAML_FLAG_OPTIONAL,
+        struct nosdk_producer_tuning,
+        compression,
+        0,
+        CYAML_UNLIMITED),
+    CYAML_FIELD_INT(
+        "linger_ms",
+        CYAML_FLAG_OPTIONAL,
+        struct nosdk_producer_tuning,
+        linger_ms),
+    CYAML_FIELD_INT(
+        "batch_size",
+        CYAML_FLAG_OPTIONAL,
+        struct nosdk_producer_tuning,
+        batch_size),
+    CYAML_FIELD_BOOL(
+        "idempotence",
+        CYAML_FLAG_OPTIONAL,
+        struct nosdk_producer_tuning,
+        idempotence),
+    CYAML_FIELD_STRING_PTR(
+        "acks",
+        CYAML_FLAG_POINTER | CYAML_FLAG_OPTIONAL,
+        struct nosdk_producer_tuning,
+        acks,
+        0,
+        CYAML_UNLIMITED),
+    CYAML_FIELD_END};
+
+static const cyaml_schema_field_t nosdk_consumer_tuning_schema[] = {
+    CYAML_FIELD_INT(
+        "fetch_min_bytes",
+        CYAML_FLAG_OPTIONAL,
+        struct nosdk_consumer_tuning,
+        fetch_min_bytes),
+    CYAML_FIELD_INT(
+        "fetch_wait_max_ms",
+        CYAML_FLAG_OPTIONAL,
+        struct nosdk_consumer_tuning,
+        fetch_wait_max_ms),
+    CYAML_FIELD_INT(
+        "max_partition_fetch_bytes",
+        CYAML_FLAG_OPTIONAL,
+        struct nosdk_consumer_tuning,
+        max_partition_fetch_bytes),
+    CYAML_FIELD_INT(
+        "session_timeout_ms",
+        CYAML_FLAG_OPTIONAL,
+        struct nosdk_consumer_tuning,
+        session_timeout_ms),
+    CYAML_FIELD_END};
+
+static const cyaml_schema_field_t nosdk_kafka_property_schema[] = {
+    CYAML_FIELD_STRING_PTR(
+        "name",
+        CYAML_FLAG_POINTER,
+        struct nosdk_kafka_property,
+        name,
+        0,
+        CYAML_UNLIMITED),
+    CYAML_FIELD_STRING_PTR(
+        "value",
+        CYAML_FLAG_POINTER,
+        struct nosdk_kafka_property,
+        value,
+        0,
+        CYAML_UNLIMITED),
+    CYAML_FIELD_END};
+
+static const cyaml_schema_value_t nosdk_kafka_property_schema_value = {
+    CYAML_VALUE_MAPPING(
+        CYAML_FLAG_DEFAULT,
+        struct nosdk_kafka_property,
+        nosdk_kafka_property_schema),
+};
+
 static const cyaml_schema_field_t nosdk_messaging_config_schema[] = {
     CYAML_FIELD_STRING_PTR(
         "topic",
@@ -23,6 +114,65 @@ static const cyaml_schema_field_t nosdk_messaging_config_schema[] = {
         interface,
         nosdk_messaging_interface_strings,
         CYAML_ARRAY_LEN(nosdk_messaging_interface_strings)),
+    CYAML_FIELD_ENUM(
+        "framing",
+        CYAML_FLAG_OPTIONAL,
+        struct nosdk_messaging_config,
+        framing,
+        nosdk_fifo_framing_strings,
+        CYAML_ARRAY_LEN(nosdk_fifo_framing_strings)),
+    CYAML_FIELD_ENUM(
+        "headers",
+        CYAML_FLAG_OPTIONAL,
+        struct nosdk_messaging_config,
+        headers,
+        nosdk_fifo_headers_strings,
+        CYAML_ARRAY_LEN(nosdk_fifo_headers_strings)),
+    CYAML_FIELD_INT(
+        "partitions",
+        CYAML_FLAG_OPTIONAL,
+        struct nosdk_messaging_config,
+        partitions),
+    CYAML_FIELD_INT(
+        "replication",
+        CYAML_FLAG_OPTIONAL,
+        struct nosdk_messaging_config,
+        replication),
+    CYAML_FIELD_INT(
+        "retries",
+        CYAML_FLAG_OPTIONAL,
+        struct nosdk_messaging_config,
+        retries),
+    CYAML_FIELD_INT(
+        "retry_backoff_ms",
+        CYAML_FLAG_OPTIONAL,
+        struct nosdk_messaging_config,
+        retry_backoff_ms),
+    CYAML_FIELD_BOOL(
+        "explicit_acks",
+        CYAML_FLAG_OPTIONAL,
+        struct nosdk_messaging_config,
+        explicit_acks),
+    CYAML_FIELD_MAPPING_PTR(
+        "producer",
+        CYAML_FLAG_POINTER | CYAML_FLAG_OPTIONAL,
+        struct nosdk_messaging_config,
+        producer,
+        nosdk_producer_tuning_schema),
+    CYAML_FIELD_MAPPING_PTR(
+        "consumer",
+        CYAML_FLAG_POINTER | CYAML_FLAG_OPTIONAL,
+        struct nosdk_messaging_config,
+        consumer,
+        nosdk_consumer_tuning_schema),
+    CYAML_FIELD_SEQUENCE(
+        "properties",
+        CYAML_FLAG_POINTER | CYAML_FLAG_OPTIONAL,
+        struct nosdk_messaging_config,
+        properties,
+        &nosdk_kafka_property_schema_value,
+        0,
+        CYAML_UNLIMITED),
     CYAML_FIELD_END};
 
 static const cyaml_schema_value_t nosdk_messaging_config_schema_value = {
@@ -65,6 +215,16 @@ static const cyaml_schema_field_t nosdk_process_config_schema[] = {
         &nosdk_messaging_config_schema_value,
         0,
         CYAML_UNLIMITED),
+    CYAML_FIELD_BOOL(
+        "transactional",
+        CYAML_FLAG_OPTIONAL,
+        struct nosdk_process_config,
+        transactional),
+    CYAML_FIELD_INT(
+        "transaction_interval_ms",
+        CYAML_FLAG_OPTIONAL,
+        struct nosdk_process_config,
+        transaction_interval_ms),
     CYAML_FIELD_END};
 
 static const cyaml_schema_value_t nosdk_process_config_schema_value = {
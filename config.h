@@ -1,14 +1,84 @@
 #ifndef _NOSDK_CONFIG_H
 #define _NOSDK_CONFIG_H
 
+#include <stdbool.h>
+
 enum nosdk_messaging_interface {
     FS,
     HTTP,
 };
 
+// how messages are delimited on FS interface FIFOs. with framing the
+// subscribe FIFO stays open and streams messages back to back.
+enum nosdk_fifo_framing {
+    FRAMING_NONE,
+    // each message is followed by a newline
+    FRAMING_LINES,
+    // each message is preceded by its decimal length and a newline
+    FRAMING_LENGTH,
+};
+
+// where FS consumers receive message metadata. with framing, file headers
+// cannot be matched to a message and are not written.
+enum nosdk_fifo_headers {
+    // sub/<topic>.headers is replaced before each message
+    HEADERS_FILE,
+    // a single-line JSON block precedes each message, as its own frame when
+    // framed or as the first line otherwise
+    HEADERS_INLINE,
+    HEADERS_NONE,
+};
+
+// throughput and latency settings of the producer serving a topic
+struct nosdk_producer_tuning {
+    // none, gzip, snappy, lz4 or zstd
+    char *compression;
+    int linger_ms;
+    int batch_size;
+    bool idempotence;
+    // 0, 1 or all
+    char *acks;
+};
+
+struct nosdk_consumer_tuning {
+    int fetch_min_bytes;
+    int fetch_wait_max_ms;
+    int max_partition_fetch_bytes;
+    int session_timeout_ms;
+};
+
+// an rdkafka property passed through as is, checked at startup
+struct nosdk_kafka_property {
+    char *name;
+    char *value;
+};
+
 struct nosdk_messaging_config {
     char *topic;
     enum nosdk_messaging_interface interface;
+    enum nosdk_fifo_framing framing;
+    enum nosdk_fifo_headers headers;
+
+    // used when the topic is created at startup
+    int partitions;
+    int replication;
+
+    // failed messages are retried through <topic>.retry.<n> topics, each
+    // tier waiting twice as long as the one before, and end up in
+    // <topic>.dlq after the last one
+    int retries;
+    int retry_backoff_ms;
+
+    // workers ack each message over HTTP once it is processed. otherwise a
+    // message is acked as it is handed out. retries imply explicit acks.
+    bool explicit_acks;
+
+    // rdkafka settings for the topic. properties are applied after the
+    // tuning blocks and override them.
+    struct nosdk_producer_tuning *producer;
+    struct nosdk_consumer_tuning *consumer;
+    struct nosdk_kafka_property *properties;
+    unsigned properties_count;
 };
 
 struct nosdk_process_config {
@@ -19,6 +89,11 @@ struct nosdk_process_config {
     unsigned consume_count;
     struct nosdk_messaging_config *produce;
     unsigned produce_count;
+
+    // commit consumed offsets together with the produced messages, in
+    // transactions of transaction_interval_ms
+    bool transactional;
+    int transaction_interval_ms;
 };
 
 struct nosdk_config {
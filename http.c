@@ -1,6 +1,8 @@
 #include "http.h"
 #include "util.h"
+#include <errno.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -59,41 +61,97 @@ int nosdk_http_respond(
     char *content_type,
     char *body,
     int body_len) {
+    return nosdk_http_respond_headers(
+        req, status, content_type, NULL, 0, body, body_len);
+}
 
-    char buf[256];
+int nosdk_http_respond_headers(
+    struct nosdk_http_request *req,
+    http_status_t status,
+    char *content_type,
+    struct nosdk_http_header *headers,
+    int num_headers,
+    char *body,
+    int body_len) {
 
-    snprintf(
-        buf, sizeof(buf), "HTTP/1.1 %d %s\r\n", status, status_str(status));
-    if (!write(req->client_fd, buf, strlen(buf))) {
-        return -1;
+    // the head is built in one buffer and sent with the body in a single
+    // writev, the body is never copied
+    struct nosdk_string_buffer *head = nosdk_string_buffer_new();
+    nosdk_string_buffer_append(
+        head, "HTTP/1.1 %d %s\r\n", status, status_str(status));
+    nosdk_string_buffer_append(head, "Content-Type: %s\r\n", content_type);
+    for (int i = 0; i < num_headers; i++) {
+        nosdk_string_buffer_append(
+            head, "%s: %s\r\n", headers[i].name, headers[i].value);
     }
+    nosdk_string_buffer_append(head, "Content-Length: %d\r\n\r\n", body_len);
 
-    snprintf(buf, sizeof(buf), "Content-Type: %s\r\n", content_type);
-    if (!write(req->client_fd, buf, strlen(buf))) {
+    struct iovec iov[2] = {
+        {.iov_base = head->data, .iov_len = head->size},
+        {.iov_base = body, .iov_len = body != NULL ? body_len : 0},
+    };
+    int ret = nosdk_writev_all(req->client_fd, iov, 2);
+    nosdk_string_buffer_free(head);
+    if (ret != 0) {
         return -1;
     }
 
-    snprintf(buf, sizeof(buf), "Content-Length: %d\r\n\r\n", body_len);
-    if (!write(req->client_fd, buf, strlen(buf))) {
-        return -1;
-    }
+    nosdk_debugf(
+        "sent http response: %s %s %s\n", http_method_name(req), req->path,
+        status_str(status));
 
-    int written = 0;
-    while (written < body_len) {
-        int result = write(req->client_fd, &body[written], body_len - written);
-        if (result < 1) {
-            return -1;
-        }
-        written += result;
+    return 0;
+}
+
+int nosdk_http_stream_start(
+    struct nosdk_http_request *req,
+    http_status_t status,
+    char *content_type) {
+    struct nosdk_string_buffer *head = nosdk_string_buffer_new();
+    nosdk_string_buffer_append(
+        head, "HTTP/1.1 %d %s\r\n", status, status_str(status));
+    nosdk_string_buffer_append(head, "Content-Type: %s\r\n", content_type);
+    nosdk_string_buffer_append(head, "Transfer-Encoding: chunked\r\n\r\n");
+
+    struct iovec iov[1] = {
+        {.iov_base = head->data, .iov_len = head->size},
+    };
+    int ret = nosdk_writev_all(req->client_fd, iov, 1);
+    nosdk_string_buffer_free(head);
+    if (ret != 0) {
+        return -1;
     }
 
     nosdk_debugf(
-        "sent http response: %s %s %s\n", http_method_name(req), req->path,
-        status_str(status));
+        "streaming http response: %s %s %s\n", http_method_name(req),
+        req->path, status_str(status));
 
     return 0;
 }
 
+int nosdk_http_stream_write(
+    struct nosdk_http_request *req, char *data, int len) {
+    if (len == 0) {
+        return 0;
+    }
+
+    char size[16];
+    int size_len = snprintf(size, sizeof(size), "%x\r\n", len);
+    struct iovec iov[3] = {
+        {.iov_base = size, .iov_len = size_len},
+        {.iov_base = data, .iov_len = len},
+        {.iov_base = "\r\n", .iov_len = 2},
+    };
+    return nosdk_writev_all(req->client_fd, iov, 3) == 0 ? 0 : -1;
+}
+
+int nosdk_http_stream_end(struct nosdk_http_request *req) {
+    struct iovec iov[1] = {
+        {.iov_base = "0\r\n\r\n", .iov_len = 5},
+    };
+    return nosdk_writev_all(req->client_fd, iov, 1) == 0 ? 0 : -1;
+}
+
 http_method_t nosdk_parse_method(char *data, int len) {
     for (int i = 0; method_table[i].name != NULL; i++) {
         if (strlen(method_table[i].name) == len) {
@@ -141,6 +199,16 @@ struct nosdk_http_server *nosdk_http_server_new() {
     server->port = ntohs(addr.sin_port);
     server->header_buf = malloc(HEADER_BUF_SIZE);
     server->num_handlers = 0;
+    server->parked = NULL;
+    server->num_parked = 0;
+    server->parked_capacity = 0;
+    if (nosdk_wake_fd_new(&server->wake_read_fd, &server->wake_fd) != 0) {
+        perror("wake fd");
+        close(socket_fd);
+        free(server->header_buf);
+        free(server);
+        return NULL;
+    }
 
     return server;
 }
@@ -173,9 +241,26 @@ int nosdk_http_server_handle(
 }
 
 void consume_header(struct nosdk_http_request *req, char *name, char *value) {
-    if (strncasecmp(name, "content-length", strlen(name)) == 0) {
+    if (strcasecmp(name, "content-length") == 0) {
         req->content_length = atoi(value);
     }
+
+    if (req->num_headers < HTTP_HEADERS_MAX) {
+        struct nosdk_http_header *h = &req->headers[req->num_headers];
+        snprintf(h->name, sizeof(h->name), "%s", name);
+        snprintf(h->value, sizeof(h->value), "%s", value);
+        req->num_headers++;
+    }
+}
+
+const char *
+nosdk_http_request_header(struct nosdk_http_request *req, const char *name) {
+    for (int i = 0; i < req->num_headers; i++) {
+        if (strcasecmp(req->headers[i].name, name) == 0) {
+            return req->headers[i].value;
+        }
+    }
+    return NULL;
 }
 
 char *nosdk_http_request_body_alloc(struct nosdk_http_request *req) {
@@ -189,8 +274,10 @@ char *nosdk_http_request_body_alloc(struct nosdk_http_request *req) {
 
     while (data_pos < req->content_length) {
         ssize_t result = read(
-            req->client_fd, &data[req->body_data_len],
-            req->content_length - req->body_data_len);
+            req->client_fd, &data[data_pos], req->content_length - data_pos);
+        if (result <= 0) {
+            break;
+        }
 
         data_pos += result;
     }
@@ -200,12 +287,57 @@ char *nosdk_http_request_body_alloc(struct nosdk_http_request *req) {
     return data;
 }
 
+int nosdk_http_request_body_read(
+    struct nosdk_http_request *req, char *buf, int len) {
+    int remaining = req->content_length - req->body_read;
+    if (len > remaining) {
+        len = remaining;
+    }
+    if (len <= 0) {
+        return 0;
+    }
+
+    int n;
+    if (req->body_read < req->body_data_len) {
+        n = req->body_data_len - req->body_read;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(buf, &req->body_data[req->body_read], n);
+    } else {
+        ssize_t result = read(req->client_fd, buf, len);
+        if (result <= 0) {
+            return -1;
+        }
+        n = result;
+    }
+
+    req->body_read += n;
+    return n;
+}
+
+int nosdk_http_request_body_peek(struct nosdk_http_request *req) {
+    if (req->body_data_len == 0 && req->content_length > 0) {
+        ssize_t result = read(req->client_fd, req->body_data, 1);
+        if (result <= 0) {
+            return -1;
+        }
+        req->body_data_len = 1;
+    }
+
+    if (req->body_data_len == 0) {
+        return -1;
+    }
+    return (unsigned char)req->body_data[0];
+}
+
 struct nosdk_http_request *
 nosdk_http_parse_head(struct nosdk_http_server *server, int client_fd) {
 
     struct nosdk_http_request *req = malloc(sizeof(struct nosdk_http_request));
     memset(req, 0, sizeof(struct nosdk_http_request));
     req->client_fd = client_fd;
+    req->server = server;
 
     ssize_t result =
         recv(req->client_fd, server->header_buf, HEADER_BUF_SIZE, 0);
@@ -233,9 +365,9 @@ nosdk_http_parse_head(struct nosdk_http_server *server, int client_fd) {
     char last_char = server->header_buf[path_start + path_len];
     int in_header = 0;
     int in_value = 0;
-    char name_buf[128];
+    char name_buf[HTTP_HEADER_NAME_MAX];
     int name_buf_pos = 0;
-    char value_buf[128];
+    char value_buf[HTTP_HEADER_VALUE_MAX];
     int value_buf_pos = 0;
     int consecutive_rns = 0;
 
@@ -247,11 +379,15 @@ nosdk_http_parse_head(struct nosdk_http_server *server, int client_fd) {
                 if (this_char == ':') {
                     in_value = 1;
                 }
-                name_buf[name_buf_pos] = last_char;
-                name_buf_pos++;
+                if (name_buf_pos < sizeof(name_buf) - 1) {
+                    name_buf[name_buf_pos] = last_char;
+                    name_buf_pos++;
+                }
             } else {
                 if (this_char != '\r') {
-                    if (this_char != ' ') {
+                    // skip leading whitespace only, values may contain spaces
+                    if ((this_char != ' ' || value_buf_pos > 0) &&
+                        value_buf_pos < sizeof(value_buf) - 1) {
                         value_buf[value_buf_pos] = this_char;
                         value_buf_pos++;
                     }
@@ -330,8 +466,11 @@ int nosdk_http_handle(struct nosdk_http_server *server) {
         struct nosdk_http_handler *handler = &server->handlers[i];
 
         if (memcmp(req->path, handler->prefix, strlen(handler->prefix)) == 0) {
+            req->ctx = handler->ctx;
             handler->handler(req);
-            nosdk_http_request_end(req);
+            if (!req->parked) {
+                nosdk_http_request_end(req);
+            }
             return 0;
         }
     }
@@ -340,14 +479,98 @@ int nosdk_http_handle(struct nosdk_http_server *server) {
     return 0;
 }
 
+void nosdk_http_park(
+    struct nosdk_http_request *req,
+    int timeout_ms,
+    nosdk_http_resume_fn resume,
+    void *arg) {
+    struct nosdk_http_server *server = req->server;
+    if (server->num_parked == server->parked_capacity) {
+        server->parked_capacity =
+            server->parked_capacity == 0 ? 16 : server->parked_capacity * 2;
+        server->parked = realloc(
+            server->parked,
+            sizeof(struct nosdk_http_parked) * server->parked_capacity);
+    }
+
+    struct nosdk_http_parked *p = &server->parked[server->num_parked];
+    p->req = req;
+    p->deadline_ms = nosdk_now_ms() + timeout_ms;
+    p->resume = resume;
+    p->arg = arg;
+    server->num_parked++;
+    req->parked = 1;
+}
+
+void nosdk_http_server_wake(struct nosdk_http_server *server) {
+    nosdk_wake_signal(server->wake_fd);
+}
+
+// retry every parked request when woken, and end the expired ones
+void nosdk_http_resume_parked(struct nosdk_http_server *server, int woken) {
+    int64_t now = nosdk_now_ms();
+
+    for (int i = 0; i < server->num_parked; i++) {
+        struct nosdk_http_parked *p = &server->parked[i];
+        int expired = now >= p->deadline_ms;
+        if (!woken && !expired) {
+            continue;
+        }
+
+        if (p->resume(p->req, p->arg, expired) || expired) {
+            nosdk_http_request_end(p->req);
+            server->num_parked--;
+            server->parked[i] = server->parked[server->num_parked];
+            i--;
+        }
+    }
+}
+
+// how long the server may sleep before a parked request expires
+int nosdk_http_parked_timeout(struct nosdk_http_server *server) {
+    if (server->num_parked == 0) {
+        return -1;
+    }
+
+    int64_t first = server->parked[0].deadline_ms;
+    for (int i = 1; i < server->num_parked; i++) {
+        if (server->parked[i].deadline_ms < first) {
+            first = server->parked[i].deadline_ms;
+        }
+    }
+
+    int64_t timeout = first - nosdk_now_ms();
+    return timeout > 0 ? (int)timeout : 0;
+}
+
 int nosdk_http_server_start(struct nosdk_http_server *server) {
     if (listen(server->socket_fd, 10) != 0) {
         perror("listen");
         return -1;
     }
 
+    struct pollfd fds[2] = {
+        {.fd = server->socket_fd, .events = POLLIN},
+        {.fd = server->wake_read_fd, .events = POLLIN},
+    };
+
     while (1) {
-        if (nosdk_http_handle(server) != 0) {
+        int ready = poll(fds, 2, nosdk_http_parked_timeout(server));
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            break;
+        }
+
+        int woken = (fds[1].revents & POLLIN) != 0;
+        if (woken) {
+            nosdk_wake_drain(server->wake_read_fd);
+        }
+        nosdk_http_resume_parked(server, woken);
+
+        if ((fds[0].revents & POLLIN) && nosdk_http_handle(server) != 0) {
             break;
         }
     }
@@ -356,6 +579,14 @@ int nosdk_http_server_start(struct nosdk_http_server *server) {
 }
 
 void nosdk_http_server_destroy(struct nosdk_http_server *server) {
+    for (int i = 0; i < server->num_parked; i++) {
+        nosdk_http_request_end(server->parked[i].req);
+    }
+    free(server->parked);
+    close(server->wake_read_fd);
+    if (server->wake_fd != server->wake_read_fd) {
+        close(server->wake_fd);
+    }
     close(server->socket_fd);
     free(server->header_buf);
     free(server);
@@ -1,9 +1,14 @@
 #ifndef _NOSDK_HTTP_H
 #define _NOSDK_HTTP_H
 
+#include <stdint.h>
+
 #define HEADER_BUF_SIZE 4096
 #define MAX_HANDLERS 16
 #define HTTP_PATH_MAX 256
+#define HTTP_HEADERS_MAX 32
+#define HTTP_HEADER_NAME_MAX 128
+#define HTTP_HEADER_VALUE_MAX 256
 
 typedef enum {
     HTTP_METHOD_UNKNOWN = 0,
@@ -27,19 +32,49 @@ typedef enum {
     HTTP_STATUS_INTERNAL_ERROR = 500,
 } http_status_t;
 
+struct nosdk_http_header {
+    char name[HTTP_HEADER_NAME_MAX];
+    char value[HTTP_HEADER_VALUE_MAX];
+};
+
+struct nosdk_http_server;
+
 struct nosdk_http_request {
     http_method_t method;
     char path[HTTP_PATH_MAX];
     int content_length;
 
-    char body_data[HTTP_PATH_MAX];
+    struct nosdk_http_header headers[HTTP_HEADERS_MAX];
+    int num_headers;
+
+    char body_data[HEADER_BUF_SIZE];
     int body_data_len;
+    int body_read;
 
     int client_fd;
+
+    // the ctx of the handler serving the request
+    void *ctx;
+
+    struct nosdk_http_server *server;
+    int parked;
 };
 
 char *nosdk_http_request_body_alloc(struct nosdk_http_request *req);
 
+// read up to len more bytes of the body, returns 0 at its end and -1 if
+// the client went away before sending all of it
+int nosdk_http_request_body_read(
+    struct nosdk_http_request *req, char *buf, int len);
+
+// the first byte of the body, which is still left to be read or
+// allocated. -1 for an empty body.
+int nosdk_http_request_body_peek(struct nosdk_http_request *req);
+
+// case-insensitive lookup of a request header value, NULL if not present
+const char *
+nosdk_http_request_header(struct nosdk_http_request *req, const char *name);
+
 int nosdk_http_respond(
     struct nosdk_http_request *req,
     http_status_t status,
@@ -47,9 +82,47 @@ int nosdk_http_respond(
     char *body,
     int body_len);
 
+// respond with additional response headers
+int nosdk_http_respond_headers(
+    struct nosdk_http_request *req,
+    http_status_t status,
+    char *content_type,
+    struct nosdk_http_header *headers,
+    int num_headers,
+    char *body,
+    int body_len);
+
+// start a response whose body is sent in chunks with
+// nosdk_http_stream_write as it is produced
+int nosdk_http_stream_start(
+    struct nosdk_http_request *req,
+    http_status_t status,
+    char *content_type);
+
+int nosdk_http_stream_write(
+    struct nosdk_http_request *req, char *data, int len);
+
+// send the last chunk. a stream that is never ended tells the client the
+// response is incomplete when the connection closes.
+int nosdk_http_stream_end(struct nosdk_http_request *req);
+
 struct nosdk_http_handler {
     char *prefix;
     void (*handler)(struct nosdk_http_request *req);
+    void *ctx;
+};
+
+// called for a parked request when the server is woken and once it
+// expires. returns 1 once it has responded, the request then ends. an
+// expired request must respond.
+typedef int (*nosdk_http_resume_fn)(
+    struct nosdk_http_request *req, void *arg, int expired);
+
+struct nosdk_http_parked {
+    struct nosdk_http_request *req;
+    int64_t deadline_ms;
+    nosdk_http_resume_fn resume;
+    void *arg;
 };
 
 struct nosdk_http_server {
@@ -59,10 +132,28 @@ struct nosdk_http_server {
 
     struct nosdk_http_handler handlers[MAX_HANDLERS];
     int num_handlers;
+
+    // requests waiting for something to respond with, without holding up
+    // the server. they are retried whenever wake_fd is signalled.
+    struct nosdk_http_parked *parked;
+    int num_parked;
+    int parked_capacity;
+    int wake_read_fd;
+    int wake_fd;
 };
 
 struct nosdk_http_server *nosdk_http_server_new();
 
+// respond later instead of from the handler, within timeout_ms
+void nosdk_http_park(
+    struct nosdk_http_request *req,
+    int timeout_ms,
+    nosdk_http_resume_fn resume,
+    void *arg);
+
+// retry the parked requests, safe to call from any thread
+void nosdk_http_server_wake(struct nosdk_http_server *server);
+
 int nosdk_http_server_handle(
     struct nosdk_http_server *server, struct nosdk_http_handler handler);
 
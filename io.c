@@ -11,6 +11,7 @@
 #include "http.h"
 #include "io.h"
 #include "kafka.h"
+#include "metrics.h"
 #include "postgres.h"
 #include "s3.h"
 
@@ -22,6 +23,14 @@ int nosdk_io_mgr_init(struct nosdk_io_mgr *mgr) {
     return 0;
 }
 
+int nosdk_io_mgr_configure(struct nosdk_io_mgr *mgr, struct nosdk_config *c) {
+    return nosdk_kafka_mgr_configure(c);
+}
+
+int nosdk_io_mgr_provision(struct nosdk_io_mgr *mgr, struct nosdk_config *c) {
+    return nosdk_kafka_mgr_provision_topics(c);
+}
+
 struct nosdk_io_process_ctx *
 nosdk_io_process_ctx_new(struct nosdk_io_mgr *mgr) {
     mgr->contexts[mgr->num_contexts].process_id = mgr->num_contexts;
@@ -38,24 +47,70 @@ int nosdk_io_mgr_setup(
 
     if (ctx->server == NULL) {
         ctx->server = nosdk_http_server_new();
+
+        struct nosdk_http_handler handler = {
+            .prefix = "/metrics",
+            .handler = nosdk_metrics_handler,
+        };
+        if (nosdk_http_server_handle(ctx->server, handler) != 0) {
+            return -1;
+        }
+    }
+
+    // a transactional process produces through a producer of its own,
+    // which its consumers commit their offsets with
+    int transactional = spec.process != NULL && spec.process->transactional;
+    if ((spec.kind == KAFKA_CONSUME_TOPIC ||
+         spec.kind == KAFKA_PRODUCE_TOPIC) &&
+        transactional) {
+        ret = nosdk_kafka_mgr_kafka_transactional(
+            ctx->process_id, spec.process->transaction_interval_ms);
+        if (ret != 0) {
+            return ret;
+        }
     }
 
     if (spec.kind == KAFKA_CONSUME_TOPIC) {
-        ret = nosdk_kafka_mgr_kafka_subscribe(spec.data);
+        // every process gets its own group member and so its own partitions
+        ret = nosdk_kafka_mgr_kafka_subscribe(
+            spec.data, ctx->process_id, spec.messaging);
         if (ret != 0) {
             return ret;
         }
 
+        // FIFO workers of a topic with retries or of a transactional
+        // process ack and nack over HTTP
+        if (spec.interface == FS &&
+            (transactional ||
+             (spec.messaging != NULL && spec.messaging->retries > 0))) {
+            struct nosdk_http_handler handler = {
+                .prefix = "/msg",
+                .handler = nosdk_kafka_handler,
+                .ctx = &ctx->process_id,
+            };
+
+            if (nosdk_http_server_handle(ctx->server, handler) != 0) {
+                return -1;
+            }
+        }
+
         if (spec.interface == FS) {
             struct nosdk_kafka_thread_ctx *kthread =
                 nosdk_kafka_mgr_make_thread(ctx->root_dir);
-            kthread->k = nosdk_kafka_mgr_get_consumer(spec.data);
+            kthread->k =
+                nosdk_kafka_mgr_get_consumer(spec.data, ctx->process_id);
+            kthread->topic = spec.data;
+            if (spec.messaging != NULL) {
+                kthread->framing = spec.messaging->framing;
+                kthread->headers = spec.messaging->headers;
+            }
             pthread_create(
                 &kthread->thread, NULL, nosdk_kafka_consumer_thread, kthread);
         } else {
             struct nosdk_http_handler handler = {
                 .prefix = "/msg",
                 .handler = nosdk_kafka_handler,
+                .ctx = &ctx->process_id,
             };
 
             if (nosdk_http_server_handle(ctx->server, handler) != 0) {
@@ -66,7 +121,7 @@ int nosdk_io_mgr_setup(
         return 0;
     } else if (spec.kind == KAFKA_PRODUCE_TOPIC) {
 
-        ret = nosdk_kafka_mgr_kafka_produce(spec.data);
+        ret = nosdk_kafka_mgr_kafka_produce(spec.data, ctx->process_id);
         if (ret != 0) {
             return ret;
         }
@@ -74,13 +129,19 @@ int nosdk_io_mgr_setup(
         if (spec.interface == FS) {
             struct nosdk_kafka_thread_ctx *kthread =
                 nosdk_kafka_mgr_make_thread(ctx->root_dir);
-            kthread->k = nosdk_kafka_mgr_get_producer();
+            kthread->k = nosdk_kafka_mgr_process_producer(ctx->process_id);
+            kthread->topic = spec.data;
+            if (spec.messaging != NULL) {
+                kthread->framing = spec.messaging->framing;
+                kthread->headers = spec.messaging->headers;
+            }
             pthread_create(
                 &kthread->thread, NULL, nosdk_kafka_producer_thread, kthread);
         } else {
             struct nosdk_http_handler handler = {
                 .prefix = "/msg",
                 .handler = nosdk_kafka_handler,
+                .ctx = &ctx->process_id,
             };
 
             if (nosdk_http_server_handle(ctx->server, handler) != 0) {
@@ -136,5 +197,6 @@ void nosdk_io_mgr_teardown(struct nosdk_io_mgr *mgr) {
     }
 
     nosdk_kafka_mgr_teardown();
+    nosdk_pg_teardown();
     s3_deinit();
 }
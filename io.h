@@ -19,6 +19,12 @@ struct nosdk_io_spec {
     enum nosdk_io_kind kind;
     enum nosdk_messaging_interface interface;
     char *data;
+
+    // messaging options for kafka topics
+    struct nosdk_messaging_config *messaging;
+
+    // the process the topic belongs to
+    struct nosdk_process_config *process;
 };
 
 struct nosdk_io_process_ctx {
@@ -41,6 +47,12 @@ typedef struct nosdk_io_mgr nosdk_io_mgr;
 
 int nosdk_io_mgr_init(struct nosdk_io_mgr *mgr);
 
+// check the client settings in the config, which is kept until teardown
+int nosdk_io_mgr_configure(struct nosdk_io_mgr *mgr, struct nosdk_config *c);
+
+// create the resources the config refers to before any process starts
+int nosdk_io_mgr_provision(struct nosdk_io_mgr *mgr, struct nosdk_config *c);
+
 struct nosdk_io_process_ctx *nosdk_io_process_ctx_new(struct nosdk_io_mgr *mgr);
 
 int nosdk_io_mgr_setup(
@@ -1,3 +1,8 @@
+#ifdef __linux__
+// vmsplice
+#define _GNU_SOURCE
+#endif
+
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
@@ -9,11 +14,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include "http.h"
 #include "kafka.h"
+#include "metrics.h"
 #include "util.h"
 
 struct nosdk_kafka_mgr *kafka_mgr;
@@ -25,10 +33,308 @@ int nosdk_kafka_mgr_init() {
 
     kafka_mgr = malloc(sizeof(struct nosdk_kafka_mgr));
     memset(kafka_mgr, 0, sizeof(struct nosdk_kafka_mgr));
+    pthread_mutex_init(&kafka_mgr->admin_lock, NULL);
+
+    char *backend = getenv("NOSDK_KAFKA_BACKEND");
+    if (backend == NULL || strlen(backend) == 0 ||
+        strcmp(backend, "kafka") == 0) {
+        kafka_mgr->backend = BACKEND_KAFKA;
+        return 0;
+    }
+    if (strcmp(backend, "local") != 0) {
+        fprintf(stderr, "unknown kafka backend: %s\n", backend);
+        return 1;
+    }
+
+    kafka_mgr->backend = BACKEND_LOCAL;
+    char *log_dir = getenv("NOSDK_LOG_DIR");
+    kafka_mgr->log_dir =
+        strdup(log_dir != NULL && strlen(log_dir) > 0 ? log_dir : "nosdk-log");
+    if (mkdir(kafka_mgr->log_dir, 0755) != 0 && errno != EEXIST) {
+        fprintf(
+            stderr, "failed to create log dir %s: %s\n", kafka_mgr->log_dir,
+            strerror(errno));
+        return 1;
+    }
+
+    int flush_ms = TOPICLOG_FLUSH_INTERVAL_MS;
+    char *flush = getenv("NOSDK_LOG_FLUSH_MS");
+    if (flush != NULL && atoi(flush) > 0) {
+        flush_ms = atoi(flush);
+    }
+
+    return nosdk_topiclog_start_flusher(flush_ms);
+}
+
+int nosdk_kafka_local() { return kafka_mgr->backend == BACKEND_LOCAL; }
+
+// properties nosdk sets itself and relies on
+static const char *kafka_reserved_properties[] = {
+    "group.id",
+    "client.id",
+    "enable.auto.commit",
+    "partition.assignment.strategy",
+    "transactional.id",
+};
+
+int nosdk_kafka_reserved_property(const char *name) {
+    int n = sizeof(kafka_reserved_properties) / sizeof(char *);
+    for (int i = 0; i < n; i++) {
+        if (strcmp(kafka_reserved_properties[i], name) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// add a setting to a topic's settings. a name the topic already set is
+// overwritten, so later sources win over earlier ones.
+void nosdk_kafka_setting_add(
+    struct nosdk_kafka_setting *settings,
+    int *n,
+    const char *topic,
+    const char *name,
+    const char *value) {
+    for (int i = 0; i < *n; i++) {
+        if (strcmp(settings[i].name, name) == 0) {
+            snprintf(settings[i].value, sizeof(settings[i].value), "%s", value);
+            return;
+        }
+    }
+
+    struct nosdk_kafka_setting *s = &settings[*n];
+    s->topic = topic;
+    s->name = name;
+    snprintf(s->value, sizeof(s->value), "%s", value);
+
+    char errstr[512];
+    rd_kafka_topic_conf_t *tconf = rd_kafka_topic_conf_new();
+    s->topic_level = rd_kafka_topic_conf_set(
+                         tconf, name, value, errstr, sizeof(errstr)) !=
+                     RD_KAFKA_CONF_UNKNOWN;
+    rd_kafka_topic_conf_destroy(tconf);
+
+    (*n)++;
+}
+
+void nosdk_kafka_setting_add_int(
+    struct nosdk_kafka_setting *settings,
+    int *n,
+    const char *topic,
+    const char *name,
+    int value) {
+    if (value > 0) {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%d", value);
+        nosdk_kafka_setting_add(settings, n, topic, name, buf);
+    }
+}
 
+// the settings of a topic for clients of the given type: its tuning block,
+// then its passthrough properties, which override the tuning block when
+// they name the same property. settings must have room for
+// KAFKA_TUNING_MAX + properties_count entries.
+int nosdk_kafka_topic_settings(
+    struct nosdk_messaging_config *m,
+    enum nosdk_kafka_type type,
+    struct nosdk_kafka_setting *settings) {
+    int n = 0;
+
+    if (type == PRODUCER && m->producer != NULL) {
+        struct nosdk_producer_tuning *p = m->producer;
+        if (p->compression != NULL) {
+            nosdk_kafka_setting_add(
+                settings, &n, m->topic, "compression.type", p->compression);
+        }
+        nosdk_kafka_setting_add_int(
+            settings, &n, m->topic, "linger.ms", p->linger_ms);
+        nosdk_kafka_setting_add_int(
+            settings, &n, m->topic, "batch.size", p->batch_size);
+        if (p->idempotence) {
+            nosdk_kafka_setting_add(
+                settings, &n, m->topic, "enable.idempotence", "true");
+        }
+        if (p->acks != NULL) {
+            nosdk_kafka_setting_add(settings, &n, m->topic, "acks", p->acks);
+        }
+    }
+
+    if (type == CONSUMER && m->consumer != NULL) {
+        struct nosdk_consumer_tuning *c = m->consumer;
+        nosdk_kafka_setting_add_int(
+            settings, &n, m->topic, "fetch.min.bytes", c->fetch_min_bytes);
+        nosdk_kafka_setting_add_int(
+            settings, &n, m->topic, "fetch.wait.max.ms",
+            c->fetch_wait_max_ms);
+        nosdk_kafka_setting_add_int(
+            settings, &n, m->topic, "max.partition.fetch.bytes",
+            c->max_partition_fetch_bytes);
+        nosdk_kafka_setting_add_int(
+            settings, &n, m->topic, "session.timeout.ms",
+            c->session_timeout_ms);
+    }
+
+    for (unsigned i = 0; i < m->properties_count; i++) {
+        nosdk_kafka_setting_add(
+            settings, &n, m->topic, m->properties[i].name,
+            m->properties[i].value);
+    }
+
+    return n;
+}
+
+// the settings of every produced topic, for the shared producer. the
+// result is to be freed.
+int nosdk_kafka_producer_settings(struct nosdk_kafka_setting **settings) {
+    struct nosdk_config *config = kafka_mgr->config;
+    *settings = NULL;
+    if (config == NULL) {
+        return 0;
+    }
+
+    int capacity = 0;
+    for (unsigned i = 0; i < config->processes_count; i++) {
+        struct nosdk_process_config *proc = &config->processes[i];
+        for (unsigned j = 0; j < proc->produce_count; j++) {
+            capacity += KAFKA_TUNING_MAX + proc->produce[j].properties_count;
+        }
+    }
+    if (capacity == 0) {
+        return 0;
+    }
+
+    *settings = malloc(sizeof(struct nosdk_kafka_setting) * capacity);
+    int n = 0;
+    for (unsigned i = 0; i < config->processes_count; i++) {
+        struct nosdk_process_config *proc = &config->processes[i];
+        for (unsigned j = 0; j < proc->produce_count; j++) {
+            n += nosdk_kafka_topic_settings(
+                &proc->produce[j], PRODUCER, &(*settings)[n]);
+        }
+    }
+    return n;
+}
+
+// set a setting on a client conf, or on a topic conf when tconf is given
+int nosdk_kafka_conf_set(
+    rd_kafka_conf_t *conf,
+    rd_kafka_topic_conf_t *tconf,
+    struct nosdk_kafka_setting *s) {
+    char errstr[512];
+    rd_kafka_conf_res_t res =
+        tconf != NULL ? rd_kafka_topic_conf_set(
+                            tconf, s->name, s->value, errstr, sizeof(errstr))
+                      : rd_kafka_conf_set(
+                            conf, s->name, s->value, errstr, sizeof(errstr));
+    if (res != RD_KAFKA_CONF_OK) {
+        fprintf(stderr, "topic %s: %s\n", s->topic, errstr);
+        return -1;
+    }
     return 0;
 }
 
+// check a topic's settings against a scratch configuration
+int nosdk_kafka_check_settings(
+    struct nosdk_messaging_config *m, enum nosdk_kafka_type type) {
+    struct nosdk_kafka_setting *settings = malloc(
+        sizeof(struct nosdk_kafka_setting) *
+        (KAFKA_TUNING_MAX + m->properties_count));
+    int n = nosdk_kafka_topic_settings(m, type, settings);
+
+    rd_kafka_conf_t *conf = rd_kafka_conf_new();
+    rd_kafka_topic_conf_t *tconf = rd_kafka_topic_conf_new();
+    int ret = 0;
+    for (int i = 0; i < n; i++) {
+        if (nosdk_kafka_reserved_property(settings[i].name)) {
+            fprintf(
+                stderr, "topic %s: %s is set by nosdk\n", m->topic,
+                settings[i].name);
+            ret = -1;
+            continue;
+        }
+        if (nosdk_kafka_conf_set(
+                conf, settings[i].topic_level ? tconf : NULL,
+                &settings[i]) != 0) {
+            ret = -1;
+        }
+    }
+
+    rd_kafka_topic_conf_destroy(tconf);
+    rd_kafka_conf_destroy(conf);
+    free(settings);
+    return ret;
+}
+
+// the most clients a config can create: the shared producer, a
+// transactional producer per process, and per consumed topic a consumer
+// and one per retry tier
+int nosdk_kafka_mgr_clients_needed(struct nosdk_config *config) {
+    int needed = 1;
+    for (unsigned i = 0; i < config->processes_count; i++) {
+        struct nosdk_process_config *proc = &config->processes[i];
+        needed += proc->transactional;
+        for (unsigned j = 0; j < proc->consume_count; j++) {
+            int tiers = proc->consume[j].retries;
+            tiers = tiers < 0 ? 0 : tiers;
+            needed += 1 + (tiers < KAFKA_RETRY_MAX ? tiers : KAFKA_RETRY_MAX);
+        }
+    }
+    return needed;
+}
+
+int nosdk_kafka_mgr_configure(struct nosdk_config *config) {
+    int ret = 0;
+
+    // fail before any process starts rather than part way through
+    int needed = nosdk_kafka_mgr_clients_needed(config);
+    if (needed > MAX_KAFKA) {
+        fprintf(
+            stderr,
+            "the config needs up to %d kafka clients, more than the %d "
+            "supported\n",
+            needed, MAX_KAFKA);
+        ret = -1;
+    }
+    for (unsigned i = 0; i < config->processes_count; i++) {
+        struct nosdk_process_config *proc = &config->processes[i];
+        for (unsigned j = 0; j < proc->consume_count; j++) {
+            if (nosdk_kafka_check_settings(&proc->consume[j], CONSUMER) != 0) {
+                ret = -1;
+            }
+        }
+        for (unsigned j = 0; j < proc->produce_count; j++) {
+            if (nosdk_kafka_check_settings(&proc->produce[j], PRODUCER) != 0) {
+                ret = -1;
+            }
+        }
+    }
+    kafka_mgr->config = config;
+
+    // one producer serves every topic, so its client settings must agree
+    // across topics, and the settings of a topic across processes
+    struct nosdk_kafka_setting *settings;
+    int n = nosdk_kafka_producer_settings(&settings);
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < i; j++) {
+            struct nosdk_kafka_setting *a = &settings[i];
+            struct nosdk_kafka_setting *b = &settings[j];
+            if (strcmp(a->name, b->name) != 0 ||
+                strcmp(a->value, b->value) == 0 ||
+                (a->topic_level && strcmp(a->topic, b->topic) != 0)) {
+                continue;
+            }
+            fprintf(
+                stderr, "producer %s is %s for %s but %s for %s\n", a->name,
+                b->value, b->topic, a->value, a->topic);
+            ret = -1;
+            break;
+        }
+    }
+    free(settings);
+
+    return ret;
+}
+
 int nosdk_kafka_mgr_add_kafka(
     struct nosdk_kafka_mgr *mgr, struct nosdk_kafka k) {
     if (mgr->num_kafkas >= MAX_KAFKA) {
@@ -36,11 +342,16 @@ int nosdk_kafka_mgr_add_kafka(
         return 1;
     }
 
-    int ret = nosdk_kafka_init(&k);
+    // initialize in place, producers hand their address to a poll thread.
+    // clients are allocated one by one so their addresses stay put.
+    struct nosdk_kafka *client = malloc(sizeof(struct nosdk_kafka));
+    *client = k;
+    int ret = nosdk_kafka_init(client);
     if (ret != 0) {
+        free(client);
         return ret;
     }
-    mgr->kafkas[mgr->num_kafkas] = k;
+    mgr->kafkas[mgr->num_kafkas] = client;
     mgr->num_kafkas++;
     return 0;
 }
@@ -55,6 +366,13 @@ struct nosdk_kafka_thread_ctx *nosdk_kafka_mgr_make_thread(char *root_dir) {
     kthread->root_dir = root_dir;
     kthread->thread = 0;
     kthread->k = NULL;
+    kthread->topic = NULL;
+    kthread->framing = FRAMING_NONE;
+    kthread->headers = HEADERS_FILE;
+    kthread->splice = 0;
+    kthread->written = 0;
+    kthread->spliced_head = 0;
+    kthread->num_spliced = 0;
 
     kafka_mgr->threads[kafka_mgr->num_threads] = kthread;
     kafka_mgr->num_threads++;
@@ -62,12 +380,13 @@ struct nosdk_kafka_thread_ctx *nosdk_kafka_mgr_make_thread(char *root_dir) {
     return kthread;
 }
 
-struct nosdk_kafka *nosdk_kafka_mgr_get_consumer(char *topic) {
+struct nosdk_kafka *nosdk_kafka_mgr_get_consumer(char *topic, int replica) {
 
     for (int i = 0; i < kafka_mgr->num_kafkas; i++) {
-        if (strcmp(kafka_mgr->kafkas[i].topic, topic) == 0) {
-            if (kafka_mgr->kafkas[i].type == CONSUMER) {
-                return &kafka_mgr->kafkas[i];
+        if (strcmp(kafka_mgr->kafkas[i]->topic, topic) == 0) {
+            if (kafka_mgr->kafkas[i]->type == CONSUMER &&
+                kafka_mgr->kafkas[i]->replica == replica) {
+                return kafka_mgr->kafkas[i];
             }
         }
     }
@@ -75,40 +394,237 @@ struct nosdk_kafka *nosdk_kafka_mgr_get_consumer(char *topic) {
     return NULL;
 }
 
-int nosdk_kafka_mgr_kafka_subscribe(char *topic) {
-    if (nosdk_kafka_mgr_get_consumer(topic) != NULL) {
+// the name of a retry tier of topic, or of its dead-letter topic for the
+// tier past the last one
+void nosdk_kafka_retry_topic(
+    char *buf, size_t size, const char *topic, int tier, int retries) {
+    if (tier > retries) {
+        snprintf(buf, size, "%s.dlq", topic);
+    } else {
+        snprintf(buf, size, "%s.retry.%d", topic, tier);
+    }
+}
+
+int nosdk_kafka_mgr_kafka_subscribe(
+    char *topic, int replica, struct nosdk_messaging_config *messaging) {
+    if (nosdk_kafka_mgr_get_consumer(topic, replica) != NULL) {
         return 0;
     }
 
     struct nosdk_kafka k = {
         .type = CONSUMER,
         .topic = strdup(topic),
+        .replica = replica,
+        .messaging = messaging,
+        .txn = nosdk_kafka_mgr_get_txn(replica),
     };
+    if (messaging != NULL && messaging->retries > 0) {
+        k.retries = messaging->retries < KAFKA_RETRY_MAX ? messaging->retries
+                                                         : KAFKA_RETRY_MAX;
+        k.retry_backoff_ms = messaging->retry_backoff_ms > 0
+                                 ? messaging->retry_backoff_ms
+                                 : KAFKA_RETRY_BACKOFF_MS;
+    }
 
-    return nosdk_kafka_mgr_add_kafka(kafka_mgr, k);
+    int ret = nosdk_kafka_mgr_add_kafka(kafka_mgr, k);
+    if (ret != 0 || k.retries == 0) {
+        return ret;
+    }
+
+    // every tier is consumed by the replica itself and republished to by
+    // the shared producer, down to the dead-letter topic
+    struct nosdk_kafka *consumer = nosdk_kafka_mgr_get_consumer(topic, replica);
+    for (int tier = 1; tier <= k.retries + 1; tier++) {
+        char name[512];
+        nosdk_kafka_retry_topic(name, sizeof(name), topic, tier, k.retries);
+
+        ret = nosdk_kafka_ensure_topic_exists(name);
+        if (ret == 0) {
+            ret = nosdk_kafka_mgr_kafka_produce(name, replica);
+        }
+        if (ret != 0 || tier > k.retries) {
+            break;
+        }
+
+        struct nosdk_kafka t = {
+            .type = CONSUMER,
+            .topic = strdup(name),
+            .replica = replica,
+            .retries = k.retries,
+            .retry_backoff_ms = k.retry_backoff_ms,
+            .tier = tier,
+            .delay_ms = k.retry_backoff_ms << (tier - 1),
+            .retry_of = consumer,
+            .messaging = messaging,
+            .txn = consumer->txn,
+        };
+        ret = nosdk_kafka_mgr_add_kafka(kafka_mgr, t);
+        if (ret != 0) {
+            break;
+        }
+    }
+
+    return ret;
 }
 
 struct nosdk_kafka *nosdk_kafka_mgr_get_producer() {
     for (int i = 0; i < kafka_mgr->num_kafkas; i++) {
-        if (kafka_mgr->kafkas[i].type == PRODUCER) {
-            return &kafka_mgr->kafkas[i];
+        if (kafka_mgr->kafkas[i]->type == PRODUCER &&
+            !kafka_mgr->kafkas[i]->transactional) {
+            return kafka_mgr->kafkas[i];
+        }
+    }
+    return NULL;
+}
+
+struct nosdk_kafka *nosdk_kafka_mgr_get_txn(int replica) {
+    for (int i = 0; i < kafka_mgr->num_kafkas; i++) {
+        if (kafka_mgr->kafkas[i]->type == PRODUCER &&
+            kafka_mgr->kafkas[i]->transactional &&
+            kafka_mgr->kafkas[i]->process_id == replica) {
+            return kafka_mgr->kafkas[i];
         }
     }
     return NULL;
 }
 
-int nosdk_kafka_mgr_kafka_produce(char *topic) {
-    if (nosdk_kafka_mgr_get_producer() != NULL) {
+struct nosdk_kafka *nosdk_kafka_mgr_process_producer(int replica) {
+    struct nosdk_kafka *producer = nosdk_kafka_mgr_get_txn(replica);
+    return producer != NULL ? producer : nosdk_kafka_mgr_get_producer();
+}
+
+int nosdk_kafka_mgr_kafka_transactional(int replica, int interval_ms) {
+    if (nosdk_kafka_mgr_get_txn(replica) != NULL) {
+        return 0;
+    }
+    if (nosdk_kafka_local()) {
+        printf("transactions are not supported by the local backend\n");
         return 0;
     }
+
+    char topic[64];
+    snprintf(topic, sizeof(topic), "txn-%d", replica);
     struct nosdk_kafka k = {
         .type = PRODUCER,
         .topic = strdup(topic),
+        .transactional = 1,
+        .process_id = replica,
+        .txn_interval_ms =
+            interval_ms > 0 ? interval_ms : KAFKA_TXN_INTERVAL_MS,
     };
-
     return nosdk_kafka_mgr_add_kafka(kafka_mgr, k);
 }
 
+int nosdk_kafka_mgr_kafka_produce(char *topic, int replica) {
+    // a single producer client serves every topic, except for processes
+    // that have their own transactional one
+    struct nosdk_kafka *producer = nosdk_kafka_mgr_process_producer(replica);
+    if (producer == NULL) {
+        struct nosdk_kafka k = {
+            .type = PRODUCER,
+            .topic = strdup(topic),
+        };
+
+        int ret = nosdk_kafka_mgr_add_kafka(kafka_mgr, k);
+        if (ret != 0) {
+            return ret;
+        }
+        producer = nosdk_kafka_mgr_get_producer();
+    }
+
+    if (nosdk_kafka_producer_topic(producer, topic) == NULL) {
+        return 1;
+    }
+
+    return 0;
+}
+
+// create a topic handle with the topic's topic-level settings
+rd_kafka_topic_t *nosdk_kafka_producer_topic_new(
+    struct nosdk_kafka *producer, const char *topic) {
+    struct nosdk_kafka_setting *settings;
+    int n = nosdk_kafka_producer_settings(&settings);
+
+    rd_kafka_topic_conf_t *tconf = rd_kafka_topic_conf_new();
+    for (int i = 0; i < n; i++) {
+        if (settings[i].topic_level && strcmp(settings[i].topic, topic) == 0) {
+            nosdk_kafka_conf_set(NULL, tconf, &settings[i]);
+        }
+    }
+    free(settings);
+
+    // the handle takes the topic conf
+    return rd_kafka_topic_new(producer->rk, topic, tconf);
+}
+
+struct nosdk_kafka_topic *
+nosdk_kafka_producer_topic(struct nosdk_kafka *producer, const char *topic) {
+    struct nosdk_kafka_topic *t = NULL;
+
+    pthread_rwlock_rdlock(&producer->topics_lock);
+    for (int i = 0; i < producer->num_topics; i++) {
+        if (strcmp(producer->topics[i]->name, topic) == 0) {
+            t = producer->topics[i];
+            break;
+        }
+    }
+    pthread_rwlock_unlock(&producer->topics_lock);
+
+    if (t != NULL) {
+        return t;
+    }
+
+    pthread_rwlock_wrlock(&producer->topics_lock);
+
+    // another thread may have created it while we waited for the lock
+    for (int i = 0; i < producer->num_topics; i++) {
+        if (strcmp(producer->topics[i]->name, topic) == 0) {
+            t = producer->topics[i];
+            pthread_rwlock_unlock(&producer->topics_lock);
+            return t;
+        }
+    }
+
+    rd_kafka_topic_t *rkt = NULL;
+    struct nosdk_topiclog *log = NULL;
+    if (nosdk_kafka_local()) {
+        log = nosdk_topiclog_open(
+            kafka_mgr->log_dir, topic, KAFKA_DEFAULT_PARTITIONS);
+        if (log == NULL) {
+            pthread_rwlock_unlock(&producer->topics_lock);
+            return NULL;
+        }
+    } else {
+        rkt = nosdk_kafka_producer_topic_new(producer, topic);
+        if (rkt == NULL) {
+            fprintf(
+                stderr, "failed to create topic handle %s: %s\n", topic,
+                rd_kafka_err2str(rd_kafka_last_error()));
+            pthread_rwlock_unlock(&producer->topics_lock);
+            return NULL;
+        }
+    }
+
+    if (producer->num_topics == producer->topics_capacity) {
+        producer->topics_capacity =
+            producer->topics_capacity == 0 ? 8 : producer->topics_capacity * 2;
+        producer->topics = realloc(
+            producer->topics,
+            sizeof(struct nosdk_kafka_topic *) * producer->topics_capacity);
+    }
+
+    // entries are allocated one by one, callers keep them past a realloc
+    t = malloc(sizeof(struct nosdk_kafka_topic));
+    t->name = strdup(topic);
+    t->rkt = rkt;
+    t->log = log;
+    producer->topics[producer->num_topics] = t;
+    producer->num_topics++;
+
+    pthread_rwlock_unlock(&producer->topics_lock);
+    return t;
+}
+
 void kafka_conf_must_set(
     rd_kafka_conf_t *conf,
     const char *property,
@@ -126,90 +642,202 @@ void kafka_conf_must_set(
     }
 }
 
-int nosdk_kafka_ensure_topic_exists(const char *topic) {
-    rd_kafka_conf_t *conf = rd_kafka_conf_new();
-    char errstr[512];
+int nosdk_kafka_stats_key(char *json, int key_start, int key_len, char *key) {
+    return key_len == (int)strlen(key) &&
+           memcmp(&json[key_start], key, key_len) == 0;
+}
 
-    kafka_conf_must_set(
-        conf, "bootstrap.servers", "NOSDK_KAFKA_BOOTSTRAP_SERVERS",
-        "0.0.0.0:19092");
+// publish the average and the percentiles of a rolling window, one series
+// per statistic
+void nosdk_kafka_stats_window(
+    struct nosdk_metric_set *set,
+    const char *name,
+    const char *help,
+    char *json,
+    int len,
+    char *labels) {
+    struct json_object_iter iter = {.data = json, .data_len = len};
+    int ks, kl, vs, vl;
 
-    // Only show warnings/errors if debug flag is set, otherwise be silent
-    if (rd_kafka_conf_set(
-            conf, "log_level", nosdk_debug_flag ? "5" : "0", errstr,
-            sizeof(errstr)) != RD_KAFKA_CONF_OK) {
-        fprintf(stderr, "config error: %s\n", errstr);
+    while (json_object_next_member(&iter, &ks, &kl, &vs, &vl)) {
+        if (nosdk_kafka_stats_key(json, ks, kl, "avg") ||
+            nosdk_kafka_stats_key(json, ks, kl, "p50") ||
+            nosdk_kafka_stats_key(json, ks, kl, "p95") ||
+            nosdk_kafka_stats_key(json, ks, kl, "p99")) {
+            nosdk_metric_set_add(
+                set, name, help, strtod(&json[vs], NULL),
+                "%s,stat=\"%.*s\"", labels, kl, &json[ks]);
+        }
     }
+}
 
-    rd_kafka_t *admin_client =
-        rd_kafka_new(RD_KAFKA_PRODUCER, conf, errstr, sizeof(errstr));
-    if (!admin_client) {
-        fprintf(stderr, "failed to create admin client: %s\n", errstr);
-        return 1;
+void nosdk_kafka_stats_brokers(
+    struct nosdk_metric_set *set, const char *client, char *json, int len) {
+    struct json_object_iter brokers = {.data = json, .data_len = len};
+    int bks, bkl, bvs, bvl;
+
+    while (json_object_next_member(&brokers, &bks, &bkl, &bvs, &bvl)) {
+        char labels[512];
+        snprintf(
+            labels, sizeof(labels), "client=\"%s\",broker=\"%.*s\"", client,
+            bkl, &json[bks]);
+
+        char *broker = &json[bvs];
+        struct json_object_iter iter = {.data = broker, .data_len = bvl};
+        int ks, kl, vs, vl;
+        while (json_object_next_member(&iter, &ks, &kl, &vs, &vl)) {
+            if (nosdk_kafka_stats_key(broker, ks, kl, "waitresp_cnt")) {
+                nosdk_metric_set_add(
+                    set, "nosdk_kafka_broker_inflight_requests",
+                    "Requests sent to the broker awaiting a response",
+                    strtod(&broker[vs], NULL), "%s", labels);
+            } else if (nosdk_kafka_stats_key(broker, ks, kl, "outbuf_cnt")) {
+                nosdk_metric_set_add(
+                    set, "nosdk_kafka_broker_queued_requests",
+                    "Requests waiting to be sent to the broker",
+                    strtod(&broker[vs], NULL), "%s", labels);
+            } else if (nosdk_kafka_stats_key(broker, ks, kl, "rtt")) {
+                nosdk_kafka_stats_window(
+                    set, "nosdk_kafka_broker_rtt_us",
+                    "Broker round trip time in microseconds", &broker[vs], vl,
+                    labels);
+            }
+        }
     }
+}
 
-    rd_kafka_NewTopic_t *new_topic =
-        rd_kafka_NewTopic_new(topic, 1, 1, errstr, sizeof(errstr));
-    if (!new_topic) {
-        fprintf(stderr, "failed to create NewTopic: %s\n", errstr);
-        rd_kafka_destroy(admin_client);
-        return 1;
+void nosdk_kafka_stats_partitions(
+    struct nosdk_metric_set *set, char *json, int len, char *topic_labels) {
+    struct json_object_iter partitions = {.data = json, .data_len = len};
+    int pks, pkl, pvs, pvl;
+
+    while (json_object_next_member(&partitions, &pks, &pkl, &pvs, &pvl)) {
+        // the internal unassigned partition holds messages not yet
+        // partitioned
+        if (nosdk_kafka_stats_key(json, pks, pkl, "-1")) {
+            continue;
+        }
+
+        char labels[512];
+        snprintf(
+            labels, sizeof(labels), "%s,partition=\"%.*s\"", topic_labels,
+            pkl, &json[pks]);
+
+        char *partition = &json[pvs];
+        struct json_object_iter iter = {.data = partition, .data_len = pvl};
+        int ks, kl, vs, vl;
+        while (json_object_next_member(&iter, &ks, &kl, &vs, &vl)) {
+            double value = strtod(&partition[vs], NULL);
+            if (nosdk_kafka_stats_key(partition, ks, kl, "consumer_lag")) {
+                // -1 until the consumer has a position and a high watermark
+                if (value >= 0) {
+                    nosdk_metric_set_add(
+                        set, "nosdk_kafka_consumer_lag",
+                        "Messages between the consumer position and the "
+                        "partition end",
+                        value, "%s", labels);
+                }
+            } else if (nosdk_kafka_stats_key(partition, ks, kl, "msgq_cnt")) {
+                nosdk_metric_set_add(
+                    set, "nosdk_kafka_partition_queued_messages",
+                    "Messages waiting to be batched for the partition", value,
+                    "%s", labels);
+            } else if (nosdk_kafka_stats_key(
+                           partition, ks, kl, "xmit_msgq_cnt")) {
+                nosdk_metric_set_add(
+                    set, "nosdk_kafka_partition_inflight_messages",
+                    "Messages batched for the partition and ready to send",
+                    value, "%s", labels);
+            } else if (nosdk_kafka_stats_key(partition, ks, kl, "fetchq_cnt")) {
+                nosdk_metric_set_add(
+                    set, "nosdk_kafka_partition_fetched_messages",
+                    "Fetched messages waiting to be consumed", value, "%s",
+                    labels);
+            }
+        }
     }
+}
 
-    rd_kafka_AdminOptions_t *options =
-        rd_kafka_AdminOptions_new(admin_client, RD_KAFKA_ADMIN_OP_CREATETOPICS);
-    rd_kafka_AdminOptions_set_operation_timeout(options, 5000, errstr, sizeof(errstr));
+void nosdk_kafka_stats_topics(
+    struct nosdk_metric_set *set, const char *client, char *json, int len) {
+    struct json_object_iter topics = {.data = json, .data_len = len};
+    int tks, tkl, tvs, tvl;
 
-    rd_kafka_queue_t *queue = rd_kafka_queue_new(admin_client);
-    rd_kafka_CreateTopics(admin_client, &new_topic, 1, options, queue);
+    while (json_object_next_member(&topics, &tks, &tkl, &tvs, &tvl)) {
+        char labels[512];
+        snprintf(
+            labels, sizeof(labels), "client=\"%s\",topic=\"%.*s\"", client,
+            tkl, &json[tks]);
 
-    rd_kafka_event_t *event = rd_kafka_queue_poll(queue, 5000);
-    const rd_kafka_CreateTopics_result_t *result =
-        rd_kafka_event_CreateTopics_result(event);
+        char *topic = &json[tvs];
+        struct json_object_iter iter = {.data = topic, .data_len = tvl};
+        int ks, kl, vs, vl;
+        while (json_object_next_member(&iter, &ks, &kl, &vs, &vl)) {
+            if (nosdk_kafka_stats_key(topic, ks, kl, "batchsize")) {
+                nosdk_kafka_stats_window(
+                    set, "nosdk_kafka_topic_batch_bytes",
+                    "Size of produced batches in bytes", &topic[vs], vl,
+                    labels);
+            } else if (nosdk_kafka_stats_key(topic, ks, kl, "batchcnt")) {
+                nosdk_kafka_stats_window(
+                    set, "nosdk_kafka_topic_batch_messages",
+                    "Messages per produced batch", &topic[vs], vl, labels);
+            } else if (nosdk_kafka_stats_key(topic, ks, kl, "partitions")) {
+                nosdk_kafka_stats_partitions(set, &topic[vs], vl, labels);
+            }
+        }
+    }
+}
 
-    size_t result_cnt;
-    const rd_kafka_topic_result_t **results =
-        rd_kafka_CreateTopics_result_topics(result, &result_cnt);
+// publish the statistics we tune against. the JSON is walked once, level
+// by level, without building a tree. the series replace the ones of the
+// previous report.
+int nosdk_kafka_stats_cb(
+    rd_kafka_t *rk, char *json, size_t json_len, void *opaque) {
+    const char *client = rd_kafka_name(rk);
+    struct nosdk_metric_set *set = nosdk_metric_set_new(client);
+    char labels[256];
+    snprintf(labels, sizeof(labels), "client=\"%s\"", client);
 
-    int ret = 0;
-    if (result_cnt > 0) {
-        rd_kafka_resp_err_t err = rd_kafka_topic_result_error(results[0]);
-        if (err != RD_KAFKA_RESP_ERR_NO_ERROR &&
-            err != RD_KAFKA_RESP_ERR_TOPIC_ALREADY_EXISTS) {
-            fprintf(
-                stderr, "failed to create topic %s: %s\n", topic,
-                rd_kafka_err2str(err));
-            ret = 1;
+    struct json_object_iter iter = {.data = json, .data_len = (int)json_len};
+    int ks, kl, vs, vl;
+    while (json_object_next_member(&iter, &ks, &kl, &vs, &vl)) {
+        if (nosdk_kafka_stats_key(json, ks, kl, "msg_cnt")) {
+            nosdk_metric_set_add(
+                set, "nosdk_kafka_producer_queue_messages",
+                "Messages in the producer queue", strtod(&json[vs], NULL),
+                "%s", labels);
+        } else if (nosdk_kafka_stats_key(json, ks, kl, "msg_size")) {
+            nosdk_metric_set_add(
+                set, "nosdk_kafka_producer_queue_bytes",
+                "Bytes of messages in the producer queue",
+                strtod(&json[vs], NULL), "%s", labels);
+        } else if (nosdk_kafka_stats_key(json, ks, kl, "brokers")) {
+            nosdk_kafka_stats_brokers(set, client, &json[vs], vl);
+        } else if (nosdk_kafka_stats_key(json, ks, kl, "topics")) {
+            nosdk_kafka_stats_topics(set, client, &json[vs], vl);
         }
     }
 
-    rd_kafka_event_destroy(event);
-    rd_kafka_queue_destroy(queue);
-    rd_kafka_AdminOptions_destroy(options);
-    rd_kafka_NewTopic_destroy(new_topic);
-    rd_kafka_destroy(admin_client);
+    nosdk_metrics_publish(set);
 
-    return ret;
+    // librdkafka frees the JSON
+    return 0;
 }
 
-int nosdk_kafka_consumer_init(struct nosdk_kafka *consumer) {
-    rd_kafka_conf_t *conf;
-    rd_kafka_topic_partition_list_t *subscription;
-    char errstr[512];
-
-    // Ensure topic exists before creating consumer
-    if (nosdk_kafka_ensure_topic_exists(consumer->topic) != 0) {
-        fprintf(stderr, "failed to ensure topic exists: %s\n", consumer->topic);
-        return 1;
+// the admin client is created on first use and kept for later topic
+// creations. call with admin_lock held.
+rd_kafka_t *nosdk_kafka_admin() {
+    if (kafka_mgr->admin != NULL) {
+        return kafka_mgr->admin;
     }
 
-    conf = rd_kafka_conf_new();
+    rd_kafka_conf_t *conf = rd_kafka_conf_new();
+    char errstr[512];
 
     kafka_conf_must_set(
         conf, "bootstrap.servers", "NOSDK_KAFKA_BOOTSTRAP_SERVERS",
         "0.0.0.0:19092");
-    kafka_conf_must_set(
-        conf, "group.id", "NOSDK_KAFKA_GROUP_ID", "nosdk-default-group");
 
     // Only show warnings/errors if debug flag is set, otherwise be silent
     if (rd_kafka_conf_set(
@@ -218,394 +846,3261 @@ int nosdk_kafka_consumer_init(struct nosdk_kafka *consumer) {
         fprintf(stderr, "config error: %s\n", errstr);
     }
 
-    if (rd_kafka_conf_set(
-            conf, "auto.offset.reset", "earliest", errstr, sizeof(errstr)) !=
-        RD_KAFKA_CONF_OK) {
+    kafka_mgr->admin =
+        rd_kafka_new(RD_KAFKA_PRODUCER, conf, errstr, sizeof(errstr));
+    if (kafka_mgr->admin == NULL) {
+        fprintf(stderr, "failed to create admin client: %s\n", errstr);
+    }
 
-        fprintf(stderr, "config error: %s\n", errstr);
+    return kafka_mgr->admin;
+}
+
+// call with admin_lock held
+int nosdk_kafka_topic_known(const char *topic) {
+    for (int i = 0; i < kafka_mgr->num_known_topics; i++) {
+        if (strcmp(kafka_mgr->known_topics[i], topic) == 0) {
+            return 1;
+        }
     }
-    if (rd_kafka_conf_set(
-            conf, "enable.auto.commit", "false", errstr, sizeof(errstr)) !=
-        RD_KAFKA_CONF_OK) {
+    return 0;
+}
 
-        fprintf(stderr, "config error: %s\n", errstr);
+// call with admin_lock held
+void nosdk_kafka_topic_remember(const char *topic) {
+    if (nosdk_kafka_topic_known(topic)) {
+        return;
     }
 
-    consumer->rk =
-        rd_kafka_new(RD_KAFKA_CONSUMER, conf, errstr, sizeof(errstr));
-    if (!consumer->rk) {
-        fprintf(stderr, "failed to create consumer: %s\n", errstr);
-        return 1;
+    if (kafka_mgr->num_known_topics == kafka_mgr->known_topics_capacity) {
+        kafka_mgr->known_topics_capacity =
+            kafka_mgr->known_topics_capacity == 0
+                ? 8
+                : kafka_mgr->known_topics_capacity * 2;
+        kafka_mgr->known_topics = realloc(
+            kafka_mgr->known_topics,
+            sizeof(char *) * kafka_mgr->known_topics_capacity);
     }
+    kafka_mgr->known_topics[kafka_mgr->num_known_topics] = strdup(topic);
+    kafka_mgr->num_known_topics++;
+}
 
-    // subscribe to topics
-    subscription = rd_kafka_topic_partition_list_new(1);
-    rd_kafka_topic_partition_t *partition = rd_kafka_topic_partition_list_add(
-        subscription, consumer->topic, RD_KAFKA_PARTITION_UA);
+// create topics with a single CreateTopics request and remember the ones
+// that now exist. call with admin_lock held.
+int nosdk_kafka_create_topics(rd_kafka_NewTopic_t **new_topics, int count) {
+    char errstr[512];
 
-    if (partition->err) {
-        printf("subscription error: %s\n", rd_kafka_err2str(partition->err));
-        return -1;
+    rd_kafka_t *admin = nosdk_kafka_admin();
+    if (admin == NULL) {
+        return 1;
     }
 
-    nosdk_debugf(
-        "topic: %s partition: %d, offset: %" PRId64 "\n", consumer->topic,
-        partition->partition, partition->offset);
+    rd_kafka_AdminOptions_t *options =
+        rd_kafka_AdminOptions_new(admin, RD_KAFKA_ADMIN_OP_CREATETOPICS);
+    rd_kafka_AdminOptions_set_operation_timeout(
+        options, KAFKA_ADMIN_TIMEOUT_MS, errstr, sizeof(errstr));
 
-    rd_kafka_resp_err_t err = rd_kafka_subscribe(consumer->rk, subscription);
-    if (err) {
+    rd_kafka_queue_t *queue = rd_kafka_queue_new(admin);
+    rd_kafka_CreateTopics(admin, new_topics, count, options, queue);
+
+    int ret = 0;
+    rd_kafka_event_t *event =
+        rd_kafka_queue_poll(queue, KAFKA_ADMIN_TIMEOUT_MS + 1000);
+    const rd_kafka_CreateTopics_result_t *result =
+        event != NULL ? rd_kafka_event_CreateTopics_result(event) : NULL;
+    if (result == NULL) {
         fprintf(
-            stderr, "failed to subscribe to %s: %s\n", consumer->topic,
-            rd_kafka_err2str(err));
+            stderr, "failed to create topics: %s\n",
+            event != NULL ? rd_kafka_event_error_string(event) : "timed out");
+        ret = 1;
+    } else {
+        size_t result_cnt;
+        const rd_kafka_topic_result_t **results =
+            rd_kafka_CreateTopics_result_topics(result, &result_cnt);
+
+        for (size_t i = 0; i < result_cnt; i++) {
+            const char *name = rd_kafka_topic_result_name(results[i]);
+            rd_kafka_resp_err_t err = rd_kafka_topic_result_error(results[i]);
+            if (err != RD_KAFKA_RESP_ERR_NO_ERROR &&
+                err != RD_KAFKA_RESP_ERR_TOPIC_ALREADY_EXISTS) {
+                fprintf(
+                    stderr, "failed to create topic %s: %s\n", name,
+                    rd_kafka_err2str(err));
+                ret = 1;
+                continue;
+            }
+            nosdk_kafka_topic_remember(name);
+        }
+    }
+
+    if (event != NULL) {
+        rd_kafka_event_destroy(event);
+    }
+    rd_kafka_queue_destroy(queue);
+    rd_kafka_AdminOptions_destroy(options);
+
+    return ret;
+}
+
+// add topic to the batch unless it is already in it, keeping the largest
+// partition count and replication factor asked for
+void nosdk_kafka_provision_add(
+    struct nosdk_messaging_config *topics,
+    int *count,
+    struct nosdk_messaging_config *m) {
+    for (int i = 0; i < *count; i++) {
+        if (strcmp(topics[i].topic, m->topic) == 0) {
+            if (m->partitions > topics[i].partitions) {
+                topics[i].partitions = m->partitions;
+            }
+            if (m->replication > topics[i].replication) {
+                topics[i].replication = m->replication;
+            }
+            return;
+        }
+    }
+    topics[*count] = *m;
+    (*count)++;
+}
+
+// local topics are created with the asked for partitions, replication
+// has no meaning on a single node
+int nosdk_kafka_provision_local(
+    struct nosdk_messaging_config *topics, int num_topics) {
+    int ret = 0;
+
+    pthread_mutex_lock(&kafka_mgr->admin_lock);
+    for (int i = 0; i < num_topics; i++) {
+        int partitions = topics[i].partitions > 0 ? topics[i].partitions
+                                                  : KAFKA_DEFAULT_PARTITIONS;
+        nosdk_debugf(
+            "provisioning local topic %s, partitions: %d\n", topics[i].topic,
+            partitions);
+        if (nosdk_topiclog_open(
+                kafka_mgr->log_dir, topics[i].topic, partitions) == NULL) {
+            ret = 1;
+            continue;
+        }
+        nosdk_kafka_topic_remember(topics[i].topic);
+    }
+    pthread_mutex_unlock(&kafka_mgr->admin_lock);
+
+    return ret;
+}
+
+// create topics on the brokers with a single request
+int nosdk_kafka_provision_broker(
+    struct nosdk_messaging_config *topics, int num_topics) {
+    rd_kafka_NewTopic_t **new_topics =
+        malloc(sizeof(rd_kafka_NewTopic_t *) * num_topics);
+    int num_new_topics = 0;
+    char errstr[512];
+    for (int i = 0; i < num_topics; i++) {
+        int partitions = topics[i].partitions > 0 ? topics[i].partitions
+                                                  : KAFKA_DEFAULT_PARTITIONS;
+        int replication = topics[i].replication > 0
+                              ? topics[i].replication
+                              : KAFKA_DEFAULT_REPLICATION;
+
+        new_topics[num_new_topics] = rd_kafka_NewTopic_new(
+            topics[i].topic, partitions, replication, errstr, sizeof(errstr));
+        if (new_topics[num_new_topics] == NULL) {
+            fprintf(
+                stderr, "invalid topic %s: %s\n", topics[i].topic, errstr);
+            continue;
+        }
+        nosdk_debugf(
+            "provisioning topic %s, partitions: %d, replication: %d\n",
+            topics[i].topic, partitions, replication);
+        num_new_topics++;
+    }
+
+    int ret = 0;
+    if (num_new_topics > 0) {
+        pthread_mutex_lock(&kafka_mgr->admin_lock);
+        ret = nosdk_kafka_create_topics(new_topics, num_new_topics);
+        pthread_mutex_unlock(&kafka_mgr->admin_lock);
+    }
+
+    rd_kafka_NewTopic_destroy_array(new_topics, num_new_topics);
+    free(new_topics);
+
+    return ret;
+}
+
+int nosdk_kafka_mgr_provision_topics(struct nosdk_config *config) {
+    int max_topics = 0;
+    for (unsigned i = 0; i < config->processes_count; i++) {
+        struct nosdk_process_config *proc = &config->processes[i];
+        max_topics += proc->consume_count;
+        max_topics += proc->produce_count;
+        for (unsigned j = 0; j < proc->consume_count; j++) {
+            if (proc->consume[j].retries > 0) {
+                max_topics += KAFKA_RETRY_MAX + 1;
+            }
+        }
+    }
+    if (max_topics == 0) {
+        return 0;
+    }
+
+    struct nosdk_messaging_config *topics =
+        malloc(sizeof(struct nosdk_messaging_config) * max_topics);
+    char **names = malloc(sizeof(char *) * max_topics);
+    int num_topics = 0;
+    int num_names = 0;
+    for (unsigned i = 0; i < config->processes_count; i++) {
+        struct nosdk_process_config *proc = &config->processes[i];
+        for (unsigned j = 0; j < proc->consume_count; j++) {
+            struct nosdk_messaging_config *m = &proc->consume[j];
+            nosdk_kafka_provision_add(topics, &num_topics, m);
+
+            // retry tiers and the dead-letter topic are shaped like the
+            // topic they serve
+            int retries =
+                m->retries < KAFKA_RETRY_MAX ? m->retries : KAFKA_RETRY_MAX;
+            for (int tier = 1; retries > 0 && tier <= retries + 1; tier++) {
+                char name[512];
+                nosdk_kafka_retry_topic(
+                    name, sizeof(name), m->topic, tier, retries);
+                names[num_names] = strdup(name);
+
+                struct nosdk_messaging_config t = *m;
+                t.topic = names[num_names];
+                num_names++;
+                nosdk_kafka_provision_add(topics, &num_topics, &t);
+            }
+        }
+        for (unsigned j = 0; j < proc->produce_count; j++) {
+            nosdk_kafka_provision_add(topics, &num_topics, &proc->produce[j]);
+        }
+    }
+
+    int ret = nosdk_kafka_local()
+                  ? nosdk_kafka_provision_local(topics, num_topics)
+                  : nosdk_kafka_provision_broker(topics, num_topics);
+
+    for (int i = 0; i < num_names; i++) {
+        free(names[i]);
+    }
+    free(names);
+    free(topics);
+
+    return ret;
+}
+
+int nosdk_kafka_ensure_topic_exists(const char *topic) {
+    pthread_mutex_lock(&kafka_mgr->admin_lock);
+
+    // topics provisioned at startup skip the round trip
+    if (nosdk_kafka_topic_known(topic)) {
+        pthread_mutex_unlock(&kafka_mgr->admin_lock);
+        return 0;
+    }
+
+    if (nosdk_kafka_local()) {
+        int ret = 0;
+        if (nosdk_topiclog_open(
+                kafka_mgr->log_dir, topic, KAFKA_DEFAULT_PARTITIONS) == NULL) {
+            ret = 1;
+        } else {
+            nosdk_kafka_topic_remember(topic);
+        }
+        pthread_mutex_unlock(&kafka_mgr->admin_lock);
+        return ret;
+    }
+
+    char errstr[512];
+    rd_kafka_NewTopic_t *new_topic = rd_kafka_NewTopic_new(
+        topic, KAFKA_DEFAULT_PARTITIONS, KAFKA_DEFAULT_REPLICATION, errstr,
+        sizeof(errstr));
+    if (!new_topic) {
+        fprintf(stderr, "failed to create NewTopic: %s\n", errstr);
+        pthread_mutex_unlock(&kafka_mgr->admin_lock);
         return 1;
     }
 
-    rd_kafka_topic_partition_list_destroy(subscription);
+    int ret = nosdk_kafka_create_topics(&new_topic, 1);
+    rd_kafka_NewTopic_destroy(new_topic);
+
+    pthread_mutex_unlock(&kafka_mgr->admin_lock);
+    return ret;
+}
+
+void nosdk_kafka_msg_destroy(struct nosdk_kafka_msg *msg) {
+    if (atomic_fetch_sub(&msg->refs, 1) > 1) {
+        return;
+    }
+    if (msg->rkmessage != NULL) {
+        rd_kafka_message_destroy(msg->rkmessage);
+    }
+    free(msg);
+}
+
+// wrap a kafka message, the wrapper takes ownership of it
+struct nosdk_kafka_msg *nosdk_kafka_msg_from_kafka(
+    struct nosdk_kafka *consumer, rd_kafka_message_t *rkm) {
+    struct nosdk_kafka_msg *msg = malloc(sizeof(struct nosdk_kafka_msg));
+    msg->consumer = consumer;
+    msg->topic = consumer->topic;
+    msg->partition = rkm->partition;
+    msg->offset = rkm->offset;
+    msg->timestamp = rd_kafka_message_timestamp(rkm, NULL);
+    msg->payload = rkm->payload;
+    msg->len = rkm->len;
+    msg->key = rkm->key;
+    msg->key_len = rkm->key_len;
+    msg->rkmessage = rkm;
+    msg->headers = NULL;
+    msg->headers_len = 0;
+    atomic_init(&msg->refs, 1);
+    return msg;
+}
+
+// wrap a local log record. it points into the mapped segment, which stays
+// mapped until the logs are closed.
+struct nosdk_kafka_msg *nosdk_kafka_msg_from_record(
+    struct nosdk_kafka *consumer, struct nosdk_topiclog_record *record) {
+    struct nosdk_kafka_msg *msg = malloc(sizeof(struct nosdk_kafka_msg));
+    msg->consumer = consumer;
+    msg->topic = consumer->topic;
+    msg->partition = record->partition;
+    msg->offset = record->offset;
+    msg->timestamp = record->timestamp;
+    msg->payload = (void *)record->value;
+    msg->len = record->value_len;
+    msg->key = record->key_len > 0 ? (void *)record->key : NULL;
+    msg->key_len = record->key_len;
+    msg->rkmessage = NULL;
+    msg->headers = record->headers;
+    msg->headers_len = record->headers_len;
+    atomic_init(&msg->refs, 1);
+    return msg;
+}
+
+int nosdk_kafka_ack_bit(struct nosdk_kafka_ack_partition *p, int64_t offset) {
+    int64_t i = offset % KAFKA_ACK_WINDOW;
+    return (p->acked[i / 64] >> (i % 64)) & 1;
+}
+
+void nosdk_kafka_ack_bit_set(
+    struct nosdk_kafka_ack_partition *p, int64_t offset, int value) {
+    int64_t i = offset % KAFKA_ACK_WINDOW;
+    if (value) {
+        p->acked[i / 64] |= (uint64_t)1 << (i % 64);
+    } else {
+        p->acked[i / 64] &= ~((uint64_t)1 << (i % 64));
+    }
+}
+
+// drop the retained messages of every delivered offset
+void nosdk_kafka_ack_partition_release(struct nosdk_kafka_ack_partition *p) {
+    for (int64_t offset = p->base;
+         p->retained != NULL && offset < p->next; offset++) {
+        struct nosdk_kafka_msg **slot =
+            &p->retained[offset % KAFKA_ACK_WINDOW];
+        if (*slot != NULL) {
+            nosdk_kafka_msg_destroy(*slot);
+            *slot = NULL;
+        }
+    }
+}
+
+void nosdk_kafka_ack_partition_reset(
+    struct nosdk_kafka_ack_partition *p, int64_t offset) {
+    nosdk_kafka_ack_partition_release(p);
+    memset(p->acked, 0, sizeof(p->acked));
+    p->base = offset;
+    p->next = offset;
+    p->handed = offset;
+}
+
+// move the watermark past every contiguously acked offset
+void nosdk_kafka_ack_partition_advance(struct nosdk_kafka_ack_partition *p) {
+    while (p->base < p->next && nosdk_kafka_ack_bit(p, p->base)) {
+        nosdk_kafka_ack_bit_set(p, p->base, 0);
+        p->base++;
+    }
+}
+
+struct nosdk_kafka_ack_partition *
+nosdk_kafka_acks_find(struct nosdk_kafka_acks *acks, int32_t partition) {
+    for (int i = 0; i < acks->num_partitions; i++) {
+        if (acks->partitions[i].partition == partition) {
+            return &acks->partitions[i];
+        }
+    }
+    return NULL;
+}
+
+void nosdk_kafka_partition_pause(
+    struct nosdk_kafka *consumer,
+    int32_t partition,
+    int64_t offset,
+    int pause) {
+    // a local consumer reads from its own positions, rewinding is enough.
+    // the paused flag in the ack state keeps the partition from being read.
+    if (consumer->rk == NULL) {
+        if (pause) {
+            consumer->positions[partition] = offset;
+        }
+        return;
+    }
+
+    rd_kafka_topic_partition_list_t *parts =
+        rd_kafka_topic_partition_list_new(1);
+    rd_kafka_topic_partition_t *tp =
+        rd_kafka_topic_partition_list_add(parts, consumer->topic, partition);
+    tp->offset = offset;
+
+    if (pause) {
+        rd_kafka_pause_partitions(consumer->rk, parts);
+
+        // rewind so the undelivered message is fetched again on resume
+        rd_kafka_error_t *error =
+            rd_kafka_seek_partitions(consumer->rk, parts, 1000);
+        if (error != NULL) {
+            printf("seek error: %s\n", rd_kafka_error_string(error));
+            rd_kafka_error_destroy(error);
+        }
+    } else {
+        rd_kafka_resume_partitions(consumer->rk, parts);
+    }
+
+    rd_kafka_topic_partition_list_destroy(parts);
+}
+
+int nosdk_kafka_acks_delivered(
+    struct nosdk_kafka *consumer, struct nosdk_kafka_msg *msg) {
+    struct nosdk_kafka_acks *acks = &consumer->acks;
+
+    pthread_mutex_lock(&acks->mutex);
+
+    struct nosdk_kafka_ack_partition *p =
+        nosdk_kafka_acks_find(acks, msg->partition);
+    if (p == NULL) {
+        if (acks->num_partitions == acks->capacity) {
+            acks->capacity = acks->capacity == 0 ? 8 : acks->capacity * 2;
+            acks->partitions = realloc(
+                acks->partitions,
+                sizeof(struct nosdk_kafka_ack_partition) * acks->capacity);
+        }
+        p = &acks->partitions[acks->num_partitions];
+        acks->num_partitions++;
+
+        p->partition = msg->partition;
+        p->committed = -1;
+        p->paused = 0;
+        p->base = 0;
+        p->next = 0;
+        p->retained = consumer->retries > 0
+                          ? calloc(KAFKA_ACK_WINDOW, sizeof(void *))
+                          : NULL;
+        nosdk_kafka_ack_partition_reset(p, msg->offset);
+    } else if (msg->offset < p->next) {
+        // redelivery after a seek or rebalance, earlier state is stale
+        nosdk_kafka_ack_partition_reset(p, msg->offset);
+    }
+
+    if (msg->offset >= p->base + KAFKA_ACK_WINDOW) {
+        p->paused = 1;
+        pthread_mutex_unlock(&acks->mutex);
+
+        nosdk_debugf(
+            "%s [%d]: ack window full, pausing\n", consumer->topic,
+            msg->partition);
+        nosdk_kafka_partition_pause(consumer, msg->partition, msg->offset, 1);
+        return -1;
+    }
+
+    // offsets skipped by the broker, e.g. transaction markers, count as acked
+    for (int64_t offset = p->next; offset < msg->offset; offset++) {
+        nosdk_kafka_ack_bit_set(p, offset, 1);
+    }
+    p->next = msg->offset + 1;
+    nosdk_kafka_ack_partition_advance(p);
+
+    // kept for a nack to republish
+    if (p->retained != NULL) {
+        atomic_fetch_add(&msg->refs, 1);
+        p->retained[msg->offset % KAFKA_ACK_WINDOW] = msg;
+    }
+
+    pthread_mutex_unlock(&acks->mutex);
     return 0;
 }
 
-int nosdk_kafka_producer_init(struct nosdk_kafka *producer) {
-    rd_kafka_conf_t *conf;
-    char errstr[512];
+int nosdk_kafka_acks_ack(
+    struct nosdk_kafka *consumer, int32_t partition, int64_t offset) {
+    struct nosdk_kafka_acks *acks = &consumer->acks;
 
-    conf = rd_kafka_conf_new();
+    pthread_mutex_lock(&acks->mutex);
 
-    kafka_conf_must_set(
-        conf, "bootstrap.servers", "NOSDK_KAFKA_BOOTSTRAP_SERVERS",
-        "0.0.0.0:19092");
+    struct nosdk_kafka_ack_partition *p =
+        nosdk_kafka_acks_find(acks, partition);
+    if (p == NULL || offset >= p->next) {
+        pthread_mutex_unlock(&acks->mutex);
+        return -1;
+    }
 
-    // Only show warnings/errors if debug flag is set, otherwise be silent
-    if (rd_kafka_conf_set(
-            conf, "log_level", nosdk_debug_flag ? "5" : "0", errstr,
-            sizeof(errstr)) != RD_KAFKA_CONF_OK) {
-        fprintf(stderr, "config error: %s\n", errstr);
+    // offsets below the watermark were already acked
+    struct nosdk_kafka_msg *retained = NULL;
+    if (offset >= p->base) {
+        nosdk_kafka_ack_bit_set(p, offset, 1);
+        if (p->retained != NULL) {
+            retained = p->retained[offset % KAFKA_ACK_WINDOW];
+            p->retained[offset % KAFKA_ACK_WINDOW] = NULL;
+        }
+        nosdk_kafka_ack_partition_advance(p);
+    }
+
+    int resume = p->paused && p->next - p->base < KAFKA_ACK_WINDOW / 2;
+    if (resume) {
+        p->paused = 0;
+    }
+    int64_t next = p->next;
+
+    pthread_mutex_unlock(&acks->mutex);
+
+    if (retained != NULL) {
+        nosdk_kafka_msg_destroy(retained);
+    }
+    if (resume) {
+        nosdk_kafka_partition_pause(consumer, partition, next, 0);
+    }
+
+    return 0;
+}
+
+// a new reference to the retained message at offset, NULL if it is not
+// delivered and unacked
+struct nosdk_kafka_msg *nosdk_kafka_acks_retained(
+    struct nosdk_kafka *consumer, int32_t partition, int64_t offset) {
+    struct nosdk_kafka_msg *msg = NULL;
+
+    pthread_mutex_lock(&consumer->acks.mutex);
+    struct nosdk_kafka_ack_partition *p =
+        nosdk_kafka_acks_find(&consumer->acks, partition);
+    if (p != NULL && p->retained != NULL && offset >= p->base &&
+        offset < p->next) {
+        msg = p->retained[offset % KAFKA_ACK_WINDOW];
+        if (msg != NULL) {
+            atomic_fetch_add(&msg->refs, 1);
+        }
+    }
+    pthread_mutex_unlock(&consumer->acks.mutex);
+
+    return msg;
+}
+
+// the watermarks that moved since the last commit, which are marked as
+// committed. NULL if none did.
+rd_kafka_topic_partition_list_t *
+nosdk_kafka_acks_committable(struct nosdk_kafka *consumer) {
+    rd_kafka_topic_partition_list_t *offsets = NULL;
+
+    pthread_mutex_lock(&consumer->acks.mutex);
+    for (int i = 0; i < consumer->acks.num_partitions; i++) {
+        struct nosdk_kafka_ack_partition *p = &consumer->acks.partitions[i];
+        if (p->base <= p->committed) {
+            continue;
+        }
+
+        if (offsets == NULL) {
+            offsets = rd_kafka_topic_partition_list_new(
+                consumer->acks.num_partitions);
+        }
+        rd_kafka_topic_partition_list_add(
+            offsets, consumer->topic, p->partition)
+            ->offset = p->base;
+        p->committed = p->base;
+    }
+    pthread_mutex_unlock(&consumer->acks.mutex);
+
+    return offsets;
+}
+
+// commit the watermark of every partition that moved since the last commit.
+// a failed async commit is retried the next time the watermark moves.
+void nosdk_kafka_commit_acks(struct nosdk_kafka *consumer, int async) {
+    // offsets of a transactional process are committed with its transaction
+    if (consumer->txn != NULL) {
+        return;
+    }
+
+    rd_kafka_topic_partition_list_t *offsets =
+        nosdk_kafka_acks_committable(consumer);
+    if (offsets == NULL) {
+        return;
+    }
+
+    if (consumer->rk == NULL) {
+        for (int i = 0; i < offsets->cnt; i++) {
+            nosdk_topiclog_commit(
+                consumer->log, consumer->group, offsets->elems[i].partition,
+                offsets->elems[i].offset);
+        }
+        rd_kafka_topic_partition_list_destroy(offsets);
+        return;
+    }
+
+    rd_kafka_resp_err_t err = rd_kafka_commit(consumer->rk, offsets, async);
+    if (err != RD_KAFKA_RESP_ERR_NO_ERROR) {
+        printf("commit error: %s\n", rd_kafka_err2str(err));
+    }
+    rd_kafka_topic_partition_list_destroy(offsets);
+}
+
+void *nosdk_kafka_commit_thread(void *arg) {
+    struct nosdk_kafka *consumer = (struct nosdk_kafka *)arg;
+
+    while (consumer->running) {
+        usleep(consumer->commit_interval_ms * 1000);
+        nosdk_kafka_commit_acks(consumer, 1);
+    }
+
+    return NULL;
+}
+
+// drop the ack state of a partition this consumer no longer owns. its
+// acked offsets must have been committed already.
+void nosdk_kafka_acks_forget_partition(
+    struct nosdk_kafka *consumer, int32_t partition) {
+    struct nosdk_kafka_acks *acks = &consumer->acks;
+
+    pthread_mutex_lock(&acks->mutex);
+    struct nosdk_kafka_ack_partition *p =
+        nosdk_kafka_acks_find(acks, partition);
+    if (p != NULL) {
+        nosdk_kafka_ack_partition_release(p);
+        free(p->retained);
+        acks->num_partitions--;
+        *p = acks->partitions[acks->num_partitions];
+    }
+    pthread_mutex_unlock(&acks->mutex);
+}
+
+void nosdk_kafka_acks_forget(
+    struct nosdk_kafka *consumer,
+    rd_kafka_topic_partition_list_t *partitions) {
+    for (int i = 0; i < partitions->cnt; i++) {
+        nosdk_kafka_acks_forget_partition(
+            consumer, partitions->elems[i].partition);
+    }
+}
+
+int nosdk_kafka_acks_paused(struct nosdk_kafka *consumer, int32_t partition) {
+    pthread_mutex_lock(&consumer->acks.mutex);
+    struct nosdk_kafka_ack_partition *p =
+        nosdk_kafka_acks_find(&consumer->acks, partition);
+    int paused = p != NULL && p->paused;
+    pthread_mutex_unlock(&consumer->acks.mutex);
+    return paused;
+}
+
+// record that a message was handed to a worker
+void nosdk_kafka_acks_handed(
+    struct nosdk_kafka *consumer, struct nosdk_kafka_msg *msg) {
+    pthread_mutex_lock(&consumer->acks.mutex);
+    struct nosdk_kafka_ack_partition *p =
+        nosdk_kafka_acks_find(&consumer->acks, msg->partition);
+    if (p != NULL && msg->offset >= p->handed) {
+        p->handed = msg->offset + 1;
+    }
+    pthread_mutex_unlock(&consumer->acks.mutex);
+}
+
+// whether every message handed to a worker has been acked
+int nosdk_kafka_acks_drained(struct nosdk_kafka *consumer) {
+    int drained = 1;
+    pthread_mutex_lock(&consumer->acks.mutex);
+    for (int i = 0; i < consumer->acks.num_partitions; i++) {
+        struct nosdk_kafka_ack_partition *p = &consumer->acks.partitions[i];
+        if (p->base < p->handed) {
+            drained = 0;
+        }
+    }
+    pthread_mutex_unlock(&consumer->acks.mutex);
+    return drained;
+}
+
+// whether a watermark moved since the last commit
+int nosdk_kafka_acks_moved(struct nosdk_kafka *consumer) {
+    int moved = 0;
+    pthread_mutex_lock(&consumer->acks.mutex);
+    for (int i = 0; i < consumer->acks.num_partitions; i++) {
+        struct nosdk_kafka_ack_partition *p = &consumer->acks.partitions[i];
+        if (p->base > p->committed) {
+            moved = 1;
+        }
+    }
+    pthread_mutex_unlock(&consumer->acks.mutex);
+    return moved;
+}
+
+// produce calls of a transactional producer are kept out of its commits
+void nosdk_kafka_txn_produce_begin(struct nosdk_kafka *producer) {
+    if (producer->transactional) {
+        pthread_rwlock_rdlock(&producer->txn_produce_lock);
+        atomic_fetch_add(&producer->txn_produced, 1);
+    }
+}
+
+void nosdk_kafka_txn_produce_end(struct nosdk_kafka *producer) {
+    if (producer->transactional) {
+        pthread_rwlock_unlock(&producer->txn_produce_lock);
+    }
+}
+
+// wake the server of requests parked on the consumer's prefetch queue,
+// which retry tiers share with the consumer of the original topic
+void nosdk_kafka_wake_parked(struct nosdk_kafka *consumer) {
+    struct nosdk_kafka *owner =
+        consumer->retry_of != NULL ? consumer->retry_of : consumer;
+    if (atomic_load(&owner->parked) > 0) {
+        nosdk_http_server_wake(owner->server);
+    }
+}
+
+int nosdk_kafka_txn_dirty(struct nosdk_kafka *producer) {
+    if (atomic_load(&producer->txn_produced) > 0) {
+        return 1;
+    }
+    for (int i = 0; i < kafka_mgr->num_kafkas; i++) {
+        struct nosdk_kafka *k = kafka_mgr->kafkas[i];
+        if (k->type == CONSUMER && k->txn == producer &&
+            nosdk_kafka_acks_moved(k)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int nosdk_kafka_txn_drained(struct nosdk_kafka *producer) {
+    for (int i = 0; i < kafka_mgr->num_kafkas; i++) {
+        struct nosdk_kafka *k = kafka_mgr->kafkas[i];
+        if (k->type == CONSUMER && k->txn == producer &&
+            !nosdk_kafka_acks_drained(k)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// stop handing out messages and wait until the ones handed out are acked.
+// returns -1 if workers did not ack them in time.
+int nosdk_kafka_txn_drain(struct nosdk_kafka *producer) {
+    pthread_mutex_lock(&producer->txn_mutex);
+    producer->txn_draining = 1;
+    while (producer->txn_readers > 0) {
+        pthread_cond_wait(&producer->txn_cond, &producer->txn_mutex);
+    }
+    pthread_mutex_unlock(&producer->txn_mutex);
+
+    int64_t deadline = nosdk_now_ms() + KAFKA_TXN_DRAIN_MS;
+    while (!nosdk_kafka_txn_drained(producer)) {
+        if (nosdk_now_ms() >= deadline) {
+            return -1;
+        }
+        usleep(1000);
+    }
+    return 0;
+}
+
+void nosdk_kafka_txn_resume(struct nosdk_kafka *producer) {
+    pthread_mutex_lock(&producer->txn_mutex);
+    producer->txn_draining = 0;
+    pthread_cond_broadcast(&producer->txn_cond);
+    pthread_mutex_unlock(&producer->txn_mutex);
+
+    // messages may have queued up while the drain held them back
+    for (int i = 0; i < kafka_mgr->num_kafkas; i++) {
+        struct nosdk_kafka *k = kafka_mgr->kafkas[i];
+        if (k->type == CONSUMER && k->txn == producer) {
+            nosdk_kafka_wake_parked(k);
+        }
+    }
+}
+
+// after an abort, consume again from the last committed offsets
+void nosdk_kafka_txn_rewind(struct nosdk_kafka *consumer) {
+    rd_kafka_topic_partition_list_t *assignment;
+    if (rd_kafka_assignment(consumer->rk, &assignment) !=
+        RD_KAFKA_RESP_ERR_NO_ERROR) {
+        return;
+    }
+
+    rd_kafka_resp_err_t err =
+        rd_kafka_committed(consumer->rk, assignment, KAFKA_TXN_TIMEOUT_MS);
+    if (err != RD_KAFKA_RESP_ERR_NO_ERROR) {
+        printf("committed offsets error: %s\n", rd_kafka_err2str(err));
+    }
+    for (int i = 0; i < assignment->cnt; i++) {
+        if (assignment->elems[i].offset < 0) {
+            assignment->elems[i].offset = RD_KAFKA_OFFSET_BEGINNING;
+        }
+    }
+
+    rd_kafka_error_t *error = rd_kafka_seek_partitions(
+        consumer->rk, assignment, KAFKA_TXN_TIMEOUT_MS);
+    if (error != NULL) {
+        printf("seek error: %s\n", rd_kafka_error_string(error));
+        rd_kafka_error_destroy(error);
+    }
+
+    // partitions paused on a full ack window start over too
+    nosdk_kafka_acks_forget(consumer, assignment);
+    rd_kafka_resume_partitions(consumer->rk, assignment);
+    rd_kafka_topic_partition_list_destroy(assignment);
+
+    // drop what was prefetched past them, tiers share the queue
+    if (consumer->retry_of == NULL) {
+        void *msg;
+        while (nosdk_queue_pop(&consumer->prefetch, &msg) == 0) {
+            nosdk_kafka_msg_destroy((struct nosdk_kafka_msg *)msg);
+        }
+    }
+}
+
+// abort the transaction after a failed commit and rewind its consumers.
+// a fatal error, e.g. being fenced by a newer instance, ends the process,
+// which resumes from the last committed transaction when restarted.
+void nosdk_kafka_txn_abort(
+    struct nosdk_kafka *producer, rd_kafka_error_t *error) {
+    printf("transaction error: %s\n", rd_kafka_error_string(error));
+    int fatal = rd_kafka_error_is_fatal(error);
+    rd_kafka_error_destroy(error);
+
+    if (!fatal) {
+        error = rd_kafka_abort_transaction(producer->rk, KAFKA_TXN_TIMEOUT_MS);
+        if (error != NULL) {
+            printf("abort error: %s\n", rd_kafka_error_string(error));
+            fatal = 1;
+            rd_kafka_error_destroy(error);
+        }
+    }
+    if (fatal) {
+        fprintf(stderr, "fatal transaction error\n");
+        exit(1);
+    }
+
+    for (int i = 0; i < kafka_mgr->num_kafkas; i++) {
+        struct nosdk_kafka *k = kafka_mgr->kafkas[i];
+        if (k->type == CONSUMER && k->txn == producer && k->rk != NULL) {
+            nosdk_kafka_txn_rewind(k);
+        }
+    }
+}
+
+// commit the process's transaction with the offsets its consumers acked.
+// handing out stops until every message handed out is acked, so nothing
+// in the transaction was produced for a message whose offset it leaves
+// out, as long as workers produce before they ack.
+void nosdk_kafka_txn_commit(struct nosdk_kafka *producer) {
+    pthread_mutex_lock(&producer->txn_commit_mutex);
+    if (producer->txn_closed || !nosdk_kafka_txn_dirty(producer)) {
+        pthread_mutex_unlock(&producer->txn_commit_mutex);
+        return;
+    }
+
+    if (nosdk_kafka_txn_drain(producer) != 0) {
+        printf(
+            "txn-%d: messages still unacked after %dms, commit postponed\n",
+            producer->process_id, KAFKA_TXN_DRAIN_MS);
+        nosdk_kafka_txn_resume(producer);
+        pthread_mutex_unlock(&producer->txn_commit_mutex);
+        return;
+    }
+
+    pthread_rwlock_wrlock(&producer->txn_produce_lock);
+
+    rd_kafka_error_t *error = NULL;
+    for (int i = 0; i < kafka_mgr->num_kafkas && error == NULL; i++) {
+        struct nosdk_kafka *k = kafka_mgr->kafkas[i];
+        if (k->type != CONSUMER || k->txn != producer || k->rk == NULL) {
+            continue;
+        }
+        rd_kafka_topic_partition_list_t *offsets =
+            nosdk_kafka_acks_committable(k);
+        if (offsets == NULL) {
+            continue;
+        }
+
+        rd_kafka_consumer_group_metadata_t *group =
+            rd_kafka_consumer_group_metadata(k->rk);
+        error = rd_kafka_send_offsets_to_transaction(
+            producer->rk, offsets, group, KAFKA_TXN_TIMEOUT_MS);
+        rd_kafka_consumer_group_metadata_destroy(group);
+        rd_kafka_topic_partition_list_destroy(offsets);
+    }
+
+    if (error == NULL) {
+        error = rd_kafka_commit_transaction(producer->rk, KAFKA_TXN_TIMEOUT_MS);
+        for (int retry = 0; error != NULL && retry < KAFKA_TXN_RETRIES &&
+                            rd_kafka_error_is_retriable(error);
+             retry++) {
+            rd_kafka_error_destroy(error);
+            error =
+                rd_kafka_commit_transaction(producer->rk, KAFKA_TXN_TIMEOUT_MS);
+        }
+    }
+    if (error != NULL) {
+        nosdk_kafka_txn_abort(producer, error);
+    }
+
+    error = rd_kafka_begin_transaction(producer->rk);
+    if (error != NULL) {
+        nosdk_kafka_txn_abort(producer, error);
+    }
+    atomic_store(&producer->txn_produced, 0);
+
+    pthread_rwlock_unlock(&producer->txn_produce_lock);
+    nosdk_kafka_txn_resume(producer);
+    pthread_mutex_unlock(&producer->txn_commit_mutex);
+}
+
+void *nosdk_kafka_txn_thread(void *arg) {
+    struct nosdk_kafka *producer = (struct nosdk_kafka *)arg;
+
+    while (!producer->txn_closed) {
+        usleep(producer->txn_interval_ms * 1000);
+        nosdk_kafka_txn_commit(producer);
+    }
+
+    return NULL;
+}
+
+int nosdk_kafka_txn_init(struct nosdk_kafka *producer) {
+    pthread_mutex_init(&producer->txn_commit_mutex, NULL);
+    pthread_mutex_init(&producer->txn_mutex, NULL);
+    pthread_cond_init(&producer->txn_cond, NULL);
+    atomic_init(&producer->txn_produced, 0);
+
+    // commits take the lock exclusively and must not starve behind a
+    // steady stream of produce calls
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+#ifdef __linux__
+    pthread_rwlockattr_setkind_np(
+        &attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+    pthread_rwlock_init(&producer->txn_produce_lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+
+    rd_kafka_error_t *error =
+        rd_kafka_init_transactions(producer->rk, KAFKA_TXN_TIMEOUT_MS);
+    if (error == NULL) {
+        error = rd_kafka_begin_transaction(producer->rk);
+    }
+    if (error != NULL) {
+        fprintf(
+            stderr, "failed to start transactions: %s\n",
+            rd_kafka_error_string(error));
+        rd_kafka_error_destroy(error);
+        return 1;
+    }
+
+    if (pthread_create(
+            &producer->txn_thread, NULL, nosdk_kafka_txn_thread, producer) !=
+        0) {
+        fprintf(stderr, "failed to start transaction thread\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+// commit what is left and stop committing, before the clients go away
+void nosdk_kafka_txn_close(struct nosdk_kafka *producer) {
+    nosdk_kafka_txn_commit(producer);
+
+    pthread_mutex_lock(&producer->txn_commit_mutex);
+    producer->txn_closed = 1;
+    pthread_mutex_unlock(&producer->txn_commit_mutex);
+    pthread_join(producer->txn_thread, NULL);
+}
+
+// wait until no commit is draining, then take the next message in slices
+struct nosdk_kafka_msg *
+nosdk_kafka_txn_next(struct nosdk_kafka *consumer, int timeout_ms) {
+    struct nosdk_kafka *txn = consumer->txn;
+    int64_t deadline_ms = nosdk_now_ms() + timeout_ms;
+    struct timespec deadline;
+    nosdk_deadline_after_ms(&deadline, timeout_ms);
+
+    while (1) {
+        pthread_mutex_lock(&txn->txn_mutex);
+        while (txn->txn_draining) {
+            if (pthread_cond_timedwait(
+                    &txn->txn_cond, &txn->txn_mutex, &deadline) ==
+                ETIMEDOUT) {
+                pthread_mutex_unlock(&txn->txn_mutex);
+                return NULL;
+            }
+        }
+        txn->txn_readers++;
+        pthread_mutex_unlock(&txn->txn_mutex);
+
+        int64_t slice = deadline_ms - nosdk_now_ms();
+        if (slice > KAFKA_TXN_SLICE_MS) {
+            slice = KAFKA_TXN_SLICE_MS;
+        } else if (slice < 0) {
+            slice = 0;
+        }
+
+        void *msg = NULL;
+        if (nosdk_queue_pop_wait(&consumer->prefetch, &msg, (int)slice) == 0) {
+            struct nosdk_kafka_msg *m = (struct nosdk_kafka_msg *)msg;
+            nosdk_kafka_acks_handed(m->consumer, m);
+        } else {
+            msg = NULL;
+        }
+
+        pthread_mutex_lock(&txn->txn_mutex);
+        txn->txn_readers--;
+        pthread_cond_broadcast(&txn->txn_cond);
+        pthread_mutex_unlock(&txn->txn_mutex);
+
+        if (msg != NULL || nosdk_now_ms() >= deadline_ms) {
+            return (struct nosdk_kafka_msg *)msg;
+        }
+    }
+}
+
+// where fetched messages go. retry tiers feed the original topic's
+// readers.
+struct nosdk_queue *nosdk_kafka_fetch_queue(struct nosdk_kafka *consumer) {
+    if (consumer->retry_of != NULL) {
+        return &consumer->retry_of->prefetch;
+    }
+    return &consumer->prefetch;
+}
+
+// drop prefetched messages of revoked partitions, their acks would find
+// no partition state. the rest go back in order, waiting for room like the
+// fetch thread does when retry tiers filled the queue meanwhile.
+void nosdk_kafka_prefetch_drop(
+    struct nosdk_kafka *consumer,
+    rd_kafka_topic_partition_list_t *partitions) {
+    struct nosdk_queue *queue = nosdk_kafka_fetch_queue(consumer);
+    size_t capacity = queue->mask + 1;
+    void **kept = malloc(sizeof(void *) * capacity);
+    size_t num_kept = 0;
+
+    void *msg;
+    for (size_t i = 0; i < capacity && nosdk_queue_pop(queue, &msg) == 0;
+         i++) {
+        struct nosdk_kafka_msg *m = (struct nosdk_kafka_msg *)msg;
+        if (m->consumer == consumer &&
+            rd_kafka_topic_partition_list_find(
+                partitions, consumer->topic, m->partition) != NULL) {
+            nosdk_kafka_msg_destroy(m);
+        } else {
+            kept[num_kept++] = msg;
+        }
+    }
+
+    for (size_t i = 0; i < num_kept; i++) {
+        while (nosdk_queue_push_wait(queue, kept[i], 500) != 0) {
+            if (!consumer->running) {
+                nosdk_kafka_msg_destroy((struct nosdk_kafka_msg *)kept[i]);
+                break;
+            }
+        }
+    }
+    free(kept);
+}
+
+// runs on the fetch thread. partitions move between replicas one at a
+// time with the cooperative protocol, so the rest keep flowing.
+void nosdk_kafka_rebalance_cb(
+    rd_kafka_t *rk,
+    rd_kafka_resp_err_t err,
+    rd_kafka_topic_partition_list_t *partitions,
+    void *opaque) {
+    struct nosdk_kafka *consumer = (struct nosdk_kafka *)opaque;
+    int cooperative =
+        strcmp(rd_kafka_rebalance_protocol(rk), "COOPERATIVE") == 0;
+
+    nosdk_debugf(
+        "%s [replica %d]: %s %d partitions\n", consumer->topic,
+        consumer->replica,
+        err == RD_KAFKA_RESP_ERR__ASSIGN_PARTITIONS ? "assigned" : "revoked",
+        partitions->cnt);
+
+    if (err == RD_KAFKA_RESP_ERR__ASSIGN_PARTITIONS) {
+        if (cooperative) {
+            rd_kafka_error_t *error =
+                rd_kafka_incremental_assign(rk, partitions);
+            if (error != NULL) {
+                printf("assign error: %s\n", rd_kafka_error_string(error));
+                rd_kafka_error_destroy(error);
+            }
+        } else {
+            rd_kafka_assign(rk, partitions);
+        }
+        return;
+    }
+
+    // hand over the acked watermark before another replica takes over.
+    // messages still unacked here will be redelivered to the new owner.
+    if (consumer->txn != NULL) {
+        nosdk_kafka_txn_commit(consumer->txn);
+    }
+    nosdk_kafka_commit_acks(consumer, 0);
+    nosdk_kafka_acks_forget(consumer, partitions);
+    nosdk_kafka_prefetch_drop(consumer, partitions);
+
+    if (cooperative) {
+        rd_kafka_error_t *error = rd_kafka_incremental_unassign(rk, partitions);
+        if (error != NULL) {
+            printf("unassign error: %s\n", rd_kafka_error_string(error));
+            rd_kafka_error_destroy(error);
+        }
+    } else {
+        rd_kafka_assign(rk, NULL);
+    }
+}
+
+// a retry tier redelivers a message once it is delay_ms old. until then
+// the partition is paused at the message, the others keep flowing.
+int nosdk_kafka_retry_hold(
+    struct nosdk_kafka *consumer, struct nosdk_kafka_msg *msg) {
+    int64_t due_ms = msg->timestamp + consumer->delay_ms;
+    if (consumer->delay_ms <= 0 || msg->timestamp < 0 ||
+        due_ms <= nosdk_now_ms()) {
+        return 0;
+    }
+
+    nosdk_kafka_partition_pause(consumer, msg->partition, msg->offset, 1);
+
+    for (int i = 0; i < consumer->num_held; i++) {
+        if (consumer->held[i].partition == msg->partition) {
+            consumer->held[i].due_ms = due_ms;
+            return 1;
+        }
+    }
+    if (consumer->num_held == consumer->held_capacity) {
+        consumer->held_capacity =
+            consumer->held_capacity == 0 ? 8 : consumer->held_capacity * 2;
+        consumer->held = realloc(
+            consumer->held,
+            sizeof(struct nosdk_kafka_held) * consumer->held_capacity);
+    }
+    consumer->held[consumer->num_held].partition = msg->partition;
+    consumer->held[consumer->num_held].due_ms = due_ms;
+    consumer->num_held++;
+    return 1;
+}
+
+// resume the held partitions that are due
+void nosdk_kafka_retry_resume(struct nosdk_kafka *consumer) {
+    int64_t now = nosdk_now_ms();
+    for (int i = 0; i < consumer->num_held;) {
+        if (consumer->held[i].due_ms > now) {
+            i++;
+            continue;
+        }
+        nosdk_kafka_partition_pause(
+            consumer, consumer->held[i].partition, 0, 0);
+        consumer->num_held--;
+        consumer->held[i] = consumer->held[consumer->num_held];
+    }
+}
+
+// poll the next deliverable message, NULL on timeout
+struct nosdk_kafka_msg *
+nosdk_kafka_consumer_poll(struct nosdk_kafka *consumer) {
+    rd_kafka_message_t *rkm = rd_kafka_consumer_poll(consumer->rk, 500);
+    if (rkm == NULL) {
+        return NULL;
+    }
+
+    if (rkm->err != RD_KAFKA_RESP_ERR_NO_ERROR) {
+        printf("poll error: %s\n", rd_kafka_err2str(rkm->err));
+        rd_kafka_message_destroy(rkm);
+        return NULL;
+    }
+
+    struct nosdk_kafka_msg *msg = nosdk_kafka_msg_from_kafka(consumer, rkm);
+    if (nosdk_kafka_retry_hold(consumer, msg) ||
+        nosdk_kafka_acks_delivered(consumer, msg) != 0) {
+        nosdk_kafka_msg_destroy(msg);
+        return NULL;
+    }
+
+    return msg;
+}
+
+// keep the prefetch queue full. when it is, the fetched message waits here
+// for room and polling stops, so a slow topic does not buffer without bound.
+void *nosdk_kafka_fetch_thread(void *arg) {
+    struct nosdk_kafka *consumer = (struct nosdk_kafka *)arg;
+    struct nosdk_queue *queue = nosdk_kafka_fetch_queue(consumer);
+    struct nosdk_kafka_msg *msg = NULL;
+
+    while (consumer->running) {
+        if (msg == NULL) {
+            nosdk_kafka_retry_resume(consumer);
+            msg = nosdk_kafka_consumer_poll(consumer);
+        }
+        if (msg != NULL && nosdk_queue_push_wait(queue, msg, 500) == 0) {
+            nosdk_kafka_wake_parked(consumer);
+            msg = NULL;
+        }
+    }
+
+    if (msg != NULL) {
+        nosdk_kafka_msg_destroy(msg);
+    }
+
+    return NULL;
+}
+
+// local partitions are spread over the topic's consumers by rank, in
+// replica order. a partition that moves away is committed and forgotten.
+void nosdk_kafka_local_assign(struct nosdk_kafka *consumer) {
+    int count = 0;
+    int rank = 0;
+    for (int i = 0; i < kafka_mgr->num_kafkas; i++) {
+        struct nosdk_kafka *k = kafka_mgr->kafkas[i];
+        if (k->type != CONSUMER || strcmp(k->topic, consumer->topic) != 0) {
+            continue;
+        }
+        count++;
+        if (k->replica < consumer->replica) {
+            rank++;
+        }
+    }
+    // not registered yet while it is being initialized
+    if (count == 0 || rank >= count) {
+        count = rank + 1;
+    }
+
+    for (int p = 0; p < consumer->log->num_partitions; p++) {
+        int owns = p % count == rank;
+        if (consumer->owned[p] && !owns) {
+            nosdk_debugf(
+                "%s [replica %d]: revoked partition %d\n", consumer->topic,
+                consumer->replica, p);
+            nosdk_kafka_commit_acks(consumer, 0);
+            nosdk_kafka_acks_forget_partition(consumer, p);
+            consumer->positions[p] = -1;
+
+            rd_kafka_topic_partition_list_t *revoked =
+                rd_kafka_topic_partition_list_new(1);
+            rd_kafka_topic_partition_list_add(revoked, consumer->topic, p);
+            nosdk_kafka_prefetch_drop(consumer, revoked);
+            rd_kafka_topic_partition_list_destroy(revoked);
+        }
+        consumer->owned[p] = owns;
+    }
+}
+
+// read one record from every owned partition in turn, and wait for appends
+// when none had one
+void *nosdk_kafka_local_fetch_thread(void *arg) {
+    struct nosdk_kafka *consumer = (struct nosdk_kafka *)arg;
+    struct nosdk_topiclog *log = consumer->log;
+    struct nosdk_queue *queue = nosdk_kafka_fetch_queue(consumer);
+
+    while (consumer->running) {
+        uint64_t seen = nosdk_topiclog_appends(log);
+        int fetched = 0;
+
+        nosdk_kafka_local_assign(consumer);
+        for (int p = 0; p < log->num_partitions && consumer->running; p++) {
+            if (!consumer->owned[p] || nosdk_kafka_acks_paused(consumer, p)) {
+                continue;
+            }
+            if (consumer->positions[p] < 0) {
+                int64_t committed =
+                    nosdk_topiclog_committed(log, consumer->group, p);
+                consumer->positions[p] = committed >= 0 ? committed : 0;
+            }
+
+            struct nosdk_topiclog_record record;
+            if (nosdk_topiclog_read(log, p, consumer->positions[p], &record) !=
+                0) {
+                continue;
+            }
+
+            // a retry tier leaves the record in place until it is due
+            if (consumer->delay_ms > 0 &&
+                record.timestamp + consumer->delay_ms > nosdk_now_ms()) {
+                continue;
+            }
+
+            struct nosdk_kafka_msg *msg =
+                nosdk_kafka_msg_from_record(consumer, &record);
+            if (nosdk_kafka_acks_delivered(consumer, msg) != 0) {
+                nosdk_kafka_msg_destroy(msg);
+                continue;
+            }
+
+            while (nosdk_queue_push_wait(queue, msg, 500) != 0) {
+                if (!consumer->running) {
+                    nosdk_kafka_msg_destroy(msg);
+                    return NULL;
+                }
+            }
+            nosdk_kafka_wake_parked(consumer);
+            consumer->positions[p]++;
+            fetched++;
+        }
+
+        if (fetched == 0) {
+            nosdk_topiclog_wait(log, seen, 500);
+        }
+    }
+
+    return NULL;
+}
+
+struct nosdk_kafka_msg *
+nosdk_kafka_consumer_next(struct nosdk_kafka *consumer, int timeout_ms) {
+    if (consumer->txn != NULL) {
+        return nosdk_kafka_txn_next(consumer, timeout_ms);
+    }
+
+    void *msg;
+    if (nosdk_queue_pop_wait(&consumer->prefetch, &msg, timeout_ms) != 0) {
+        return NULL;
+    }
+    return (struct nosdk_kafka_msg *)msg;
+}
+
+int nosdk_kafka_consumer_subscribe(struct nosdk_kafka *consumer) {
+    rd_kafka_conf_t *conf;
+    rd_kafka_topic_partition_list_t *subscription;
+    char errstr[512];
+
+    conf = rd_kafka_conf_new();
+
+    kafka_conf_must_set(
+        conf, "bootstrap.servers", "NOSDK_KAFKA_BOOTSTRAP_SERVERS",
+        "0.0.0.0:19092");
+    kafka_conf_must_set(
+        conf, "group.id", "NOSDK_KAFKA_GROUP_ID", "nosdk-default-group");
+
+    // Only show warnings/errors if debug flag is set, otherwise be silent
+    if (rd_kafka_conf_set(
+            conf, "log_level", nosdk_debug_flag ? "5" : "0", errstr,
+            sizeof(errstr)) != RD_KAFKA_CONF_OK) {
+        fprintf(stderr, "config error: %s\n", errstr);
+    }
+
+    // each replica is a group member of its own, partitions are spread
+    // across replicas and stay put when one joins or leaves
+    char client_id[256];
+    snprintf(
+        client_id, sizeof(client_id), "nosdk-%s-%d", consumer->topic,
+        consumer->replica);
+    if (rd_kafka_conf_set(
+            conf, "client.id", client_id, errstr, sizeof(errstr)) !=
+        RD_KAFKA_CONF_OK) {
+        fprintf(stderr, "config error: %s\n", errstr);
+    }
+    if (rd_kafka_conf_set(
+            conf, "partition.assignment.strategy", "cooperative-sticky",
+            errstr, sizeof(errstr)) != RD_KAFKA_CONF_OK) {
+        fprintf(stderr, "config error: %s\n", errstr);
+    }
+    rd_kafka_conf_set_rebalance_cb(conf, nosdk_kafka_rebalance_cb);
+    rd_kafka_conf_set_opaque(conf, consumer);
+
+    // statistics are served from the fetch thread's polls
+    kafka_conf_must_set(
+        conf, "statistics.interval.ms", "NOSDK_KAFKA_STATS_INTERVAL_MS",
+        KAFKA_STATS_INTERVAL_MS);
+    rd_kafka_conf_set_stats_cb(conf, nosdk_kafka_stats_cb);
+
+    if (rd_kafka_conf_set(
+            conf, "auto.offset.reset", "earliest", errstr, sizeof(errstr)) !=
+        RD_KAFKA_CONF_OK) {
+
+        fprintf(stderr, "config error: %s\n", errstr);
+    }
+    if (rd_kafka_conf_set(
+            conf, "enable.auto.commit", "false", errstr, sizeof(errstr)) !=
+        RD_KAFKA_CONF_OK) {
+
+        fprintf(stderr, "config error: %s\n", errstr);
+    }
+
+    // the topic's settings were checked when the config was loaded
+    struct nosdk_messaging_config *m = consumer->messaging;
+    if (m != NULL) {
+        struct nosdk_kafka_setting *settings = malloc(
+            sizeof(struct nosdk_kafka_setting) *
+            (KAFKA_TUNING_MAX + m->properties_count));
+        int n = nosdk_kafka_topic_settings(m, CONSUMER, settings);
+        for (int i = 0; i < n; i++) {
+            nosdk_kafka_conf_set(conf, NULL, &settings[i]);
+        }
+        free(settings);
+    }
+
+    consumer->rk =
+        rd_kafka_new(RD_KAFKA_CONSUMER, conf, errstr, sizeof(errstr));
+    if (!consumer->rk) {
+        fprintf(stderr, "failed to create consumer: %s\n", errstr);
+        return 1;
+    }
+
+    // subscribe to topics
+    subscription = rd_kafka_topic_partition_list_new(1);
+    rd_kafka_topic_partition_t *partition = rd_kafka_topic_partition_list_add(
+        subscription, consumer->topic, RD_KAFKA_PARTITION_UA);
+
+    if (partition->err) {
+        printf("subscription error: %s\n", rd_kafka_err2str(partition->err));
+        return -1;
+    }
+
+    nosdk_debugf(
+        "topic: %s partition: %d, offset: %" PRId64 "\n", consumer->topic,
+        partition->partition, partition->offset);
+
+    rd_kafka_resp_err_t err = rd_kafka_subscribe(consumer->rk, subscription);
+    if (err) {
+        fprintf(
+            stderr, "failed to subscribe to %s: %s\n", consumer->topic,
+            rd_kafka_err2str(err));
+        return 1;
+    }
+
+    rd_kafka_topic_partition_list_destroy(subscription);
+
+    return 0;
+}
+
+int nosdk_kafka_local_consumer_open(struct nosdk_kafka *consumer) {
+    consumer->log = nosdk_topiclog_open(
+        kafka_mgr->log_dir, consumer->topic, KAFKA_DEFAULT_PARTITIONS);
+    if (consumer->log == NULL) {
+        return 1;
+    }
+
+    char *group = getenv("NOSDK_KAFKA_GROUP_ID");
+    consumer->group = strdup(
+        group != NULL && strlen(group) > 0 ? group : "nosdk-default-group");
+
+    int partitions = consumer->log->num_partitions;
+    consumer->positions = malloc(sizeof(int64_t) * partitions);
+    consumer->owned = calloc(partitions, sizeof(int));
+    for (int p = 0; p < partitions; p++) {
+        consumer->positions[p] = -1;
+    }
+
+    return 0;
+}
+
+int nosdk_kafka_consumer_init(struct nosdk_kafka *consumer) {
+    // Ensure topic exists before creating consumer
+    if (nosdk_kafka_ensure_topic_exists(consumer->topic) != 0) {
+        fprintf(stderr, "failed to ensure topic exists: %s\n", consumer->topic);
+        return 1;
+    }
+
+    // the rebalance callback touches the ack state from the first poll on
+    pthread_mutex_init(&consumer->acks.mutex, NULL);
+    consumer->acks.partitions = NULL;
+    consumer->acks.num_partitions = 0;
+    consumer->acks.capacity = 0;
+
+    int ret = nosdk_kafka_local() ? nosdk_kafka_local_consumer_open(consumer)
+                                  : nosdk_kafka_consumer_subscribe(consumer);
+    if (ret != 0) {
+        return ret;
+    }
+
+    char *interval = getenv("NOSDK_KAFKA_COMMIT_INTERVAL_MS");
+    consumer->commit_interval_ms =
+        interval != NULL ? atoi(interval) : KAFKA_COMMIT_INTERVAL_MS;
+    if (consumer->commit_interval_ms <= 0) {
+        consumer->commit_interval_ms = KAFKA_COMMIT_INTERVAL_MS;
+    }
+
+    char *prefetch = getenv("NOSDK_KAFKA_PREFETCH");
+    int prefetch_size = prefetch != NULL ? atoi(prefetch) : 0;
+    if (prefetch_size <= 0) {
+        prefetch_size = KAFKA_PREFETCH_SIZE;
+    }
+    if (nosdk_queue_init(&consumer->prefetch, prefetch_size) != 0) {
+        fprintf(stderr, "failed to allocate prefetch queue\n");
+        return 1;
+    }
+
+    consumer->running = 1;
+    if (pthread_create(
+            &consumer->commit_thread, NULL, nosdk_kafka_commit_thread,
+            consumer) != 0) {
+        fprintf(stderr, "failed to start commit thread\n");
+        consumer->running = 0;
+        return 1;
+    }
+
+    if (pthread_create(
+            &consumer->fetch_thread, NULL,
+            consumer->rk != NULL ? nosdk_kafka_fetch_thread
+                                 : nosdk_kafka_local_fetch_thread,
+            consumer) != 0) {
+        fprintf(stderr, "failed to start fetch thread\n");
+        consumer->running = 0;
+        pthread_join(consumer->commit_thread, NULL);
+        return 1;
+    }
+
+    return 0;
+}
+
+struct nosdk_kafka_delivery *
+nosdk_kafka_delivery_new(char *body, int num_results) {
+    struct nosdk_kafka_delivery *delivery =
+        malloc(sizeof(struct nosdk_kafka_delivery));
+    pthread_mutex_init(&delivery->mutex, NULL);
+    pthread_cond_init(&delivery->cond, NULL);
+    delivery->pending = 0;
+    delivery->refs = 1;
+    delivery->detached = 0;
+    delivery->body = body;
+    delivery->num_results = num_results;
+    delivery->results =
+        calloc(num_results, sizeof(struct nosdk_kafka_delivery_result));
+    for (int i = 0; i < num_results; i++) {
+        delivery->results[i].delivery = delivery;
+    }
+    return delivery;
+}
+
+void nosdk_kafka_delivery_release(struct nosdk_kafka_delivery *delivery) {
+    pthread_mutex_lock(&delivery->mutex);
+    delivery->refs--;
+    int refs = delivery->refs;
+    pthread_mutex_unlock(&delivery->mutex);
+
+    if (refs == 0) {
+        pthread_mutex_destroy(&delivery->mutex);
+        pthread_cond_destroy(&delivery->cond);
+        free(delivery->body);
+        free(delivery->results);
+        free(delivery);
+    }
+}
+
+// record the outcome of one produced message and drop its reference
+void nosdk_kafka_delivery_complete(
+    struct nosdk_kafka_delivery_result *result,
+    rd_kafka_resp_err_t err,
+    int32_t partition,
+    int64_t offset) {
+    struct nosdk_kafka_delivery *delivery = result->delivery;
+    if (delivery->detached && err != RD_KAFKA_RESP_ERR_NO_ERROR) {
+        printf("delivery error: %s\n", rd_kafka_err2str(err));
+    }
+
+    pthread_mutex_lock(&delivery->mutex);
+    result->delivered = 1;
+    result->err = err;
+    result->partition = partition;
+    result->offset = offset;
+    delivery->pending--;
+    pthread_cond_signal(&delivery->cond);
+    pthread_mutex_unlock(&delivery->mutex);
+
+    nosdk_kafka_delivery_release(delivery);
+}
+
+void nosdk_kafka_dr_msg_cb(
+    rd_kafka_t *rk, const rd_kafka_message_t *msg, void *opaque) {
+    struct nosdk_kafka_delivery_result *result = msg->_private;
+
+    if (result == NULL) {
+        if (msg->err != RD_KAFKA_RESP_ERR_NO_ERROR) {
+            printf("delivery error: %s\n", rd_kafka_err2str(msg->err));
+        }
+        return;
+    }
+
+    nosdk_kafka_delivery_complete(
+        result, msg->err, msg->partition, msg->offset);
+}
+
+void *nosdk_kafka_producer_poll_thread(void *arg) {
+    struct nosdk_kafka *producer = (struct nosdk_kafka *)arg;
+
+    while (producer->running) {
+        rd_kafka_poll(producer->rk, 100);
+    }
+
+    return NULL;
+}
+
+int nosdk_kafka_producer_init(struct nosdk_kafka *producer) {
+    rd_kafka_conf_t *conf;
+    char errstr[512];
+
+    pthread_rwlock_init(&producer->topics_lock, NULL);
+    producer->topics = NULL;
+    producer->num_topics = 0;
+    producer->topics_capacity = 0;
+
+    // local appends complete in place, there is nothing to poll
+    if (nosdk_kafka_local()) {
+        producer->running = 1;
+        return 0;
+    }
+
+    conf = rd_kafka_conf_new();
+
+    kafka_conf_must_set(
+        conf, "bootstrap.servers", "NOSDK_KAFKA_BOOTSTRAP_SERVERS",
+        "0.0.0.0:19092");
+
+    // Only show warnings/errors if debug flag is set, otherwise be silent
+    if (rd_kafka_conf_set(
+            conf, "log_level", nosdk_debug_flag ? "5" : "0", errstr,
+            sizeof(errstr)) != RD_KAFKA_CONF_OK) {
+        fprintf(stderr, "config error: %s\n", errstr);
+    }
+
+    rd_kafka_conf_set_dr_msg_cb(conf, nosdk_kafka_dr_msg_cb);
+
+    // the id stays the same across restarts, so a new instance fences off
+    // the transactions of the one it replaces
+    if (producer->transactional) {
+        char *group = getenv("NOSDK_KAFKA_GROUP_ID");
+        char txn_id[256];
+        snprintf(
+            txn_id, sizeof(txn_id), "%s-txn-%d",
+            group != NULL && strlen(group) > 0 ? group : "nosdk-default-group",
+            producer->process_id);
+        if (rd_kafka_conf_set(
+                conf, "transactional.id", txn_id, errstr, sizeof(errstr)) !=
+            RD_KAFKA_CONF_OK) {
+            fprintf(stderr, "config error: %s\n", errstr);
+        }
+    }
+
+    // statistics are served from the poll thread
+    kafka_conf_must_set(
+        conf, "statistics.interval.ms", "NOSDK_KAFKA_STATS_INTERVAL_MS",
+        KAFKA_STATS_INTERVAL_MS);
+    rd_kafka_conf_set_stats_cb(conf, nosdk_kafka_stats_cb);
+
+    // client-level settings of every produced topic, they were checked to
+    // agree when the config was loaded
+    struct nosdk_kafka_setting *settings;
+    int n = nosdk_kafka_producer_settings(&settings);
+    for (int i = 0; i < n; i++) {
+        if (!settings[i].topic_level) {
+            nosdk_kafka_conf_set(conf, NULL, &settings[i]);
+        }
+    }
+    free(settings);
+
+    producer->rk =
+        rd_kafka_new(RD_KAFKA_PRODUCER, conf, errstr, sizeof(errstr));
+    if (!producer->rk) {
+        fprintf(stderr, "failed to create producer: %s\n", errstr);
+        return 1;
+    }
+
+    producer->running = 1;
+    if (pthread_create(
+            &producer->poll_thread, NULL, nosdk_kafka_producer_poll_thread,
+            producer) != 0) {
+        fprintf(stderr, "failed to start producer poll thread\n");
+        producer->running = 0;
+        return 1;
+    }
+
+    if (producer->transactional) {
+        return nosdk_kafka_txn_init(producer);
+    }
+
+    return 0;
+}
+
+int nosdk_kafka_init(struct nosdk_kafka *k) {
+    if (k->type == CONSUMER) {
+        return nosdk_kafka_consumer_init(k);
+    } else if (k->type == PRODUCER) {
+        return nosdk_kafka_producer_init(k);
+    }
+    return -1;
+}
+
+void nosdk_kafka_format_header(
+    struct nosdk_string_buffer *sb,
+    const char *name,
+    size_t name_len,
+    const void *value,
+    size_t value_size) {
+    nosdk_string_buffer_append_json_string(sb, name, (int)name_len);
+    nosdk_string_buffer_append(sb, ":");
+    nosdk_string_buffer_append_json_string(
+        sb, value != NULL ? (char *)value : "", (int)value_size);
+    nosdk_string_buffer_append(sb, ",");
+}
+
+void nosdk_kafka_format_headers(
+    struct nosdk_kafka_msg *msg, struct nosdk_string_buffer *sb) {
+    nosdk_string_buffer_append(sb, "{");
+
+    // local records carry their headers encoded
+    if (msg->rkmessage == NULL) {
+        size_t pos = 0;
+        const char *name;
+        size_t name_len;
+        const char *value;
+        size_t value_len;
+        while (nosdk_topiclog_header_next(
+            msg->headers, msg->headers_len, &pos, &name, &name_len, &value,
+            &value_len)) {
+            nosdk_kafka_format_header(sb, name, name_len, value, value_len);
+        }
+    }
+
+    rd_kafka_headers_t *headers = NULL;
+    if (msg->rkmessage != NULL &&
+        rd_kafka_message_headers(msg->rkmessage, &headers) ==
+            RD_KAFKA_RESP_ERR_NO_ERROR) {
+        size_t header_count = rd_kafka_header_cnt(headers);
+        for (size_t i = 0; i < header_count; i++) {
+            const char *name;
+            const void *value;
+            size_t value_size;
+
+            rd_kafka_header_get_all(headers, i, &name, &value, &value_size);
+            nosdk_kafka_format_header(
+                sb, name, strlen(name), value, value_size);
+        }
+    }
+
+    // kafka metadata
+    if (msg->key) {
+        nosdk_string_buffer_append(sb, "\"_key\":");
+        nosdk_string_buffer_append_json_string(
+            sb, (char *)msg->key, (int)msg->key_len);
+        nosdk_string_buffer_append(sb, ",");
+    }
+
+    nosdk_string_buffer_append(sb, "\"_topic\":");
+    nosdk_string_buffer_append_json_string(
+        sb, msg->topic, (int)strlen(msg->topic));
+    nosdk_string_buffer_append(sb, ",\"_partition\":%d,", msg->partition);
+    nosdk_string_buffer_append(sb, "\"_offset\":%" PRId64 "}", msg->offset);
+}
+
+// replace <filepath>.headers atomically, so a reader never sees a partial
+// file or a mix of two messages
+int nosdk_kafka_write_headers(struct nosdk_kafka_msg *msg, char *filepath) {
+    char headers_path[PATH_MAX];
+    char tmp_path[PATH_MAX];
+    snprintf(headers_path, sizeof(headers_path), "%s.headers", filepath);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.headers.tmp", filepath);
+
+    int headers_fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (headers_fd < 0) {
+        return -1;
+    }
+
+    struct nosdk_string_buffer *sb = nosdk_string_buffer_new();
+    nosdk_kafka_format_headers(msg, sb);
+    ssize_t written = write(headers_fd, sb->data, sb->size);
+    nosdk_string_buffer_free(sb);
+    close(headers_fd);
+
+    if (written < 0 || rename(tmp_path, headers_path) != 0) {
+        unlink(tmp_path);
+        return -1;
+    }
+
+    return 0;
+}
+
+// write one frame in the thread's framing, straight from the given buffer
+int nosdk_kafka_write_frame(
+    struct nosdk_kafka_thread_ctx *ctx, int fd, void *data, size_t len) {
+    char prefix[32];
+    struct iovec iov[3];
+    int iovcnt = 0;
+
+    if (ctx->framing == FRAMING_LENGTH) {
+        iov[iovcnt].iov_base = prefix;
+        iov[iovcnt].iov_len = snprintf(prefix, sizeof(prefix), "%zu\n", len);
+        iovcnt++;
+    }
+
+    iov[iovcnt].iov_base = data;
+    iov[iovcnt].iov_len = len;
+    iovcnt++;
+
+    if (ctx->framing == FRAMING_LINES) {
+        iov[iovcnt].iov_base = "\n";
+        iov[iovcnt].iov_len = 1;
+        iovcnt++;
+    }
+
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        total += iov[i].iov_len;
+    }
+    if (nosdk_writev_all(fd, iov, iovcnt) != 0) {
+        return -1;
+    }
+    ctx->written += total;
+    return 0;
+}
+
+#ifdef __linux__
+// write one frame with the payload spliced into the pipe. the pipe then
+// references the payload pages instead of holding a copy, so the payload
+// must stay untouched until the reader has consumed it.
+int nosdk_kafka_splice_frame(
+    struct nosdk_kafka_thread_ctx *ctx, int fd, void *data, size_t len) {
+    if (ctx->framing == FRAMING_LENGTH) {
+        char prefix[32];
+        struct iovec iov = {
+            .iov_base = prefix,
+            .iov_len = snprintf(prefix, sizeof(prefix), "%zu\n", len),
+        };
+        ctx->written += iov.iov_len;
+        if (nosdk_writev_all(fd, &iov, 1) != 0) {
+            return -1;
+        }
+    }
+
+    struct iovec iov = {.iov_base = data, .iov_len = len};
+    while (iov.iov_len > 0) {
+        ssize_t result = vmsplice(fd, &iov, 1, 0);
+        if (result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        iov.iov_base = (char *)iov.iov_base + result;
+        iov.iov_len -= result;
+        ctx->written += result;
+    }
+
+    if (ctx->framing == FRAMING_LINES) {
+        struct iovec newline = {.iov_base = "\n", .iov_len = 1};
+        ctx->written += 1;
+        if (nosdk_writev_all(fd, &newline, 1) != 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// destroy spliced messages the reader has read past. with wait, block
+// until the retention ring has room for another one.
+void nosdk_kafka_splice_reclaim(
+    struct nosdk_kafka_thread_ctx *ctx, int fd, int wait) {
+    while (ctx->num_spliced > 0) {
+        int unread;
+        if (ioctl(fd, FIONREAD, &unread) == 0) {
+            uint64_t consumed = ctx->written - unread;
+            while (ctx->num_spliced > 0 &&
+                   ctx->spliced[ctx->spliced_head].end <= consumed) {
+                nosdk_kafka_msg_destroy(
+                    ctx->spliced[ctx->spliced_head].msg);
+                ctx->spliced_head =
+                    (ctx->spliced_head + 1) % KAFKA_SPLICE_RETAIN;
+                ctx->num_spliced--;
+            }
+        }
+
+        if (!wait || ctx->num_spliced < KAFKA_SPLICE_RETAIN) {
+            return;
+        }
+        usleep(1000);
+    }
+}
+#endif
+
+// destroy every spliced message, once the pipe they went into is gone
+void nosdk_kafka_splice_release(struct nosdk_kafka_thread_ctx *ctx) {
+    while (ctx->num_spliced > 0) {
+        nosdk_kafka_msg_destroy(ctx->spliced[ctx->spliced_head].msg);
+        ctx->spliced_head = (ctx->spliced_head + 1) % KAFKA_SPLICE_RETAIN;
+        ctx->num_spliced--;
+    }
+    ctx->spliced_head = 0;
+    ctx->written = 0;
+}
+
+// write a message with its metadata in-band. inline headers are a
+// single-line JSON block: a frame of their own when the FIFO is framed,
+// otherwise a line ahead of the payload. returns 1 if the payload was
+// spliced and the message must be handed to the retention ring.
+int nosdk_kafka_write_message_frame(
+    struct nosdk_kafka_thread_ctx *ctx, int fd, struct nosdk_kafka_msg *msg) {
+    if (ctx->headers == HEADERS_INLINE) {
+        struct nosdk_string_buffer *sb = nosdk_string_buffer_new();
+        nosdk_kafka_format_headers(msg, sb);
+        if (ctx->framing == FRAMING_NONE) {
+            nosdk_string_buffer_append(sb, "\n");
+        }
+        int ret = nosdk_kafka_write_frame(ctx, fd, sb->data, sb->size);
+        nosdk_string_buffer_free(sb);
+        if (ret != 0) {
+            return ret;
+        }
+    }
+
+#ifdef __linux__
+    // small payloads are cheaper to copy than to keep around
+    if (ctx->splice && msg->len >= KAFKA_SPLICE_MIN) {
+        nosdk_kafka_splice_reclaim(ctx, fd, 1);
+        if (nosdk_kafka_splice_frame(ctx, fd, msg->payload, msg->len) != 0) {
+            return -1;
+        }
+        return 1;
+    }
+#endif
+
+    return nosdk_kafka_write_frame(ctx, fd, msg->payload, msg->len);
+}
+
+char *nosdk_kafka_fifo_path(struct nosdk_kafka_thread_ctx *ctx) {
+    char *buf = malloc(PATH_MAX);
+    if (ctx->k->type == CONSUMER) {
+        snprintf(buf, PATH_MAX, "%s/sub/%s", ctx->root_dir, ctx->topic);
+    } else if (ctx->k->type == PRODUCER) {
+        snprintf(buf, PATH_MAX, "%s/pub/%s", ctx->root_dir, ctx->topic);
+    } else {
+        free(buf);
+        return NULL;
+    }
+    return buf;
+}
+
+int nosdk_kafka_mkfifo(struct nosdk_kafka_thread_ctx *ctx) {
+    char *path = nosdk_kafka_fifo_path(ctx);
+
+    struct stat st;
+    if (stat(path, &st) == -1 && errno == ENOENT) {
+        nosdk_debugf("creating %s\n", path);
+        if (mkfifo(path, S_IRWXU) < 0) {
+            perror("fifo creation");
+            free(path);
+            return -1;
+        }
+    }
+    free(path);
+    return 0;
+}
+
+// a message handed to a worker is acked, unless the topic asks for
+// explicit acks, has a retry policy or the process is transactional. the
+// worker then acks or nacks it over HTTP once processed.
+void nosdk_kafka_written(
+    struct nosdk_kafka *consumer, struct nosdk_kafka_msg *msg) {
+    bool explicit_acks =
+        consumer->messaging != NULL && consumer->messaging->explicit_acks;
+    if (!explicit_acks && consumer->retries == 0 && consumer->txn == NULL) {
+        nosdk_kafka_acks_ack(consumer, msg->partition, msg->offset);
+    }
+}
+
+// keep the subscribe FIFO open and write framed messages back to back.
+// blocking writes give the reader backpressure. a message that could not
+// be written because the reader went away goes to the next reader.
+void nosdk_kafka_consumer_stream(
+    struct nosdk_kafka_thread_ctx *ctx, char *fifo_path) {
+    struct nosdk_kafka_msg *pending = NULL;
+
+#ifdef __linux__
+    // the FIFO stays open, so large payloads can be spliced from rdkafka's
+    // buffers and kept alive until the reader is past them
+    ctx->splice = 1;
+#endif
+
+    while (1) {
+        nosdk_debugf("%s: waiting for stream reader\n", ctx->root_dir);
+
+        int write_fd = open(fifo_path, O_WRONLY);
+        if (write_fd < 0) {
+            perror("opening fifo");
+            break;
+        }
+
+        while (1) {
+            struct nosdk_kafka_msg *msg = pending;
+            pending = NULL;
+            if (msg == NULL) {
+                msg = nosdk_kafka_consumer_next(ctx->k, 500);
+            }
+            if (msg == NULL) {
+#ifdef __linux__
+                nosdk_kafka_splice_reclaim(ctx, write_fd, 0);
+#endif
+                continue;
+            }
+
+            int ret = nosdk_kafka_write_message_frame(ctx, write_fd, msg);
+            if (ret < 0) {
+                nosdk_debugf("%s: stream reader went away\n", ctx->root_dir);
+                pending = msg;
+                break;
+            }
+
+            nosdk_kafka_written(ctx->k, msg);
+            if (ret == 1) {
+                int tail = (ctx->spliced_head + ctx->num_spliced) %
+                           KAFKA_SPLICE_RETAIN;
+                ctx->spliced[tail].msg = msg;
+                ctx->spliced[tail].end = ctx->written;
+                ctx->num_spliced++;
+            } else {
+                nosdk_kafka_msg_destroy(msg);
+            }
+        }
+
+        close(write_fd);
+        nosdk_kafka_splice_release(ctx);
+    }
+
+    if (pending != NULL) {
+        nosdk_kafka_msg_destroy(pending);
+    }
+}
+
+void *nosdk_kafka_consumer_thread(void *arg) {
+    struct nosdk_kafka_thread_ctx *ctx = (struct nosdk_kafka_thread_ctx *)arg;
+    nosdk_debugf(
+        "starting consumer thread for topic %s in %s\n", ctx->k->topic,
+        ctx->root_dir);
+
+    // ignore SIGPIPE so we can handle it
+    signal(SIGPIPE, SIG_IGN);
+
+    if (nosdk_kafka_mkfifo(ctx) < 0) {
+        return NULL;
+    }
+
+    char *fifo_path = nosdk_kafka_fifo_path(ctx);
+
+    if (ctx->framing != FRAMING_NONE) {
+        nosdk_kafka_consumer_stream(ctx, fifo_path);
+        free(fifo_path);
+        return NULL;
+    }
+
+    while (1) {
+        nosdk_debugf("%s: waiting for reader\n ", ctx->root_dir);
+
+        int write_fd = open(fifo_path, O_WRONLY);
+        if (write_fd < 0) {
+            perror("opening fifo");
+            break;
+        }
+
+        struct nosdk_kafka_msg *msg = NULL;
+
+        while (msg == NULL) {
+            nosdk_debugf(
+                "%s: reading connected, polling %s\n", ctx->root_dir,
+                ctx->k->topic);
+            msg = nosdk_kafka_consumer_next(ctx->k, 500);
+        }
+
+        // headers go first so they are in place once the payload is read
+        if (ctx->headers == HEADERS_FILE) {
+            nosdk_kafka_write_headers(msg, fifo_path);
+        }
+
+        // write message to pipe
+        nosdk_kafka_write_message_frame(ctx, write_fd, msg);
+
+        fsync(write_fd);
+        close(write_fd);
+
+        // the commit thread picks up the ack with the next batch
+        nosdk_kafka_written(ctx->k, msg);
+        nosdk_kafka_msg_destroy(msg);
+
+        usleep(3000);
+    }
+
+    return NULL;
+}
+
+// split complete frames from buf[0:len] into msgs. returns the number of
+// bytes consumed, the remainder is an incomplete frame.
+int nosdk_kafka_split_frames(
+    struct nosdk_kafka_thread_ctx *ctx,
+    char *buf,
+    int len,
+    rd_kafka_message_t *msgs,
+    int *count) {
+    int pos = 0;
+    *count = 0;
+
+    if (ctx->framing == FRAMING_NONE) {
+        // every read is one message
+        msgs[0].payload = buf;
+        msgs[0].len = len;
+        *count = 1;
+        return len;
+    }
+
+    while (pos < len && *count < KAFKA_FIFO_BATCH_MAX) {
+        char *newline = memchr(&buf[pos], '\n', len - pos);
+
+        if (ctx->framing == FRAMING_LINES) {
+            if (newline == NULL) {
+                break;
+            }
+            int line_len = newline - &buf[pos];
+            if (line_len > 0) {
+                msgs[*count].payload = &buf[pos];
+                msgs[*count].len = line_len;
+                (*count)++;
+            }
+            pos += line_len + 1;
+        } else {
+            if (newline == NULL) {
+                break;
+            }
+
+            char *end;
+            long frame_len = strtol(&buf[pos], &end, 10);
+            if (end != newline || frame_len < 0 ||
+                frame_len > KAFKA_FIFO_BUF_SIZE - 32) {
+                printf("%s: invalid frame length, skipping\n", ctx->topic);
+                pos = newline - buf + 1;
+                continue;
+            }
+
+            int payload_start = newline - buf + 1;
+            if (payload_start + frame_len > len) {
+                break;
+            }
+
+            msgs[*count].payload = &buf[payload_start];
+            msgs[*count].len = frame_len;
+            (*count)++;
+            pos = payload_start + frame_len;
+        }
+    }
+
+    return pos;
+}
+
+// enqueue a batch of messages, retrying the ones that hit a full queue.
+// the payloads point into chunk and are not copied, every enqueued
+// message holds a reference to it until its delivery report.
+void nosdk_kafka_produce_frames(
+    struct nosdk_kafka *producer,
+    struct nosdk_kafka_topic *topic,
+    rd_kafka_message_t *msgs,
+    int count,
+    struct nosdk_kafka_delivery *chunk) {
+    // a local append copies the frame into the log right away
+    for (int i = 0; topic->log != NULL && i < count; i++) {
+        if (nosdk_topiclog_append(
+                topic->log, -1, NULL, 0, NULL, 0, msgs[i].payload,
+                msgs[i].len, NULL, NULL) != 0) {
+            printf("producer error: failed to append to %s\n", topic->name);
+        }
+    }
+    if (topic->log != NULL) {
+        return;
+    }
+
+    rd_kafka_topic_t *rkt = topic->rkt;
+    while (count > 0) {
+        pthread_mutex_lock(&chunk->mutex);
+        chunk->pending += count;
+        chunk->refs += count;
+        pthread_mutex_unlock(&chunk->mutex);
+
+        for (int i = 0; i < count; i++) {
+            msgs[i].err = RD_KAFKA_RESP_ERR_NO_ERROR;
+            msgs[i]._private = &chunk->results[0];
+        }
+
+        nosdk_kafka_txn_produce_begin(producer);
+        int enqueued =
+            rd_kafka_produce_batch(rkt, RD_KAFKA_PARTITION_UA, 0, msgs, count);
+        nosdk_kafka_txn_produce_end(producer);
+        if (enqueued == count) {
+            return;
+        }
+
+        int retry = 0;
+        for (int i = 0; i < count; i++) {
+            if (msgs[i].err == RD_KAFKA_RESP_ERR_NO_ERROR) {
+                continue;
+            }
+
+            // the producer thread holds a reference, this never frees
+            pthread_mutex_lock(&chunk->mutex);
+            chunk->pending--;
+            chunk->refs--;
+            pthread_mutex_unlock(&chunk->mutex);
+
+            if (msgs[i].err == RD_KAFKA_RESP_ERR__QUEUE_FULL) {
+                msgs[retry++] = msgs[i];
+            } else {
+                printf("producer error: %s\n", rd_kafka_err2str(msgs[i].err));
+            }
+        }
+
+        count = retry;
+        if (count > 0) {
+            // the poll thread drains delivery reports meanwhile
+            usleep(1000);
+        }
+    }
+}
+
+// a buffer the FIFO is read into. nobody waits on its delivery reports,
+// it is freed once the producer thread and every message released it.
+struct nosdk_kafka_delivery *nosdk_kafka_fifo_chunk_new() {
+    struct nosdk_kafka_delivery *chunk =
+        nosdk_kafka_delivery_new(malloc(KAFKA_FIFO_BUF_SIZE), 1);
+    chunk->detached = 1;
+    return chunk;
+}
+
+void *nosdk_kafka_producer_thread(void *arg) {
+    struct nosdk_kafka_thread_ctx *ctx = (struct nosdk_kafka_thread_ctx *)arg;
+    nosdk_debugf(
+        "starting producer thread for topic %s in %s\n", ctx->topic,
+        ctx->root_dir);
+
+    struct nosdk_kafka_topic *topic =
+        nosdk_kafka_producer_topic(ctx->k, ctx->topic);
+    if (topic == NULL) {
+        return NULL;
+    }
+
+    if (nosdk_kafka_mkfifo(ctx) < 0) {
+        return NULL;
+    }
+
+    // frames are produced straight out of the chunk they were read into.
+    // consumed bytes stay in place for rdkafka, only an incomplete frame at
+    // the end of a full chunk is copied over to a fresh one.
+    struct nosdk_kafka_delivery *chunk = nosdk_kafka_fifo_chunk_new();
+    int buf_start = 0;
+    int buf_len = 0;
+    rd_kafka_message_t *msgs =
+        calloc(KAFKA_FIFO_BATCH_MAX, sizeof(rd_kafka_message_t));
+
+    char *fifo_path = nosdk_kafka_fifo_path(ctx);
+
+    int read_fd = open(fifo_path, O_RDONLY | O_NONBLOCK);
+    if (read_fd < 0) {
+        perror("opening fifo");
+        nosdk_kafka_delivery_release(chunk);
+        free(msgs);
+        free(fifo_path);
+        return NULL;
+    }
+
+    // hold a write end open ourselves so the FIFO never reports EOF between
+    // writers and partial frames carry over to the next one
+    int hold_fd = open(fifo_path, O_WRONLY | O_NONBLOCK);
+
+    struct pollfd pfd[1] = {
+        {
+            .fd = read_fd,
+            .events = POLLIN | POLLHUP,
+        },
+    };
+
+    while (1) {
+        int ready = poll(pfd, 1, -1);
+        nosdk_debugf("producer: %d poll fds are ready\n", ready);
+
+        if (ready == -1) {
+            perror("poll error");
+            break;
+        } else if (ready == 0) {
+            continue;
+        }
+
+        if (pfd[0].revents & POLLIN) {
+            if (buf_len == KAFKA_FIFO_BUF_SIZE) {
+                if (buf_start == 0) {
+                    printf(
+                        "%s: frame exceeds %d bytes, dropping\n", ctx->topic,
+                        KAFKA_FIFO_BUF_SIZE);
+                    buf_start = buf_len;
+                }
+
+                struct nosdk_kafka_delivery *next =
+                    nosdk_kafka_fifo_chunk_new();
+                memcpy(
+                    next->body, &chunk->body[buf_start], buf_len - buf_start);
+                buf_len -= buf_start;
+                buf_start = 0;
+                nosdk_kafka_delivery_release(chunk);
+                chunk = next;
+            }
+
+            ssize_t result = read(
+                read_fd, &chunk->body[buf_len], KAFKA_FIFO_BUF_SIZE - buf_len);
+
+            if (result <= 0) {
+                continue;
+            }
+
+            nosdk_debugf("producer read %zd bytes\n", result);
+            buf_len += result;
+
+            while (buf_start < buf_len) {
+                int count;
+                int used = nosdk_kafka_split_frames(
+                    ctx, &chunk->body[buf_start], buf_len - buf_start, msgs,
+                    &count);
+                if (count == 0 && used == 0) {
+                    break;
+                }
+                nosdk_kafka_produce_frames(
+                    ctx->k, topic, msgs, count, chunk);
+                buf_start += used;
+            }
+        } else if (pfd[0].revents & POLLHUP || pfd[0].revents & POLLERR) {
+            printf("process hung up\n");
+            // this never happens...
+        }
+    }
+
+    if (hold_fd >= 0) {
+        close(hold_fd);
+    }
+    close(read_fd);
+
+    if (ctx->k->rk != NULL) {
+        rd_kafka_flush(ctx->k->rk, 5000);
+    }
+    nosdk_kafka_delivery_release(chunk);
+    free(msgs);
+    free(fifo_path);
+    return NULL;
+}
+
+// the path segment following /msg/<topic>/, or NULL
+char *get_topic_action(struct nosdk_http_request *req) {
+    char *topic_prefix = "/msg/";
+    char *rest = &req->path[strlen(topic_prefix)];
+
+    while (*rest != '\0' && *rest != '/' && *rest != '?') {
+        rest++;
+    }
+    if (*rest != '/') {
+        return NULL;
+    }
+
+    char *action = strdup(rest + 1);
+    for (int i = 0; action[i] != '\0'; i++) {
+        if (action[i] == '?' || action[i] == '/') {
+            action[i] = '\0';
+            break;
+        }
+    }
+    return action;
+}
+
+char *get_topic_name(struct nosdk_http_request *req) {
+    char *topic_prefix = "/msg/";
+    char *name = strdup(&req->path[strlen(topic_prefix)]);
+    int len = strlen(name);
+
+    for (int i = 0; i < len; i++) {
+        name[i] = tolower(name[i]);
+        if (name[i] == '?' || name[i] == '/') {
+            name[i] = '\0';
+        }
+    }
+    return name;
+}
+
+// the consumer of the replica whose server received the request
+struct nosdk_kafka *nosdk_kafka_request_consumer(
+    struct nosdk_http_request *req, char *topic_name) {
+    int replica = req->ctx != NULL ? *(int *)req->ctx : 0;
+    return nosdk_kafka_mgr_get_consumer(topic_name, replica);
+}
+
+// respond with the next prefetched message, returns 0 if there is none
+int nosdk_kafka_sub_respond(
+    struct nosdk_http_request *req, struct nosdk_kafka *consumer) {
+    struct nosdk_kafka_msg *msg = nosdk_kafka_consumer_next(consumer, 0);
+    if (msg == NULL) {
+        return 0;
+    }
+
+    // workers acknowledge messages by topic, partition and offset. the
+    // topic is a retry tier's for redelivered messages.
+    struct nosdk_http_header headers[4];
+    int num_headers = 3;
+    snprintf(headers[0].name, sizeof(headers[0].name), "X-Nosdk-Partition");
+    snprintf(
+        headers[0].value, sizeof(headers[0].value), "%d", msg->partition);
+    snprintf(headers[1].name, sizeof(headers[1].name), "X-Nosdk-Offset");
+    snprintf(
+        headers[1].value, sizeof(headers[1].value), "%" PRId64, msg->offset);
+    snprintf(headers[2].name, sizeof(headers[2].name), "X-Nosdk-Topic");
+    snprintf(headers[2].value, sizeof(headers[2].value), "%s", msg->topic);
+    if (msg->key != NULL) {
+        snprintf(headers[3].name, sizeof(headers[3].name), "X-Nosdk-Key");
+        snprintf(
+            headers[3].value, sizeof(headers[3].value), "%.*s",
+            (int)msg->key_len, (char *)msg->key);
+        num_headers++;
+    }
+
+    nosdk_http_respond_headers(
+        req, HTTP_STATUS_OK, "application/json", headers, num_headers,
+        (char *)msg->payload, msg->len);
+
+    nosdk_kafka_written(msg->consumer, msg);
+    nosdk_kafka_msg_destroy(msg);
+    return 1;
+}
+
+int nosdk_kafka_sub_resume(
+    struct nosdk_http_request *req, void *arg, int expired) {
+    struct nosdk_kafka *consumer = (struct nosdk_kafka *)arg;
+    if (!nosdk_kafka_sub_respond(req, consumer)) {
+        if (!expired) {
+            return 0;
+        }
+        nosdk_http_respond(req, HTTP_STATUS_OK, "application/json", "null", 4);
+    }
+
+    atomic_fetch_sub(&consumer->parked, 1);
+    return 1;
+}
+
+// a request with nothing to take parks until the fetch thread wakes the
+// server, so idle topics hold up neither the server nor a thread
+void nosdk_kafka_sub_handler(struct nosdk_http_request *req) {
+    char *topic_name = get_topic_name(req);
+    struct nosdk_kafka *consumer =
+        nosdk_kafka_request_consumer(req, topic_name);
+    free(topic_name);
+    if (consumer == NULL) {
+        nosdk_http_respond(
+            req, HTTP_STATUS_INTERNAL_ERROR, "text/plain", NULL, 0);
+        return;
+    }
+
+    // counted as parked before looking, so a message pushed meanwhile
+    // either is found here or wakes the server
+    consumer->server = req->server;
+    atomic_fetch_add(&consumer->parked, 1);
+    if (nosdk_kafka_sub_respond(req, consumer)) {
+        atomic_fetch_sub(&consumer->parked, 1);
+        return;
+    }
+
+    nosdk_http_park(req, KAFKA_SUB_WAIT_MS, nosdk_kafka_sub_resume, consumer);
+}
+
+// the owned partitions of a local consumer and the offsets it reads next
+rd_kafka_topic_partition_list_t *
+nosdk_kafka_local_assignment(struct nosdk_kafka *consumer) {
+    rd_kafka_topic_partition_list_t *assignment =
+        rd_kafka_topic_partition_list_new(consumer->log->num_partitions);
+    for (int p = 0; p < consumer->log->num_partitions; p++) {
+        if (!consumer->owned[p]) {
+            continue;
+        }
+        int64_t position = consumer->positions[p];
+        if (position < 0) {
+            position = nosdk_topiclog_committed(
+                consumer->log, consumer->group, p);
+        }
+        rd_kafka_topic_partition_list_add(assignment, consumer->topic, p)
+            ->offset = position;
+    }
+    return assignment;
+}
+
+void nosdk_kafka_consumer_lag(
+    struct nosdk_kafka *consumer, struct nosdk_string_buffer *sb) {
+    rd_kafka_topic_partition_list_t *assignment = NULL;
+    if (consumer->rk == NULL) {
+        assignment = nosdk_kafka_local_assignment(consumer);
+    } else {
+        if (rd_kafka_assignment(consumer->rk, &assignment) !=
+            RD_KAFKA_RESP_ERR_NO_ERROR) {
+            assignment = rd_kafka_topic_partition_list_new(0);
+        }
+        rd_kafka_position(consumer->rk, assignment);
+    }
+
+    int64_t total = 0;
+    nosdk_string_buffer_append(
+        sb, "{\"replica\":%d,\"partitions\":[", consumer->replica);
+    for (int i = 0; i < assignment->cnt; i++) {
+        rd_kafka_topic_partition_t *tp = &assignment->elems[i];
+        int64_t low = -1, high = -1;
+        if (consumer->rk == NULL) {
+            high = nosdk_topiclog_end(consumer->log, tp->partition);
+        } else {
+            rd_kafka_get_watermark_offsets(
+                consumer->rk, tp->topic, tp->partition, &low, &high);
+        }
+
+        // unacked messages count as lag, they may still be redelivered
+        int64_t acked = tp->offset;
+        pthread_mutex_lock(&consumer->acks.mutex);
+        struct nosdk_kafka_ack_partition *p =
+            nosdk_kafka_acks_find(&consumer->acks, tp->partition);
+        if (p != NULL) {
+            acked = p->base;
+        }
+        pthread_mutex_unlock(&consumer->acks.mutex);
+
+        int64_t lag = 0;
+        if (high >= 0 && acked >= 0 && high > acked) {
+            lag = high - acked;
+        }
+        total += lag;
+
+        nosdk_string_buffer_append(
+            sb,
+            "%s{\"partition\":%d,\"position\":%" PRId64
+            ",\"acked\":%" PRId64 ",\"high\":%" PRId64 ",\"lag\":%" PRId64
+            "}",
+            i > 0 ? "," : "", tp->partition, tp->offset, acked, high, lag);
+    }
+    nosdk_string_buffer_append(sb, "],\"lag\":%" PRId64 "}", total);
+
+    rd_kafka_topic_partition_list_destroy(assignment);
+}
+
+// GET /msg/<topic>/lag reports the partitions owned by the replica and how
+// far its acknowledgements trail the end of each
+void nosdk_kafka_lag_handler(struct nosdk_http_request *req) {
+    char *topic_name = get_topic_name(req);
+    struct nosdk_kafka *consumer =
+        nosdk_kafka_request_consumer(req, topic_name);
+    free(topic_name);
+    if (consumer == NULL) {
+        nosdk_http_respond(req, HTTP_STATUS_NOT_FOUND, "text/plain", NULL, 0);
+        return;
+    }
+
+    struct nosdk_string_buffer *sb = nosdk_string_buffer_new();
+    nosdk_kafka_consumer_lag(consumer, sb);
+    nosdk_http_respond(
+        req, HTTP_STATUS_OK, "application/json", sb->data, sb->size);
+    nosdk_string_buffer_free(sb);
+}
+
+// the consumer a message of topic was fetched by: the consumer itself, or
+// one of its retry tiers
+struct nosdk_kafka *nosdk_kafka_ack_target(
+    struct nosdk_kafka *consumer, char *topic, int topic_len) {
+    if ((int)strlen(consumer->topic) == topic_len &&
+        memcmp(consumer->topic, topic, topic_len) == 0) {
+        return consumer;
+    }
+
+    for (int i = 0; i < kafka_mgr->num_kafkas; i++) {
+        struct nosdk_kafka *k = kafka_mgr->kafkas[i];
+        if (k->retry_of == consumer && (int)strlen(k->topic) == topic_len &&
+            memcmp(k->topic, topic, topic_len) == 0) {
+            return k;
+        }
+    }
+    return NULL;
+}
+
+// read the JSON integer spanning len bytes at json. returns -1 for
+// strings, fractions and anything else that is not a plain integer.
+int nosdk_kafka_json_int(char *json, int len, int64_t *value) {
+    if (len == 0 || (json[0] != '-' && !isdigit((unsigned char)json[0]))) {
+        return -1;
+    }
+
+    char *end;
+    errno = 0;
+    long long n = strtoll(json, &end, 10);
+    if (end != &json[len] || errno == ERANGE) {
+        return -1;
+    }
+    *value = n;
+    return 0;
+}
+
+// ack or nack one partition/offset object. messages from a retry tier name
+// their topic.
+int nosdk_kafka_ack_item(
+    struct nosdk_kafka *consumer, char *item, int len, int nack) {
+    int start, span_len;
+
+    if (json_object_get(item, len, "topic", &start, &span_len)) {
+        json_unquote(item, &start, &span_len);
+        consumer = nosdk_kafka_ack_target(consumer, &item[start], span_len);
+        if (consumer == NULL) {
+            return -1;
+        }
+    }
+
+    int64_t partition, offset;
+    if (!json_object_get(item, len, "partition", &start, &span_len) ||
+        nosdk_kafka_json_int(&item[start], span_len, &partition) != 0 ||
+        partition < 0 || partition > INT32_MAX) {
+        return -1;
+    }
+    if (!json_object_get(item, len, "offset", &start, &span_len) ||
+        nosdk_kafka_json_int(&item[start], span_len, &offset) != 0 ||
+        offset < 0) {
+        return -1;
     }
 
-    producer->rk =
-        rd_kafka_new(RD_KAFKA_PRODUCER, conf, errstr, sizeof(errstr));
-    if (!producer->rk) {
-        fprintf(stderr, "failed to create producer: %s\n", errstr);
-        return 1;
+    if (nack) {
+        char *reason = NULL;
+        int reason_len = 0;
+        if (json_object_get(item, len, "error", &start, &span_len)) {
+            json_unquote(item, &start, &span_len);
+            reason = &item[start];
+            reason_len = span_len;
+        }
+        return nosdk_kafka_nack(
+            consumer, partition, offset, reason, reason_len);
     }
 
-    return 0;
+    return nosdk_kafka_acks_ack(consumer, partition, offset);
 }
 
-int nosdk_kafka_init(struct nosdk_kafka *k) {
-    if (k->type == CONSUMER) {
-        return nosdk_kafka_consumer_init(k);
-    } else if (k->type == PRODUCER) {
-        return nosdk_kafka_producer_init(k);
+// POST /msg/<topic>/ack with one or an array of partition/offset objects.
+// POST /msg/<topic>/nack takes the same body, with an optional "error".
+void nosdk_kafka_ack_handler(struct nosdk_http_request *req, int nack) {
+    char *topic_name = get_topic_name(req);
+    struct nosdk_kafka *consumer =
+        nosdk_kafka_request_consumer(req, topic_name);
+    free(topic_name);
+    if (consumer == NULL) {
+        nosdk_http_respond(req, HTTP_STATUS_NOT_FOUND, "text/plain", NULL, 0);
+        return;
     }
-    return -1;
-}
-
-int nosdk_kafka_write_headers(rd_kafka_message_t *msg, char *filepath) {
-    char headers_path[512];
-    snprintf(headers_path, sizeof(headers_path), "%s.headers", filepath);
 
-    int headers_fd = open(headers_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-    if (headers_fd >= 0) {
-        dprintf(headers_fd, "{");
+    char *body = nosdk_http_request_body_alloc(req);
+    int body_len = req->content_length;
+    int acked = 0;
+    int rejected = 0;
 
-        rd_kafka_headers_t *headers = rd_kafka_headers_new(10);
-        rd_kafka_message_headers(msg, &headers);
-        if (headers) {
-            size_t header_count = rd_kafka_header_cnt(headers);
-            for (size_t i = 0; i < header_count; i++) {
-                const char *name;
-                const void *value;
-                size_t value_size;
+    int first = 0;
+    while (first < body_len && isspace((unsigned char)body[first])) {
+        first++;
+    }
 
-                rd_kafka_header_get_all(headers, i, &name, &value, &value_size);
-                dprintf(
-                    headers_fd, "\"%s\":\"%.*s\",", name, (int)value_size,
-                    (char *)value);
+    if (first < body_len && body[first] == '[') {
+        struct json_array_iter iter = {
+            .data = body,
+            .data_len = body_len,
+        };
+        int start, len;
+        while (json_array_next_value(&iter, &start, &len)) {
+            if (nosdk_kafka_ack_item(consumer, &body[start], len, nack) ==
+                0) {
+                acked++;
+            } else {
+                rejected++;
             }
         }
-
-        // kafka metadata
-        if (msg->key) {
-            dprintf(
-                headers_fd, "\"_key\":\"%.*s\",", (int)msg->key_len,
-                (char *)msg->key);
-        }
-
-        dprintf(headers_fd, "\"_partition\":%d,\n", msg->partition);
-        dprintf(headers_fd, "\"_offset\":%" PRId64 "}", msg->offset);
-        close(headers_fd);
+    } else if (
+        nosdk_kafka_ack_item(
+            consumer, &body[first], body_len - first, nack) == 0) {
+        acked++;
+    } else {
+        rejected++;
     }
 
-    return 0;
+    free(body);
+
+    char response[64];
+    int response_len = snprintf(
+        response, sizeof(response), "{\"%s\":%d,\"rejected\":%d}",
+        nack ? "nacked" : "acked", acked, rejected);
+    nosdk_http_respond(
+        req, rejected == 0 ? HTTP_STATUS_OK : HTTP_STATUS_INVALID_REQUEST,
+        "application/json", response, response_len);
 }
 
-char *nosdk_kafka_fifo_path(struct nosdk_kafka *k, char *root_dir) {
-    char *buf = malloc(PATH_MAX);
-    if (k->type == CONSUMER) {
-        snprintf(buf, PATH_MAX, "%s/sub/%s", root_dir, k->topic);
-    } else if (k->type == PRODUCER) {
-        snprintf(buf, PATH_MAX, "%s/pub/%s", root_dir, k->topic);
-    } else {
-        return NULL;
+void nosdk_kafka_headers_add_json(
+    rd_kafka_headers_t *headers, char *buf, int len) {
+    struct json_object_iter iter = {
+        .data = buf,
+        .data_len = len,
+    };
+    int key_start, key_len, value_start, value_len;
+
+    while (json_object_next_member(
+        &iter, &key_start, &key_len, &value_start, &value_len)) {
+        json_unquote(buf, &value_start, &value_len);
+        rd_kafka_header_add(
+            headers, &buf[key_start], key_len, &buf[value_start], value_len);
     }
-    return buf;
 }
 
-int nosdk_kafka_mkfifo(struct nosdk_kafka *k, char *root_dir) {
-    char *path = nosdk_kafka_fifo_path(k, root_dir);
+// read the X-Nosdk-Key, X-Nosdk-Partition and X-Nosdk-Header-<name>
+// request headers. returns -1 if the partition is not a number.
+int nosdk_kafka_produce_opts_parse(
+    struct nosdk_http_request *req, struct nosdk_kafka_produce_opts *opts) {
+    const char *header_prefix = "x-nosdk-header-";
+    int prefix_len = strlen(header_prefix);
 
-    struct stat st;
-    if (stat(path, &st) == -1 && errno == ENOENT) {
-        nosdk_debugf("creating %s\n", path);
-        if (mkfifo(path, S_IRWXU) < 0) {
-            perror("fifo creation");
-            free(path);
-            return -1;
+    opts->key = NULL;
+    opts->key_len = 0;
+    opts->partition = RD_KAFKA_PARTITION_UA;
+    opts->headers = NULL;
+
+    for (int i = 0; i < req->num_headers; i++) {
+        struct nosdk_http_header *h = &req->headers[i];
+
+        if (strcasecmp(h->name, "x-nosdk-key") == 0) {
+            opts->key = h->value;
+            opts->key_len = strlen(h->value);
+        } else if (strcasecmp(h->name, "x-nosdk-partition") == 0) {
+            char *end;
+            long partition = strtol(h->value, &end, 10);
+            if (end == h->value || *end != '\0' || partition < 0) {
+                return -1;
+            }
+            opts->partition = (int32_t)partition;
+        } else if (strncasecmp(h->name, header_prefix, prefix_len) == 0) {
+            if (opts->headers == NULL) {
+                opts->headers = rd_kafka_headers_new(8);
+            }
+            rd_kafka_header_add(
+                opts->headers, &h->name[prefix_len], -1, h->value, -1);
         }
     }
-    free(path);
+
     return 0;
 }
 
-void *nosdk_kafka_consumer_thread(void *arg) {
-    struct nosdk_kafka_thread_ctx *ctx = (struct nosdk_kafka_thread_ctx *)arg;
-    nosdk_debugf(
-        "starting consumer thread for topic %s in %s\n", ctx->k->topic,
-        ctx->root_dir);
-
-    // ignore SIGPIPE so we can handle it
-    signal(SIGPIPE, SIG_IGN);
+// append one message to a local log. the append is durable once the
+// flusher syncs it, so the delivery completes right away.
+rd_kafka_resp_err_t nosdk_kafka_produce_local(
+    struct nosdk_topiclog *log,
+    int32_t partition,
+    const char *key,
+    int key_len,
+    rd_kafka_headers_t *headers,
+    char *value,
+    int value_len,
+    struct nosdk_kafka_delivery_result *result) {
+    size_t header_count = headers != NULL ? rd_kafka_header_cnt(headers) : 0;
+    size_t headers_len = 0;
+    for (size_t i = 0; i < header_count; i++) {
+        const char *name;
+        const void *header_value;
+        size_t value_size;
+        rd_kafka_header_get_all(
+            headers, i, &name, &header_value, &value_size);
+        headers_len += nosdk_topiclog_header_size(strlen(name), value_size);
+    }
 
-    if (nosdk_kafka_mkfifo(ctx->k, ctx->root_dir) < 0) {
-        return NULL;
+    char *encoded = headers_len > 0 ? malloc(headers_len) : NULL;
+    char *dst = encoded;
+    for (size_t i = 0; i < header_count; i++) {
+        const char *name;
+        const void *header_value;
+        size_t value_size;
+        rd_kafka_header_get_all(
+            headers, i, &name, &header_value, &value_size);
+        dst = nosdk_topiclog_header_put(
+            dst, name, strlen(name), header_value, value_size);
     }
 
-    char *fifo_path = nosdk_kafka_fifo_path(ctx->k, ctx->root_dir);
+    int32_t partition_out;
+    int64_t offset_out;
+    int ret = nosdk_topiclog_append(
+        log, partition == RD_KAFKA_PARTITION_UA ? -1 : partition, key,
+        key != NULL ? key_len : 0, encoded, headers_len, value, value_len,
+        &partition_out, &offset_out);
+    free(encoded);
 
-    while (1) {
-        nosdk_debugf("%s: waiting for reader\n ", ctx->root_dir);
+    if (ret != 0) {
+        return partition >= log->num_partitions
+                   ? RD_KAFKA_RESP_ERR__UNKNOWN_PARTITION
+                   : RD_KAFKA_RESP_ERR__FS;
+    }
 
-        int write_fd = open(fifo_path, O_WRONLY);
-        if (write_fd < 0) {
-            perror("opening fifo");
-            break;
-        }
+    nosdk_kafka_delivery_complete(
+        result, RD_KAFKA_RESP_ERR_NO_ERROR, partition_out, offset_out);
+    return RD_KAFKA_RESP_ERR_NO_ERROR;
+}
 
-        rd_kafka_message_t *msg;
-        int no_message = 1;
+// enqueue a message whose payload stays valid until its delivery report.
+// takes the headers.
+rd_kafka_resp_err_t nosdk_kafka_produce_message(
+    struct nosdk_kafka *producer,
+    struct nosdk_kafka_topic *topic,
+    int32_t partition,
+    const char *key,
+    int key_len,
+    rd_kafka_headers_t *headers,
+    char *value,
+    int value_len,
+    struct nosdk_kafka_delivery_result *result) {
+    rd_kafka_resp_err_t err;
+    rd_kafka_topic_t *rkt = topic->rkt;
 
-        while (no_message) {
-            nosdk_debugf(
-                "%s: reading connected, polling %s\n", ctx->root_dir,
-                ctx->k->topic);
-            msg = rd_kafka_consumer_poll(ctx->k->rk, 500);
-            no_message = (msg == NULL);
+    if (topic->log != NULL) {
+        err = nosdk_kafka_produce_local(
+            topic->log, partition, key, key_len, headers, value, value_len,
+            result);
+        if (headers != NULL) {
+            rd_kafka_headers_destroy(headers);
         }
-
-        if (msg->err != RD_KAFKA_RESP_ERR_NO_ERROR) {
-            printf("poll error: %s\n", rd_kafka_err2str(msg->err));
-            rd_kafka_message_destroy(msg);
-            close(write_fd);
-            continue;
+    } else if (headers != NULL) {
+        nosdk_kafka_txn_produce_begin(producer);
+        err = rd_kafka_producev(
+            producer->rk, RD_KAFKA_V_RKT(rkt), RD_KAFKA_V_PARTITION(partition),
+            RD_KAFKA_V_VALUE(value, value_len), RD_KAFKA_V_KEY(key, key_len),
+            RD_KAFKA_V_HEADERS(headers),
+            RD_KAFKA_V_MSGFLAGS(RD_KAFKA_MSG_F_BLOCK),
+            RD_KAFKA_V_OPAQUE(result), RD_KAFKA_V_END);
+        nosdk_kafka_txn_produce_end(producer);
+        if (err != RD_KAFKA_RESP_ERR_NO_ERROR) {
+            // headers are only owned by rdkafka on success
+            rd_kafka_headers_destroy(headers);
         }
+    } else {
+        nosdk_kafka_txn_produce_begin(producer);
+        err = rd_kafka_producev(
+            producer->rk, RD_KAFKA_V_RKT(rkt), RD_KAFKA_V_PARTITION(partition),
+            RD_KAFKA_V_VALUE(value, value_len), RD_KAFKA_V_KEY(key, key_len),
+            RD_KAFKA_V_MSGFLAGS(RD_KAFKA_MSG_F_BLOCK),
+            RD_KAFKA_V_OPAQUE(result), RD_KAFKA_V_END);
+        nosdk_kafka_txn_produce_end(producer);
+    }
 
-        // write message to pipe
-        int total_written = 0;
+    return err;
+}
 
-        while (total_written < msg->len) {
-            ssize_t result = write(
-                write_fd, (char *)msg->payload + total_written,
-                msg->len - total_written);
-            total_written += result;
-        }
+// enqueue one message. a batch element that is an object with a "_value"
+// key is an envelope that may also carry a "_key", a "_partition" and a
+// "_headers" object, anything else is published as-is. envelope fields
+// take precedence over the request-level options.
+rd_kafka_resp_err_t nosdk_kafka_produce_element(
+    struct nosdk_kafka *producer,
+    struct nosdk_kafka_topic *topic,
+    struct nosdk_kafka_produce_opts *opts,
+    char *data,
+    int len,
+    int is_batch,
+    struct nosdk_kafka_delivery_result *result) {
 
-        // write headers
-        nosdk_kafka_write_headers(msg, fifo_path);
+    char *value = data;
+    int value_len = len;
+    const char *key = opts->key;
+    int key_len = opts->key_len;
+    int32_t partition = opts->partition;
+    rd_kafka_headers_t *headers = NULL;
+    int start, span_len;
 
-        fsync(write_fd);
-        close(write_fd);
+    if (opts->headers != NULL) {
+        headers = rd_kafka_headers_copy(opts->headers);
+    }
+
+    if (is_batch && len > 0 && data[0] == '{' &&
+        json_object_get(data, len, "_value", &start, &span_len)) {
+        value = &data[start];
+        value_len = span_len;
 
-        // commit and destroy
-        rd_kafka_resp_err_t commit_err =
-            rd_kafka_commit_message(ctx->k->rk, msg, 1);
-        if (commit_err != RD_KAFKA_RESP_ERR_NO_ERROR) {
-            printf("commit error: %s\n", rd_kafka_err2str(commit_err));
+        if (json_object_get(data, len, "_key", &start, &span_len)) {
+            json_unquote(data, &start, &span_len);
+            key = &data[start];
+            key_len = span_len;
         }
-        rd_kafka_message_destroy(msg);
 
-        usleep(3000);
+        // validated like X-Nosdk-Partition, the element fails on its own
+        int64_t n;
+        if (json_object_get(data, len, "_partition", &start, &span_len)) {
+            if (nosdk_kafka_json_int(&data[start], span_len, &n) != 0 ||
+                n < 0 || n > INT32_MAX) {
+                if (headers != NULL) {
+                    rd_kafka_headers_destroy(headers);
+                }
+                return RD_KAFKA_RESP_ERR__INVALID_ARG;
+            }
+            partition = (int32_t)n;
+        }
+
+        if (json_object_get(data, len, "_headers", &start, &span_len)) {
+            if (headers == NULL) {
+                headers = rd_kafka_headers_new(8);
+            }
+            nosdk_kafka_headers_add_json(headers, &data[start], span_len);
+        }
     }
 
-    return NULL;
+    return nosdk_kafka_produce_message(
+        producer, topic, partition, key, key_len, headers, value, value_len,
+        result);
 }
 
-void *nosdk_kafka_producer_thread(void *arg) {
-    struct nosdk_kafka_thread_ctx *ctx = (struct nosdk_kafka_thread_ctx *)arg;
-    nosdk_debugf(
-        "starting producer thread for topic %s in %s\n", ctx->k->topic,
-        ctx->root_dir);
-
-    if (nosdk_kafka_mkfifo(ctx->k, ctx->root_dir) < 0) {
-        return NULL;
-    }
+struct nosdk_kafka_span {
+    int start;
+    int len;
+};
 
-    // kafka max message size is 1mb!
-    char *msg_buf = malloc(1000 * 1000);
+// split a publish body into message spans: the elements of a JSON array,
+// the non-empty lines of an NDJSON body, or the whole body
+int nosdk_kafka_split_body(
+    char *body,
+    int body_len,
+    int is_ndjson,
+    struct nosdk_kafka_span **spans_out) {
 
-    char *fifo_path = nosdk_kafka_fifo_path(ctx->k, ctx->root_dir);
+    int capacity = 16;
+    int count = 0;
+    struct nosdk_kafka_span *spans =
+        malloc(sizeof(struct nosdk_kafka_span) * capacity);
 
-    int read_fd = open(fifo_path, O_RDONLY | O_NONBLOCK);
-    if (read_fd < 0) {
-        perror("opening fifo");
-        free(msg_buf);
-        free(fifo_path);
-        return NULL;
+    int first = 0;
+    while (first < body_len && isspace((unsigned char)body[first])) {
+        first++;
     }
 
-    struct pollfd pfd[1] = {
-        {
-            .fd = read_fd,
-            .events = POLLIN | POLLHUP,
-        },
+    struct nosdk_kafka_span span;
+    struct json_array_iter iter = {
+        .data = body,
+        .data_len = body_len,
     };
+    int line_start = 0;
 
     while (1) {
-        int ready = poll(pfd, 1, -1);
-        nosdk_debugf("producer: %d poll fds are ready\n", ready);
-
-        if (ready == -1) {
-            perror("poll error");
-            break;
-        } else if (ready == 0) {
-            continue;
-        }
-
-        if (pfd[0].revents & POLLIN) {
-            ssize_t result = read(read_fd, msg_buf, 1000 * 1000);
-
-            nosdk_debugf("producer read data: %.*s\n", (int)result, msg_buf);
+        if (is_ndjson) {
+            if (line_start >= body_len) {
+                break;
+            }
+            int line_end = line_start;
+            while (line_end < body_len && body[line_end] != '\n') {
+                line_end++;
+            }
+            span.start = line_start;
+            span.len = line_end - line_start;
+            line_start = line_end + 1;
 
-            if (result == 0) {
+            while (span.len > 0 &&
+                   isspace((unsigned char)body[span.start + span.len - 1])) {
+                span.len--;
+            }
+            if (span.len == 0) {
                 continue;
             }
-
-            rd_kafka_producev(
-                ctx->k->rk, RD_KAFKA_V_TOPIC(ctx->k->topic),
-                RD_KAFKA_V_VALUE(msg_buf, result), RD_KAFKA_V_END);
-        } else if (pfd[0].revents & POLLHUP || pfd[0].revents & POLLERR) {
-            printf("process hung up\n");
-            // this never happens...
+        } else if (first < body_len && body[first] == '[') {
+            if (!json_array_next_value(&iter, &span.start, &span.len)) {
+                break;
+            }
+        } else {
+            span.start = 0;
+            span.len = body_len;
+            spans[count++] = span;
+            break;
         }
-    }
-
-    close(read_fd);
-
-    rd_kafka_flush(ctx->k->rk, 5000);
-    free(msg_buf);
-    free(fifo_path);
-    return NULL;
-}
 
-char *get_topic_name(struct nosdk_http_request *req) {
-    char *topic_prefix = "/msg/";
-    char *name = strdup(&req->path[strlen(topic_prefix)]);
-    int len = strlen(name);
-
-    for (int i = 0; i < len; i++) {
-        name[i] = tolower(name[i]);
-        if (name[i] == '?' || name[i] == '/') {
-            name[i] = '\0';
+        if (count == capacity) {
+            capacity *= 2;
+            spans = realloc(spans, sizeof(struct nosdk_kafka_span) * capacity);
         }
+        spans[count++] = span;
     }
-    return name;
+
+    *spans_out = spans;
+    return count;
 }
 
-void nosdk_kafka_sub_handler(struct nosdk_http_request *req) {
+void nosdk_kafka_pub_handler(struct nosdk_http_request *req) {
     char *topic_name = get_topic_name(req);
-    struct nosdk_kafka *consumer = nosdk_kafka_mgr_get_consumer(topic_name);
-    if (consumer == NULL) {
+    int replica = req->ctx != NULL ? *(int *)req->ctx : 0;
+    struct nosdk_kafka *producer = nosdk_kafka_mgr_process_producer(replica);
+    if (producer == NULL) {
         free(topic_name);
         nosdk_http_respond(
             req, HTTP_STATUS_INTERNAL_ERROR, "text/plain", NULL, 0);
         return;
     }
 
-    rd_kafka_message_t *msg = NULL;
-    for (int i = 0; i < 20 && msg == NULL; i++) {
-        msg = rd_kafka_consumer_poll(consumer->rk, 500);
-    }
-    if (msg == NULL) {
+    struct nosdk_kafka_topic *topic =
+        nosdk_kafka_producer_topic(producer, topic_name);
+    if (topic == NULL) {
         free(topic_name);
-        nosdk_http_respond(req, HTTP_STATUS_OK, "application/json", "null", 4);
+        nosdk_http_respond(
+            req, HTTP_STATUS_INTERNAL_ERROR, "text/plain", NULL, 0);
         return;
     }
 
-    if (msg->err != RD_KAFKA_RESP_ERR_NO_ERROR) {
-        printf("poll error: %s\n", rd_kafka_err2str(msg->err));
-        rd_kafka_message_destroy(msg);
+    struct nosdk_kafka_produce_opts opts;
+    if (nosdk_kafka_produce_opts_parse(req, &opts) != 0) {
         free(topic_name);
+        if (opts.headers != NULL) {
+            rd_kafka_headers_destroy(opts.headers);
+        }
+        char *err = "invalid X-Nosdk-Partition";
         nosdk_http_respond(
-            req, HTTP_STATUS_INTERNAL_ERROR, "text/plain", NULL, 0);
+            req, HTTP_STATUS_INVALID_REQUEST, "text/plain", err, strlen(err));
         return;
     }
 
-    nosdk_http_respond(
-        req, HTTP_STATUS_OK, "application/json", (char *)msg->payload,
-        msg->len);
+    char *body_data = nosdk_http_request_body_alloc(req);
+    int body_len = req->content_length;
 
-    rd_kafka_message_destroy(msg);
-    free(topic_name);
-}
+    const char *content_type = nosdk_http_request_header(req, "content-type");
+    int is_ndjson =
+        content_type != NULL &&
+        strncasecmp(content_type, "application/x-ndjson", 20) == 0;
 
-void nosdk_kafka_pub_handler(struct nosdk_http_request *req) {
-    char *topic_name = get_topic_name(req);
-    struct nosdk_kafka *producer = nosdk_kafka_mgr_get_producer();
-    if (producer == NULL) {
-        free(topic_name);
-        nosdk_http_respond(
-            req, HTTP_STATUS_INTERNAL_ERROR, "text/plain", NULL, 0);
-        return;
+    int first = 0;
+    while (first < body_len && isspace((unsigned char)body_data[first])) {
+        first++;
     }
+    int is_batch = is_ndjson || (first < body_len && body_data[first] == '[');
 
-    char *body_data = nosdk_http_request_body_alloc(req);
+    struct nosdk_kafka_span *spans;
+    int num_spans =
+        nosdk_kafka_split_body(body_data, body_len, is_ndjson, &spans);
+
+    // payloads point into the body, which rdkafka reads without copying
+    struct nosdk_kafka_delivery *delivery =
+        nosdk_kafka_delivery_new(body_data, num_spans);
+
+    for (int i = 0; i < num_spans; i++) {
+        struct nosdk_kafka_delivery_result *result = &delivery->results[i];
+        result->partition = RD_KAFKA_PARTITION_UA;
+        result->offset = -1;
+
+        pthread_mutex_lock(&delivery->mutex);
+        delivery->pending++;
+        delivery->refs++;
+        pthread_mutex_unlock(&delivery->mutex);
+
+        rd_kafka_resp_err_t err = nosdk_kafka_produce_element(
+            producer, topic, &opts, &body_data[spans[i].start], spans[i].len,
+            is_batch, result);
+
+        pthread_mutex_lock(&delivery->mutex);
+        if (err != RD_KAFKA_RESP_ERR_NO_ERROR) {
+            result->err = err;
+            delivery->pending--;
+            delivery->refs--;
+        } else {
+            result->enqueued = 1;
+        }
+        pthread_mutex_unlock(&delivery->mutex);
+    }
+
+    free(spans);
+    if (opts.headers != NULL) {
+        rd_kafka_headers_destroy(opts.headers);
+    }
+
+    struct timespec deadline;
+    nosdk_deadline_after_ms(&deadline, KAFKA_DELIVERY_WAIT_MS);
+
+    pthread_mutex_lock(&delivery->mutex);
+    while (delivery->pending > 0) {
+        if (pthread_cond_timedwait(
+                &delivery->cond, &delivery->mutex, &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
 
-    rd_kafka_resp_err_t resp;
+    struct nosdk_string_buffer *sb = nosdk_string_buffer_new();
+    rd_kafka_resp_err_t first_err = RD_KAFKA_RESP_ERR_NO_ERROR;
 
-    resp = rd_kafka_producev(
-        producer->rk, RD_KAFKA_V_TOPIC(topic_name),
-        RD_KAFKA_V_VALUE(body_data, strlen(body_data)), RD_KAFKA_V_END);
+    nosdk_string_buffer_append(sb, "[");
+    for (int i = 0; i < num_spans; i++) {
+        struct nosdk_kafka_delivery_result *result = &delivery->results[i];
+        if (i > 0) {
+            nosdk_string_buffer_append(sb, ",");
+        }
+
+        if (result->enqueued && !result->delivered) {
+            nosdk_string_buffer_append(sb, "{\"error\":\"delivery pending\"}");
+            if (first_err == RD_KAFKA_RESP_ERR_NO_ERROR) {
+                first_err = RD_KAFKA_RESP_ERR__TIMED_OUT;
+            }
+        } else if (result->err != RD_KAFKA_RESP_ERR_NO_ERROR) {
+            nosdk_string_buffer_append(
+                sb, "{\"error\":\"%s\"}", rd_kafka_err2str(result->err));
+            if (first_err == RD_KAFKA_RESP_ERR_NO_ERROR) {
+                first_err = result->err;
+            }
+        } else {
+            nosdk_string_buffer_append(
+                sb, "{\"partition\":%d,\"offset\":%" PRId64 "}",
+                result->partition, result->offset);
+        }
+    }
+    nosdk_string_buffer_append(sb, "]");
+    pthread_mutex_unlock(&delivery->mutex);
+
+    // the body stays alive until rdkafka is done with every payload
+    nosdk_kafka_delivery_release(delivery);
+    free(topic_name);
 
-    if (resp != RD_KAFKA_RESP_ERR_NO_ERROR) {
-        const char *err = rd_kafka_err2str(resp);
+    if (is_batch) {
+        nosdk_http_respond(
+            req, HTTP_STATUS_OK, "application/json", sb->data, sb->size);
+    } else if (first_err != RD_KAFKA_RESP_ERR_NO_ERROR) {
+        const char *err = rd_kafka_err2str(first_err);
         printf("producer error: %s\n", err);
-        free(topic_name);
-        free(body_data);
         nosdk_http_respond(
             req, HTTP_STATUS_INTERNAL_ERROR, "text/plain", (char *)err,
             strlen(err));
-        return;
+    } else {
+        nosdk_http_respond(req, HTTP_STATUS_OK, "text/plain", NULL, 0);
     }
 
-    resp = rd_kafka_flush(producer->rk, 500);
+    nosdk_string_buffer_free(sb);
+}
 
-    if (resp != RD_KAFKA_RESP_ERR_NO_ERROR) {
-        const char *err = rd_kafka_err2str(resp);
-        printf("producer flush error: %s\n", err);
-        free(topic_name);
-        free(body_data);
-        nosdk_http_respond(
-            req, HTTP_STATUS_INTERNAL_ERROR, "text/plain", (char *)err,
-            strlen(err));
-        return;
+// copy the headers of a consumed message
+rd_kafka_headers_t *nosdk_kafka_msg_headers(struct nosdk_kafka_msg *msg) {
+    rd_kafka_headers_t *headers = NULL;
+
+    if (msg->rkmessage != NULL) {
+        rd_kafka_headers_t *msg_headers;
+        if (rd_kafka_message_headers(msg->rkmessage, &msg_headers) ==
+            RD_KAFKA_RESP_ERR_NO_ERROR) {
+            headers = rd_kafka_headers_copy(msg_headers);
+        }
+    } else {
+        size_t pos = 0;
+        const char *name;
+        size_t name_len;
+        const char *value;
+        size_t value_len;
+        while (nosdk_topiclog_header_next(
+            msg->headers, msg->headers_len, &pos, &name, &name_len, &value,
+            &value_len)) {
+            if (headers == NULL) {
+                headers = rd_kafka_headers_new(8);
+            }
+            rd_kafka_header_add(headers, name, name_len, value, value_len);
+        }
     }
 
-    free(topic_name);
-    free(body_data);
-    nosdk_http_respond(req, HTTP_STATUS_OK, "text/plain", NULL, 0);
+    if (headers == NULL) {
+        headers = rd_kafka_headers_new(2);
+    }
+    return headers;
+}
+
+// republish a failed message to the next retry tier of its topic, or to
+// the dead-letter topic after the last tier, and ack it once that is
+// delivered. the partition moves on while the message waits out its
+// backoff in the tier.
+int nosdk_kafka_nack(
+    struct nosdk_kafka *consumer,
+    int32_t partition,
+    int64_t offset,
+    const char *reason,
+    int reason_len) {
+    if (consumer->retries == 0) {
+        return -1;
+    }
+
+    struct nosdk_kafka_msg *msg =
+        nosdk_kafka_acks_retained(consumer, partition, offset);
+    if (msg == NULL) {
+        return -1;
+    }
+
+    struct nosdk_kafka *origin =
+        consumer->retry_of != NULL ? consumer->retry_of : consumer;
+    int tier = consumer->tier + 1;
+    char name[512];
+    nosdk_kafka_retry_topic(
+        name, sizeof(name), origin->topic, tier, consumer->retries);
+
+    struct nosdk_kafka *producer =
+        nosdk_kafka_mgr_process_producer(consumer->replica);
+    struct nosdk_kafka_topic *topic =
+        producer != NULL ? nosdk_kafka_producer_topic(producer, name) : NULL;
+    if (topic == NULL) {
+        nosdk_kafka_msg_destroy(msg);
+        return -1;
+    }
+
+    rd_kafka_headers_t *headers = nosdk_kafka_msg_headers(msg);
+    char attempts[16];
+    snprintf(attempts, sizeof(attempts), "%d", tier);
+    rd_kafka_header_remove(headers, "nosdk-retries");
+    rd_kafka_header_add(headers, "nosdk-retries", -1, attempts, -1);
+    if (reason != NULL) {
+        rd_kafka_header_remove(headers, "nosdk-error");
+        rd_kafka_header_add(headers, "nosdk-error", -1, reason, reason_len);
+    }
+
+    struct nosdk_kafka_delivery *delivery = nosdk_kafka_delivery_new(NULL, 1);
+    delivery->pending = 1;
+    delivery->refs = 2;
+
+    rd_kafka_resp_err_t err = nosdk_kafka_produce_message(
+        producer, topic, RD_KAFKA_PARTITION_UA, msg->key, msg->key_len,
+        headers, msg->payload, msg->len, &delivery->results[0]);
+
+    // the payload is not copied, wait for the report before letting go of
+    // the message. rdkafka reports every message within its timeout.
+    pthread_mutex_lock(&delivery->mutex);
+    if (err != RD_KAFKA_RESP_ERR_NO_ERROR) {
+        delivery->pending--;
+        delivery->refs--;
+    }
+    while (delivery->pending > 0) {
+        pthread_cond_wait(&delivery->cond, &delivery->mutex);
+    }
+    if (err == RD_KAFKA_RESP_ERR_NO_ERROR) {
+        err = delivery->results[0].err;
+    }
+    pthread_mutex_unlock(&delivery->mutex);
+    nosdk_kafka_delivery_release(delivery);
+
+    if (err != RD_KAFKA_RESP_ERR_NO_ERROR) {
+        printf(
+            "failed to republish %s [%d] %" PRId64 " to %s: %s\n",
+            consumer->topic, partition, offset, name, rd_kafka_err2str(err));
+        nosdk_kafka_msg_destroy(msg);
+        return -1;
+    }
+
+    nosdk_debugf(
+        "%s [%d] %" PRId64 ": nacked to %s\n", consumer->topic, partition,
+        offset, name);
+    nosdk_kafka_msg_destroy(msg);
+    return nosdk_kafka_acks_ack(consumer, partition, offset);
 }
 
 void nosdk_kafka_handler(struct nosdk_http_request *req) {
-    if (req->method == HTTP_METHOD_GET) {
+    char *action = get_topic_action(req);
+
+    if (action != NULL) {
+        if (req->method == HTTP_METHOD_POST && strcmp(action, "ack") == 0) {
+            nosdk_kafka_ack_handler(req, 0);
+        } else if (
+            req->method == HTTP_METHOD_POST && strcmp(action, "nack") == 0) {
+            nosdk_kafka_ack_handler(req, 1);
+        } else if (
+            req->method == HTTP_METHOD_GET && strcmp(action, "lag") == 0) {
+            nosdk_kafka_lag_handler(req);
+        } else {
+            nosdk_http_respond(
+                req, HTTP_STATUS_NOT_FOUND, "text/plain", NULL, 0);
+        }
+        free(action);
+    } else if (req->method == HTTP_METHOD_GET) {
         nosdk_kafka_sub_handler(req);
     } else if (req->method == HTTP_METHOD_POST) {
         nosdk_kafka_pub_handler(req);
@@ -616,15 +4111,88 @@ void nosdk_kafka_handler(struct nosdk_http_request *req) {
 }
 
 void nosdk_kafka_mgr_teardown() {
+    // commit what the processes acked before any client goes away
+    for (int i = 0; i < kafka_mgr->num_kafkas; i++) {
+        if (kafka_mgr->kafkas[i]->transactional) {
+            nosdk_kafka_txn_close(kafka_mgr->kafkas[i]);
+        }
+    }
+
     for (int i = 0; i < kafka_mgr->num_kafkas; i++) {
         nosdk_debugf("destroying kafka client %d\n", i);
-        if (kafka_mgr->kafkas[i].type == PRODUCER) {
-            rd_kafka_flush(kafka_mgr->kafkas[i].rk, 500);
+        if (kafka_mgr->kafkas[i]->type == PRODUCER) {
+            kafka_mgr->kafkas[i]->running = 0;
+            if (kafka_mgr->kafkas[i]->rk != NULL) {
+                rd_kafka_flush(kafka_mgr->kafkas[i]->rk, 500);
+                pthread_join(kafka_mgr->kafkas[i]->poll_thread, NULL);
+            }
+
+            for (int t = 0; t < kafka_mgr->kafkas[i]->num_topics; t++) {
+                struct nosdk_kafka_topic *topic =
+                    kafka_mgr->kafkas[i]->topics[t];
+                if (topic->rkt != NULL) {
+                    rd_kafka_topic_destroy(topic->rkt);
+                }
+                free(topic->name);
+                free(topic);
+            }
+            free(kafka_mgr->kafkas[i]->topics);
+        } else if (kafka_mgr->kafkas[i]->type == CONSUMER) {
+            kafka_mgr->kafkas[i]->running = 0;
+            pthread_join(kafka_mgr->kafkas[i]->fetch_thread, NULL);
+            pthread_join(kafka_mgr->kafkas[i]->commit_thread, NULL);
+            nosdk_kafka_commit_acks(kafka_mgr->kafkas[i], 0);
+
+            // leave the group now so the other replicas take over our
+            // partitions without waiting for the session to time out
+            if (kafka_mgr->kafkas[i]->rk != NULL) {
+                rd_kafka_consumer_close(kafka_mgr->kafkas[i]->rk);
+            }
+            for (int p = 0; p < kafka_mgr->kafkas[i]->acks.num_partitions;
+                 p++) {
+                struct nosdk_kafka_ack_partition *ap =
+                    &kafka_mgr->kafkas[i]->acks.partitions[p];
+                nosdk_kafka_ack_partition_release(ap);
+                free(ap->retained);
+            }
+            free(kafka_mgr->kafkas[i]->acks.partitions);
+            free(kafka_mgr->kafkas[i]->held);
+            free(kafka_mgr->kafkas[i]->group);
+            free(kafka_mgr->kafkas[i]->positions);
+            free(kafka_mgr->kafkas[i]->owned);
+
+            // prefetched messages were never handed out and stay uncommitted
+            void *msg;
+            while (nosdk_queue_pop(&kafka_mgr->kafkas[i]->prefetch, &msg) ==
+                   0) {
+                nosdk_kafka_msg_destroy((struct nosdk_kafka_msg *)msg);
+            }
+            nosdk_queue_destroy(&kafka_mgr->kafkas[i]->prefetch);
+        }
+        if (kafka_mgr->kafkas[i]->rk != NULL) {
+            nosdk_metrics_remove(rd_kafka_name(kafka_mgr->kafkas[i]->rk));
+            rd_kafka_destroy(kafka_mgr->kafkas[i]->rk);
         }
-        rd_kafka_destroy(kafka_mgr->kafkas[i].rk);
     }
 
+    for (int i = 0; i < kafka_mgr->num_kafkas; i++) {
+        free(kafka_mgr->kafkas[i]);
+    }
     for (int i = 0; i < kafka_mgr->num_threads; i++) {
         free(kafka_mgr->threads[i]);
     }
+
+    if (kafka_mgr->admin != NULL) {
+        rd_kafka_destroy(kafka_mgr->admin);
+    }
+    for (int i = 0; i < kafka_mgr->num_known_topics; i++) {
+        free(kafka_mgr->known_topics[i]);
+    }
+    free(kafka_mgr->known_topics);
+
+    // consumed local messages point into the logs, close them last
+    if (nosdk_kafka_local()) {
+        nosdk_topiclog_close_all();
+        free(kafka_mgr->log_dir);
+    }
 }
@@ -4,56 +4,387 @@
 #include <librdkafka/rdkafka.h>
 #include <pthread.h>
 
+#include "config.h"
 #include "http.h"
+#include "queue.h"
+#include "topiclog.h"
+#include "util.h"
 
-#define MAX_KAFKA 16
+// clients: consumers per topic and replica, retry tiers and producers
+#define MAX_KAFKA 1024
 #define MAX_PROCS 100
 
+// topics not given partitions or replication in nosdk.yaml
+#define KAFKA_DEFAULT_PARTITIONS 1
+#define KAFKA_DEFAULT_REPLICATION 1
+#define KAFKA_ADMIN_TIMEOUT_MS 5000
+
+// how long a publish request waits for its delivery reports
+#define KAFKA_DELIVERY_WAIT_MS 5000
+
+// how many offsets past the oldest unacknowledged one may be in flight
+// per partition before the partition is paused
+#define KAFKA_ACK_WINDOW 4096
+#define KAFKA_COMMIT_INTERVAL_MS 1000
+
+// messages fetched ahead of the requests and FIFO bridges that consume them
+#define KAFKA_PREFETCH_SIZE 256
+// how long a GET /msg/<topic> waits for a message
+#define KAFKA_SUB_WAIT_MS 10000
+
+// kafka max message size is 1mb!
+#define KAFKA_FIFO_BUF_SIZE (1000 * 1000)
+// most messages handed to rd_kafka_produce_batch at once
+#define KAFKA_FIFO_BATCH_MAX 1024
+// payloads at least this large are spliced into streaming FIFOs on linux,
+// and at most this many spliced messages are waiting on the reader
+#define KAFKA_SPLICE_MIN (64 * 1024)
+#define KAFKA_SPLICE_RETAIN 64
+
+// retry tiers wait retry_backoff_ms << (tier - 1) before redelivering
+#define KAFKA_RETRY_BACKOFF_MS 1000
+#define KAFKA_RETRY_MAX 8
+
+// how often every client reports statistics, "0" turns them off
+#define KAFKA_STATS_INTERVAL_MS "5000"
+
+// the most settings a producer or consumer tuning block amounts to
+#define KAFKA_TUNING_MAX 8
+
+// transactional processes commit every interval. a commit waits up to
+// KAFKA_TXN_DRAIN_MS for handed out messages to be acked, and readers
+// take messages in slices of KAFKA_TXN_SLICE_MS so they never hold it up
+// for longer.
+#define KAFKA_TXN_INTERVAL_MS 100
+#define KAFKA_TXN_DRAIN_MS 5000
+#define KAFKA_TXN_SLICE_MS 100
+#define KAFKA_TXN_TIMEOUT_MS 30000
+#define KAFKA_TXN_RETRIES 3
+
 enum nosdk_kafka_type {
     PRODUCER,
     CONSUMER,
 };
 
+// where topics live. the local backend keeps them in file-backed logs
+// under NOSDK_LOG_DIR and needs no broker, for a single node.
+enum nosdk_kafka_backend {
+    BACKEND_KAFKA,
+    BACKEND_LOCAL,
+};
+
+// a consumed message from either backend
+struct nosdk_kafka_msg {
+    // the consumer that fetched it, and its topic
+    struct nosdk_kafka *consumer;
+    const char *topic;
+    int32_t partition;
+    int64_t offset;
+    int64_t timestamp;
+    void *payload;
+    size_t len;
+    void *key;
+    size_t key_len;
+
+    // the kafka message the payload points into
+    rd_kafka_message_t *rkmessage;
+    // the encoded headers of a local log record
+    const char *headers;
+    size_t headers_len;
+
+    // readers and the retry state each hold a reference
+    atomic_int refs;
+};
+
+// acknowledgement state for one partition. offsets in [base, next) have
+// been delivered, and acked ones are marked in a ring of bits indexed by
+// offset % KAFKA_ACK_WINDOW. base is the commit watermark.
+struct nosdk_kafka_ack_partition {
+    int32_t partition;
+    int64_t base;
+    int64_t next;
+    int64_t committed;
+    int paused;
+
+    // one past the last offset handed to a worker
+    int64_t handed;
+    uint64_t acked[KAFKA_ACK_WINDOW / 64];
+
+    // with a retry policy, delivered messages are kept until acked or
+    // nacked, indexed like the ack bits
+    struct nosdk_kafka_msg **retained;
+};
+
+struct nosdk_kafka_acks {
+    pthread_mutex_t mutex;
+    struct nosdk_kafka_ack_partition *partitions;
+    int num_partitions;
+    int capacity;
+};
+
+// a partition of a retry tier paused until its next message is due
+struct nosdk_kafka_held {
+    int32_t partition;
+    int64_t due_ms;
+};
+
+// an rdkafka property taken from a topic's config
+struct nosdk_kafka_setting {
+    const char *topic;
+    const char *name;
+    char value[256];
+
+    // the producer client is shared, topic-level properties are set on
+    // the topic's handle instead
+    int topic_level;
+};
+
+// a cached rdkafka topic handle, or the log of a local topic
+struct nosdk_kafka_topic {
+    char *name;
+    rd_kafka_topic_t *rkt;
+    struct nosdk_topiclog *log;
+};
+
 struct nosdk_kafka {
     enum nosdk_kafka_type type;
     rd_kafka_t *rk;
     char *topic;
+
+    // the process replica a consumer serves, each is its own group member
+    int replica;
+
+    // a consumer's topic config, NULL for topics that are not configured
+    struct nosdk_messaging_config *messaging;
+
+    // a transactional producer serves the process process_id. everything
+    // the process produces and the offsets its consumers ack are committed
+    // in one transaction every txn_interval_ms, once every message handed
+    // out has been acked. handing out stops while a commit drains.
+    int transactional;
+    int process_id;
+    int txn_interval_ms;
+    pthread_t txn_thread;
+    pthread_mutex_t txn_commit_mutex;
+    int txn_closed;
+    pthread_mutex_t txn_mutex;
+    pthread_cond_t txn_cond;
+    int txn_draining;
+    int txn_readers;
+    pthread_rwlock_t txn_produce_lock;
+    atomic_int txn_produced;
+
+    // the transaction a consumer's offsets are committed in
+    struct nosdk_kafka *txn;
+
+    // producers serve delivery reports from a dedicated thread
+    pthread_t poll_thread;
+    int running;
+
+    // consumers commit acknowledged offsets in batches from a timer thread
+    struct nosdk_kafka_acks acks;
+    pthread_t commit_thread;
+    int commit_interval_ms;
+
+    // a consumer's fetch thread is the only one polling its handle, every
+    // reader takes messages from the prefetch queue
+    struct nosdk_queue prefetch;
+    pthread_t fetch_thread;
+
+    // subscribe requests waiting for the prefetch queue are parked on the
+    // replica's server, which the fetch thread wakes as messages arrive
+    atomic_int parked;
+    struct nosdk_http_server *server;
+
+    // failed messages go to the next retry tier. a tier consumer holds
+    // back its messages for delay_ms and hands them to the consumer of the
+    // original topic, retry_of.
+    int retries;
+    int retry_backoff_ms;
+    int tier;
+    int delay_ms;
+    struct nosdk_kafka *retry_of;
+    struct nosdk_kafka_held *held;
+    int num_held;
+    int held_capacity;
+
+    // local consumers read their log directly. partitions are spread over
+    // the topic's replicas, and each owned one is read from its position.
+    struct nosdk_topiclog *log;
+    char *group;
+    int64_t *positions;
+    int *owned;
+
+    // producers publish to any number of topics through cached handles
+    struct nosdk_kafka_topic **topics;
+    int num_topics;
+    int topics_capacity;
+    pthread_rwlock_t topics_lock;
+};
+
+// per-request publish options taken from X-Nosdk-* request headers
+struct nosdk_kafka_produce_opts {
+    const char *key;
+    int key_len;
+    int32_t partition;
+    rd_kafka_headers_t *headers;
+};
+
+struct nosdk_kafka_delivery;
+
+struct nosdk_kafka_delivery_result {
+    struct nosdk_kafka_delivery *delivery;
+    int enqueued;
+    int delivered;
+    rd_kafka_resp_err_t err;
+    int32_t partition;
+    int64_t offset;
+};
+
+// tracks the delivery reports for a set of messages produced together.
+// the body holds the message payloads and is only freed once the request
+// and every enqueued message have dropped their reference.
+struct nosdk_kafka_delivery {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int pending;
+    int refs;
+
+    // nobody waits on the reports, errors are logged instead
+    int detached;
+
+    char *body;
+    struct nosdk_kafka_delivery_result *results;
+    int num_results;
+};
+
+// a message whose payload pages are referenced by a pipe, until the
+// reader has read past byte end of the FIFO
+struct nosdk_kafka_spliced {
+    struct nosdk_kafka_msg *msg;
+    uint64_t end;
 };
 
 struct nosdk_kafka_thread_ctx {
     struct nosdk_kafka *k;
+    char *topic;
     char *root_dir;
     pthread_t thread;
+
+    enum nosdk_fifo_framing framing;
+    enum nosdk_fifo_headers headers;
+
+    // bytes written since the FIFO was opened, and the spliced messages
+    // still waiting on the reader
+    int splice;
+    uint64_t written;
+    struct nosdk_kafka_spliced spliced[KAFKA_SPLICE_RETAIN];
+    int spliced_head;
+    int num_spliced;
 };
 
 struct nosdk_kafka_mgr {
-    struct nosdk_kafka kafkas[MAX_KAFKA];
+    enum nosdk_kafka_backend backend;
+    char *log_dir;
+
+    // clients are tuned from the config as they are created
+    struct nosdk_config *config;
+
+    struct nosdk_kafka *kafkas[MAX_KAFKA];
     int num_kafkas;
     struct nosdk_kafka_thread_ctx *threads[MAX_PROCS];
     int num_threads;
+
+    // one admin client creates every topic, and topics known to exist are
+    // not created again
+    pthread_mutex_t admin_lock;
+    rd_kafka_t *admin;
+    char **known_topics;
+    int num_known_topics;
+    int known_topics_capacity;
 };
 
 int nosdk_kafka_mgr_init();
 
+// check the rdkafka settings of every topic in the config and keep it for
+// the clients created later
+int nosdk_kafka_mgr_configure(struct nosdk_config *config);
+
+// create every topic in the config with one CreateTopics request
+int nosdk_kafka_mgr_provision_topics(struct nosdk_config *config);
+
 int nosdk_kafka_init(struct nosdk_kafka *k);
 
 struct nosdk_kafka_thread_ctx *nosdk_kafka_mgr_make_thread(char *root_dir);
 
+void nosdk_kafka_msg_destroy(struct nosdk_kafka_msg *msg);
+
+// format the message headers and kafka metadata as a single-line JSON
+// object
+void nosdk_kafka_format_headers(
+    struct nosdk_kafka_msg *msg, struct nosdk_string_buffer *sb);
+
 // write the message headers to a regular file at path <filepath>.headers
-int nosdk_kafka_write_headers(rd_kafka_message_t *msg, char *filepath);
+int nosdk_kafka_write_headers(struct nosdk_kafka_msg *msg, char *filepath);
+
+// take the next prefetched message, NULL if none arrives within timeout_ms
+struct nosdk_kafka_msg *
+nosdk_kafka_consumer_next(struct nosdk_kafka *consumer, int timeout_ms);
 
 void *nosdk_kafka_consumer_thread(void *arg);
 
 void *nosdk_kafka_producer_thread(void *arg);
 
-int nosdk_kafka_mgr_kafka_subscribe(char *topic);
+int nosdk_kafka_mgr_kafka_subscribe(
+    char *topic, int replica, struct nosdk_messaging_config *messaging);
+
+struct nosdk_kafka *nosdk_kafka_mgr_get_consumer(char *topic, int replica);
 
-struct nosdk_kafka *nosdk_kafka_mgr_get_consumer(char *topic);
+// write the replica's assigned partitions and their lag as JSON
+void nosdk_kafka_consumer_lag(
+    struct nosdk_kafka *consumer, struct nosdk_string_buffer *sb);
 
-int nosdk_kafka_mgr_kafka_produce(char *topic);
+int nosdk_kafka_mgr_kafka_produce(char *topic, int replica);
+
+// give a process a transactional producer, for its consumers to commit
+// their offsets with what it produces
+int nosdk_kafka_mgr_kafka_transactional(int replica, int interval_ms);
+
+// create the topic unless it is known to exist
+int nosdk_kafka_ensure_topic_exists(const char *topic);
 
 struct nosdk_kafka *nosdk_kafka_mgr_get_producer();
 
+// the transactional producer of a process, NULL if it has none
+struct nosdk_kafka *nosdk_kafka_mgr_get_txn(int replica);
+
+// the producer a process publishes through: its transactional producer,
+// or the shared one
+struct nosdk_kafka *nosdk_kafka_mgr_process_producer(int replica);
+
+// get the cached topic handle for a producer, creating it on first use
+struct nosdk_kafka_topic *
+nosdk_kafka_producer_topic(struct nosdk_kafka *producer, const char *topic);
+
+// record that a message is being handed to a worker. returns -1 if the
+// partition's ack window is full, in which case the message must not be
+// delivered; the partition is rewound to it and paused until acks catch up.
+int nosdk_kafka_acks_delivered(
+    struct nosdk_kafka *consumer, struct nosdk_kafka_msg *msg);
+
+// acknowledge a delivered offset, returns -1 if it was never delivered
+int nosdk_kafka_acks_ack(
+    struct nosdk_kafka *consumer, int32_t partition, int64_t offset);
+
+// send a delivered message to the consumer's next retry tier, or to the
+// dead-letter topic, and ack it
+int nosdk_kafka_nack(
+    struct nosdk_kafka *consumer,
+    int32_t partition,
+    int64_t offset,
+    const char *reason,
+    int reason_len);
+
 void nosdk_kafka_handler(struct nosdk_http_request *req);
 
 void nosdk_kafka_mgr_teardown();
@@ -31,6 +31,16 @@ int config_main(struct nosdk_config *config, bool is_yaml) {
 
     proc_mgr.io_mgr = &io_mgr;
 
+    if (nosdk_io_mgr_configure(&io_mgr, config) != 0) {
+        fprintf(stderr, "invalid kafka settings\n");
+        return 1;
+    }
+
+    // topics that fail here are retried one by one as they are used
+    if (nosdk_io_mgr_provision(&io_mgr, config) != 0) {
+        fprintf(stderr, "some topics could not be provisioned\n");
+    }
+
     for (int i = 0; i < config->processes_count; i++) {
         struct nosdk_process_config c = config->processes[i];
         struct nosdk_process p = {0};
@@ -43,6 +53,8 @@ int config_main(struct nosdk_config *config, bool is_yaml) {
                 .kind = KAFKA_CONSUME_TOPIC,
                 .interface = c.consume[j].interface,
                 .data = c.consume[j].topic,
+                .messaging = &c.consume[j],
+                .process = &config->processes[i],
             };
             nosdk_process_add_io(&p, s);
         }
@@ -52,6 +64,8 @@ int config_main(struct nosdk_config *config, bool is_yaml) {
                 .kind = KAFKA_PRODUCE_TOPIC,
                 .interface = c.produce[j].interface,
                 .data = c.produce[j].topic,
+                .messaging = &c.produce[j],
+                .process = &config->processes[i],
             };
             nosdk_process_add_io(&p, s);
         }
@@ -92,8 +106,8 @@ int main(int argc, char *argv[]) {
 
     struct nosdk_process_config p_config = {0};
     p_config.name = "cmdline";
-    p_config.consume = malloc(sizeof(struct nosdk_messaging_config) * 16);
-    p_config.produce = malloc(sizeof(struct nosdk_messaging_config) * 16);
+    p_config.consume = calloc(16, sizeof(struct nosdk_messaging_config));
+    p_config.produce = calloc(16, sizeof(struct nosdk_messaging_config));
 
     int c;
     static struct option long_options[] = {
@@ -111,11 +125,15 @@ int main(int argc, char *argv[]) {
         case 'c':
             p_config.consume[p_config.consume_count].topic = strdup(optarg);
             p_config.consume[p_config.consume_count].interface = HTTP;
+            p_config.consume[p_config.consume_count].framing = FRAMING_NONE;
+            p_config.consume[p_config.consume_count].headers = HEADERS_FILE;
             p_config.consume_count++;
             break;
         case 'p':
             p_config.produce[p_config.produce_count].topic = strdup(optarg);
             p_config.produce[p_config.produce_count].interface = HTTP;
+            p_config.produce[p_config.produce_count].framing = FRAMING_NONE;
+            p_config.produce[p_config.produce_count].headers = HEADERS_FILE;
             p_config.produce_count++;
             break;
         case 'n':
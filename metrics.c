@@ -0,0 +1,171 @@
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "http.h"
+#include "metrics.h"
+#include "util.h"
+
+struct nosdk_metrics metrics_mgr = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+struct nosdk_metric_set *nosdk_metric_set_new(const char *owner) {
+    struct nosdk_metric_set *set = malloc(sizeof(struct nosdk_metric_set));
+    set->owner = strdup(owner);
+    set->metrics = NULL;
+    set->num_metrics = 0;
+    set->capacity = 0;
+    return set;
+}
+
+void nosdk_metric_set_free(struct nosdk_metric_set *set) {
+    for (int i = 0; i < set->num_metrics; i++) {
+        free(set->metrics[i].labels);
+    }
+    free(set->metrics);
+    free(set->owner);
+    free(set);
+}
+
+void nosdk_metric_set_add(
+    struct nosdk_metric_set *set,
+    const char *name,
+    const char *help,
+    double value,
+    const char *labels,
+    ...) {
+    if (set->num_metrics == set->capacity) {
+        set->capacity = set->capacity == 0 ? 32 : set->capacity * 2;
+        set->metrics =
+            realloc(set->metrics, sizeof(struct nosdk_metric) * set->capacity);
+    }
+
+    char buf[512];
+    va_list args;
+    va_start(args, labels);
+    vsnprintf(buf, sizeof(buf), labels, args);
+    va_end(args);
+
+    struct nosdk_metric *m = &set->metrics[set->num_metrics];
+    m->name = name;
+    m->help = help;
+    m->labels = strdup(buf);
+    m->value = value;
+    set->num_metrics++;
+}
+
+// call with the metrics mutex held
+int nosdk_metrics_find(const char *owner) {
+    for (int i = 0; i < metrics_mgr.num_sets; i++) {
+        if (strcmp(metrics_mgr.sets[i]->owner, owner) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+void nosdk_metrics_publish(struct nosdk_metric_set *set) {
+    struct nosdk_metric_set *old = NULL;
+
+    pthread_mutex_lock(&metrics_mgr.mutex);
+    int i = nosdk_metrics_find(set->owner);
+    if (i >= 0) {
+        old = metrics_mgr.sets[i];
+        metrics_mgr.sets[i] = set;
+    } else if (metrics_mgr.num_sets < METRICS_MAX_SETS) {
+        metrics_mgr.sets[metrics_mgr.num_sets] = set;
+        metrics_mgr.num_sets++;
+    } else {
+        old = set;
+    }
+    pthread_mutex_unlock(&metrics_mgr.mutex);
+
+    if (old != NULL) {
+        nosdk_metric_set_free(old);
+    }
+}
+
+void nosdk_metrics_remove(const char *owner) {
+    struct nosdk_metric_set *old = NULL;
+
+    pthread_mutex_lock(&metrics_mgr.mutex);
+    int i = nosdk_metrics_find(owner);
+    if (i >= 0) {
+        old = metrics_mgr.sets[i];
+        metrics_mgr.num_sets--;
+        metrics_mgr.sets[i] = metrics_mgr.sets[metrics_mgr.num_sets];
+    }
+    pthread_mutex_unlock(&metrics_mgr.mutex);
+
+    if (old != NULL) {
+        nosdk_metric_set_free(old);
+    }
+}
+
+int nosdk_metric_cmp(const void *a, const void *b) {
+    const struct nosdk_metric *ma = *(const struct nosdk_metric **)a;
+    const struct nosdk_metric *mb = *(const struct nosdk_metric **)b;
+    int cmp = strcmp(ma->name, mb->name);
+    if (cmp != 0) {
+        return cmp;
+    }
+    return strcmp(ma->labels, mb->labels);
+}
+
+void nosdk_metrics_render(struct nosdk_string_buffer *sb) {
+    pthread_mutex_lock(&metrics_mgr.mutex);
+
+    int count = 0;
+    for (int i = 0; i < metrics_mgr.num_sets; i++) {
+        count += metrics_mgr.sets[i]->num_metrics;
+    }
+
+    // the text format wants every series of a metric in one group
+    struct nosdk_metric **sorted =
+        malloc(sizeof(struct nosdk_metric *) * count);
+    int n = 0;
+    for (int i = 0; i < metrics_mgr.num_sets; i++) {
+        for (int j = 0; j < metrics_mgr.sets[i]->num_metrics; j++) {
+            sorted[n++] = &metrics_mgr.sets[i]->metrics[j];
+        }
+    }
+    if (count > 0) {
+        qsort(sorted, count, sizeof(struct nosdk_metric *), nosdk_metric_cmp);
+    }
+
+    for (int i = 0; i < count; i++) {
+        struct nosdk_metric *m = sorted[i];
+        if (i == 0 || strcmp(sorted[i - 1]->name, m->name) != 0) {
+            nosdk_string_buffer_append(
+                sb, "# HELP %s %s\n# TYPE %s gauge\n", m->name, m->help,
+                m->name);
+        }
+        if (m->labels[0] == '\0') {
+            nosdk_string_buffer_append(sb, "%s %.15g\n", m->name, m->value);
+        } else {
+            nosdk_string_buffer_append(
+                sb, "%s{%s} %.15g\n", m->name, m->labels, m->value);
+        }
+    }
+
+    pthread_mutex_unlock(&metrics_mgr.mutex);
+    free(sorted);
+}
+
+void nosdk_metrics_handler(struct nosdk_http_request *req) {
+    if (req->method != HTTP_METHOD_GET) {
+        nosdk_http_respond(
+            req, HTTP_STATUS_INVALID_REQUEST, "text/plain", NULL, 0);
+        return;
+    }
+
+    struct nosdk_string_buffer *sb = nosdk_string_buffer_new();
+    nosdk_metrics_render(sb);
+    nosdk_http_respond(
+        req, HTTP_STATUS_OK, "text/plain; version=0.0.4", sb->data,
+        sb->size);
+    nosdk_string_buffer_free(sb);
+}
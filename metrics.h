@@ -0,0 +1,61 @@
+#ifndef _NOSDK_METRICS_H
+#define _NOSDK_METRICS_H
+
+#include <pthread.h>
+
+#include "http.h"
+#include "util.h"
+
+// gauges exposed in the prometheus text format on GET /metrics. series
+// are published in sets, each owned by one source (e.g. a kafka client),
+// and a source replaces all of its series at once, so a series it stops
+// reporting disappears with the next update.
+#define METRICS_MAX_SETS 256
+
+struct nosdk_metric {
+    const char *name;
+    const char *help;
+    char *labels;
+    double value;
+};
+
+struct nosdk_metric_set {
+    char *owner;
+    struct nosdk_metric *metrics;
+    int num_metrics;
+    int capacity;
+};
+
+struct nosdk_metrics {
+    pthread_mutex_t mutex;
+    struct nosdk_metric_set *sets[METRICS_MAX_SETS];
+    int num_sets;
+};
+
+struct nosdk_metric_set *nosdk_metric_set_new(const char *owner);
+
+void nosdk_metric_set_free(struct nosdk_metric_set *set);
+
+// add a series. name and help must be string literals, labels is a
+// printf format for the label pairs, e.g. "topic=\"%s\"". label values are
+// not escaped.
+void nosdk_metric_set_add(
+    struct nosdk_metric_set *set,
+    const char *name,
+    const char *help,
+    double value,
+    const char *labels,
+    ...);
+
+// replace the series of set's owner with set, which the registry takes
+void nosdk_metrics_publish(struct nosdk_metric_set *set);
+
+// drop every series of owner
+void nosdk_metrics_remove(const char *owner);
+
+// render every series, grouped by metric name
+void nosdk_metrics_render(struct nosdk_string_buffer *sb);
+
+void nosdk_metrics_handler(struct nosdk_http_request *req);
+
+#endif // _NOSDK_METRICS_H
@@ -8,107 +8,863 @@
 #include <unistd.h>
 
 #include "http.h"
+#include "metrics.h"
 #include "postgres.h"
 #include "util.h"
 
 struct nosdk_pg pg_pool = {0};
+pthread_mutex_t pg_init_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-int nosdk_pg_init() {
-    if (pg_pool.initialized) {
-        return 0;
+void nosdk_pg_disconnect(PGconn *conn) { PQfinish(conn); }
+
+void nosdk_pg_stmts_clear(struct nosdk_pg_stmts *stmts) {
+    for (int i = 0; i < stmts->num_stmts; i++) {
+        free(stmts->stmts[i].sql);
     }
+    stmts->num_stmts = 0;
+    stmts->clock = 0;
+    stmts->next_id = 0;
+}
 
-    int result = pthread_mutex_init(&pg_pool.mutex, NULL);
-    if (result != 0) {
-        fprintf(stderr, "failed to initialize pool mutex: %d\n", result);
-        return -1;
+int nosdk_pg_env_int(const char *envvar, int default_value) {
+    char *value = getenv(envvar);
+    int n = value != NULL ? atoi(value) : 0;
+    return n > 0 ? n : default_value;
+}
+
+// called without the pool lock, connecting can take a while
+PGconn *nosdk_pg_connect() {
+    char *dsn = getenv("POSTGRES_DSN");
+    if (dsn == NULL) {
+        fprintf(stderr, "POSTGRES_DSN is not set\n");
+        return NULL;
     }
 
-    for (int i = 0; i < PG_POOL_MAX; i++) {
-        pg_pool.pool[i] = NULL;
-        pg_pool.in_use[i] = false;
+    PGconn *conn = PQconnectdb(dsn);
+    if (PQstatus(conn) != CONNECTION_OK) {
+        fprintf(stderr, "connection error: %s\n", PQerrorMessage(conn));
+        nosdk_pg_disconnect(conn);
+        return NULL;
     }
+    return conn;
+}
 
-    pg_pool.initialized = true;
+// (re)connect a slot claimed as connecting, closing its old connection.
+// called and returns with the pool lock held.
+int nosdk_pg_slot_connect(struct nosdk_pg_conn *slot) {
+    PGconn *old = slot->conn;
+    slot->conn = NULL;
+    nosdk_pg_stmts_clear(&slot->stmts);
+    pthread_mutex_unlock(&pg_pool.mutex);
+
+    if (old != NULL) {
+        nosdk_pg_disconnect(old);
+    }
+    PGconn *conn = nosdk_pg_connect();
+
+    pthread_mutex_lock(&pg_pool.mutex);
+    slot->connecting = false;
+    slot->conn = conn;
+    slot->created_ms = nosdk_now_ms();
+    if (conn == NULL) {
+        // let a waiter try the slot
+        pthread_cond_signal(&pg_pool.available);
+        return -1;
+    }
     return 0;
 }
 
-void nosdk_pg_disconnect(PGconn *conn) { PQfinish(conn); }
+bool nosdk_pg_slot_expired(struct nosdk_pg_conn *slot, int64_t now) {
+    return PQstatus(slot->conn) != CONNECTION_OK ||
+           now - slot->created_ms >= pg_pool.max_age_ms;
+}
 
+// an idle connection, or a slot to open one in, waiting up to the pool's
+// wait_ms for one to be released when all are busy
 PGconn *nosdk_pg_get_connection() {
+    struct timespec deadline;
+    nosdk_deadline_after_ms(&deadline, pg_pool.wait_ms);
+
     pthread_mutex_lock(&pg_pool.mutex);
 
-    for (int i = 0; i < PG_POOL_MAX; i++) {
-        if (!pg_pool.in_use[i]) {
-            if (pg_pool.pool[i] != NULL) {
-                if (PQstatus(pg_pool.pool[i]) != CONNECTION_OK) {
-                    nosdk_debugf("cleaning up stale connection\n");
-                    PQfinish(pg_pool.pool[i]);
-                    pg_pool.pool[i] = NULL;
-                } else {
-                    pg_pool.in_use[i] = 1;
-                    pthread_mutex_unlock(&pg_pool.mutex);
-                    return pg_pool.pool[i];
-                }
-            } else {
-                char *dsn = getenv("POSTGRES_DSN");
-                if (dsn == NULL) {
-                    fprintf(stderr, "POSTGRES_DSN is not set\n");
-                    return NULL;
-                }
-                PGconn *conn = PQconnectdb(getenv("POSTGRES_DSN"));
-                if (PQstatus(conn) != CONNECTION_OK) {
-                    fprintf(
-                        stderr, "connection error: %s\n", PQerrorMessage(conn));
-                    nosdk_pg_disconnect(conn);
-                    pthread_mutex_unlock(&pg_pool.mutex);
-                    return NULL;
+    while (1) {
+        int64_t now = nosdk_now_ms();
+        struct nosdk_pg_conn *empty = NULL;
+
+        for (int i = 0; i < pg_pool.max_size; i++) {
+            struct nosdk_pg_conn *slot = &pg_pool.conns[i];
+            if (slot->in_use || slot->connecting) {
+                continue;
+            }
+            if (slot->conn == NULL || nosdk_pg_slot_expired(slot, now)) {
+                if (empty == NULL) {
+                    empty = slot;
                 }
-                pg_pool.in_use[i] = 1;
-                pg_pool.pool[i] = conn;
+                continue;
+            }
+
+            slot->in_use = true;
+            pthread_mutex_unlock(&pg_pool.mutex);
+            return slot->conn;
+        }
+
+        if (empty != NULL) {
+            if (empty->conn != NULL) {
+                nosdk_debugf("recycling postgres connection\n");
+            }
+            empty->connecting = true;
+            empty->in_use = true;
+            if (nosdk_pg_slot_connect(empty) != 0) {
+                empty->in_use = false;
                 pthread_mutex_unlock(&pg_pool.mutex);
-                return conn;
+                return NULL;
             }
+            pthread_mutex_unlock(&pg_pool.mutex);
+            return empty->conn;
+        }
+
+        if (pthread_cond_timedwait(
+                &pg_pool.available, &pg_pool.mutex, &deadline) != 0) {
+            break;
         }
     }
+
     pthread_mutex_unlock(&pg_pool.mutex);
-    fprintf(stderr, "all postgres connections in use\n");
+    fprintf(stderr, "timed out waiting for a postgres connection\n");
     return NULL;
 }
 
+// a connection left in a transaction, e.g. an aborted one, would fail
+// every request after it, so it is reset before going back to the pool
 void nosdk_pg_connection_release(PGconn *conn) {
+    bool reset = PQtransactionStatus(conn) != PQTRANS_IDLE;
+    if (reset) {
+        fprintf(
+            stderr, "resetting postgres connection left in a transaction\n");
+        PQreset(conn);
+    }
+
+    pthread_mutex_lock(&pg_pool.mutex);
+    for (int i = 0; i < pg_pool.max_size; i++) {
+        if (pg_pool.conns[i].conn == conn) {
+            if (reset) {
+                nosdk_pg_stmts_clear(&pg_pool.conns[i].stmts);
+            }
+            pg_pool.conns[i].in_use = false;
+        }
+    }
+    pthread_cond_signal(&pg_pool.available);
+    pthread_mutex_unlock(&pg_pool.mutex);
+}
+
+// check idle connections, replacing broken and old ones, and open new ones
+// until min_size are up. called with the pool lock held.
+void nosdk_pg_pool_maintain() {
+    int open = 0;
+    for (int i = 0; i < pg_pool.max_size; i++) {
+        struct nosdk_pg_conn *slot = &pg_pool.conns[i];
+        if (slot->in_use || slot->connecting || slot->conn == NULL) {
+            open += slot->in_use || slot->connecting;
+            continue;
+        }
+
+        // take the slot so no request gets it while it is checked
+        slot->in_use = true;
+        PGconn *conn = slot->conn;
+        bool healthy = !nosdk_pg_slot_expired(slot, nosdk_now_ms());
+        pthread_mutex_unlock(&pg_pool.mutex);
+
+        if (healthy) {
+            PGresult *res = PQexec(conn, "SELECT 1");
+            healthy = PQresultStatus(res) == PGRES_TUPLES_OK;
+            PQclear(res);
+        }
+
+        pthread_mutex_lock(&pg_pool.mutex);
+        if (!healthy) {
+            nosdk_debugf("replacing postgres connection\n");
+            slot->connecting = true;
+            nosdk_pg_slot_connect(slot);
+        }
+        slot->in_use = false;
+        if (slot->conn != NULL) {
+            open++;
+        }
+        pthread_cond_signal(&pg_pool.available);
+    }
+
+    for (int i = 0; i < pg_pool.max_size && open < pg_pool.min_size; i++) {
+        struct nosdk_pg_conn *slot = &pg_pool.conns[i];
+        if (slot->in_use || slot->connecting || slot->conn != NULL) {
+            continue;
+        }
+
+        slot->connecting = true;
+        if (nosdk_pg_slot_connect(slot) != 0) {
+            break;
+        }
+        open++;
+        pthread_cond_signal(&pg_pool.available);
+    }
+}
+
+// warms the pool up to min_size, then keeps it there
+void *nosdk_pg_health_thread(void *arg) {
+    pthread_mutex_lock(&pg_pool.mutex);
+    while (pg_pool.running) {
+        nosdk_pg_pool_maintain();
+        if (!pg_pool.running) {
+            break;
+        }
+
+        struct timespec deadline;
+        nosdk_deadline_after_ms(&deadline, pg_pool.health_interval_ms);
+        pthread_cond_timedwait(&pg_pool.health_cond, &pg_pool.mutex, &deadline);
+    }
+    pthread_mutex_unlock(&pg_pool.mutex);
+    return NULL;
+}
+
+// the statement cache of a connection taken from the pool
+struct nosdk_pg_stmts *nosdk_pg_stmts_of(PGconn *conn) {
+    struct nosdk_pg_stmts *stmts = NULL;
+
     pthread_mutex_lock(&pg_pool.mutex);
-    for (int i = 0; i < PG_POOL_MAX; i++) {
-        if (pg_pool.pool[i] == conn) {
-            pg_pool.in_use[i] = 0;
+    for (int i = 0; i < pg_pool.max_size; i++) {
+        if (pg_pool.conns[i].conn == conn) {
+            stmts = &pg_pool.conns[i].stmts;
         }
     }
     pthread_mutex_unlock(&pg_pool.mutex);
+    return stmts;
+}
+
+void nosdk_pg_stmt_forget(struct nosdk_pg_stmts *stmts, const char *name) {
+    for (int i = 0; i < stmts->num_stmts; i++) {
+        if (strcmp(stmts->stmts[i].name, name) == 0) {
+            free(stmts->stmts[i].sql);
+            stmts->num_stmts--;
+            stmts->stmts[i] = stmts->stmts[stmts->num_stmts];
+            return;
+        }
+    }
+}
+
+int nosdk_pg_pipeline_begin(struct nosdk_pg_pipeline *p, PGconn *conn) {
+    p->conn = conn;
+    p->stmts = nosdk_pg_stmts_of(conn);
+    p->num_cmds = 0;
+    if (p->stmts == NULL || PQenterPipelineMode(conn) != 1) {
+        fprintf(stderr, "pipeline failed: %s\n", PQerrorMessage(conn));
+        return -1;
+    }
+    return 0;
+}
+
+// record a command the pipeline sent, and the statement it prepares
+int nosdk_pg_pipeline_queued(
+    struct nosdk_pg_pipeline *p, int sent, const char *prepared) {
+    if (sent != 1) {
+        fprintf(stderr, "pipeline send failed: %s\n", PQerrorMessage(p->conn));
+        if (prepared != NULL) {
+            nosdk_pg_stmt_forget(p->stmts, prepared);
+        }
+        return -1;
+    }
+
+    struct nosdk_pg_pipeline_cmd *cmd = &p->cmds[p->num_cmds];
+    snprintf(
+        cmd->prepared, sizeof(cmd->prepared), "%s",
+        prepared != NULL ? prepared : "");
+    p->num_cmds++;
+    return 0;
+}
+
+// check the result of queued command i, forgetting the statement it
+// prepared if it failed
+bool nosdk_pg_pipeline_failed(
+    struct nosdk_pg_pipeline *p, int i, PGresult *res, int ret) {
+    ExecStatusType status = PQresultStatus(res);
+    bool failed = status != PGRES_COMMAND_OK && status != PGRES_TUPLES_OK &&
+                  status != PGRES_SINGLE_TUPLE;
+
+    if (failed && p->cmds[i].prepared[0] != '\0') {
+        nosdk_pg_stmt_forget(p->stmts, p->cmds[i].prepared);
+    }
+    if (failed && ret == 0 && status != PGRES_PIPELINE_ABORTED) {
+        fprintf(stderr, "pipeline failed: %s", PQresultErrorMessage(res));
+    }
+    return failed;
+}
+
+// collect the result of every queued command. first, if set, takes the
+// first failed result, or the result of the last command if none failed.
+int nosdk_pg_pipeline_sync(struct nosdk_pg_pipeline *p, PGresult **first) {
+    int ret = 0;
+    if (PQpipelineSync(p->conn) != 1) {
+        fprintf(stderr, "pipeline sync failed: %s\n", PQerrorMessage(p->conn));
+        return -1;
+    }
+
+    for (int i = 0; i < p->num_cmds; i++) {
+        PGresult *res = PQgetResult(p->conn);
+        bool failed = nosdk_pg_pipeline_failed(p, i, res, ret);
+
+        if (first != NULL && ret == 0 && (failed || i == p->num_cmds - 1)) {
+            *first = res;
+        } else {
+            PQclear(res);
+        }
+        if (failed) {
+            ret = -1;
+        }
+
+        // every command's results end with a NULL
+        while (res != NULL && (res = PQgetResult(p->conn)) != NULL) {
+            PQclear(res);
+        }
+    }
+
+    PGresult *res = PQgetResult(p->conn);
+    if (PQresultStatus(res) != PGRES_PIPELINE_SYNC) {
+        ret = -1;
+    }
+    PQclear(res);
+    p->num_cmds = 0;
+    return ret;
+}
+
+void nosdk_pg_cancel(PGconn *conn) {
+    char err[256];
+    PGcancel *cancel = PQgetCancel(conn);
+    if (cancel != NULL) {
+        if (!PQcancel(cancel, err, sizeof(err))) {
+            fprintf(stderr, "cancel failed: %s\n", err);
+        }
+        PQfreeCancel(cancel);
+    }
+}
+
+// like nosdk_pg_pipeline_sync, but the rows of the last command are handed
+// to row_fn one at a time as they arrive instead of being collected
+int nosdk_pg_pipeline_sync_rows(
+    struct nosdk_pg_pipeline *p, nosdk_pg_row_fn row_fn, void *arg) {
+    int ret = 0;
+    if (PQpipelineSync(p->conn) != 1) {
+        fprintf(stderr, "pipeline sync failed: %s\n", PQerrorMessage(p->conn));
+        return -1;
+    }
+
+    for (int i = 0; i < p->num_cmds; i++) {
+        bool rows = i == p->num_cmds - 1;
+        if (rows && ret == 0 && PQsetSingleRowMode(p->conn) != 1) {
+            fprintf(stderr, "single-row mode failed\n");
+        }
+
+        int results = 0;
+        PGresult *res;
+        while ((res = PQgetResult(p->conn)) != NULL) {
+            results++;
+            if (nosdk_pg_pipeline_failed(p, i, res, ret)) {
+                ret = -1;
+            } else if (
+                rows && ret == 0 && PQresultStatus(res) == PGRES_SINGLE_TUPLE &&
+                row_fn(res, arg) != 0) {
+                // the rest of the rows are read and dropped
+                nosdk_pg_cancel(p->conn);
+                ret = -1;
+            }
+            PQclear(res);
+        }
+        if (results == 0) {
+            ret = -1;
+        }
+    }
+
+    PGresult *res = PQgetResult(p->conn);
+    if (PQresultStatus(res) != PGRES_PIPELINE_SYNC) {
+        ret = -1;
+    }
+    PQclear(res);
+    p->num_cmds = 0;
+    return ret;
+}
+
+// leave pipeline mode. a connection that cannot is reset, which drops
+// its prepared statements too.
+int nosdk_pg_pipeline_end(struct nosdk_pg_pipeline *p) {
+    if (PQexitPipelineMode(p->conn) != 1) {
+        fprintf(stderr, "pipeline exit failed: %s\n", PQerrorMessage(p->conn));
+        nosdk_pg_stmts_clear(p->stmts);
+        PQreset(p->conn);
+        return -1;
+    }
+    return 0;
+}
+
+// queue a statement that is not prepared, e.g. BEGIN
+int nosdk_pg_pipeline_command(struct nosdk_pg_pipeline *p, const char *sql) {
+    if (p->num_cmds == PG_PIPELINE_BATCH &&
+        nosdk_pg_pipeline_sync(p, NULL) != 0) {
+        return -1;
+    }
+
+    return nosdk_pg_pipeline_queued(
+        p, PQsendQueryParams(p->conn, sql, 0, NULL, NULL, NULL, NULL, 0),
+        NULL);
+}
+
+// queue a parameterized statement, prepared first if the connection has
+// not seen its sql yet. the least recently used statement makes room.
+int nosdk_pg_pipeline_send(
+    struct nosdk_pg_pipeline *p,
+    const char *sql,
+    int n_params,
+    const char *const *params) {
+    if (p->num_cmds + 3 > PG_PIPELINE_BATCH &&
+        nosdk_pg_pipeline_sync(p, NULL) != 0) {
+        return -1;
+    }
+
+    struct nosdk_pg_stmts *stmts = p->stmts;
+    struct nosdk_pg_stmt *stmt = NULL;
+    stmts->clock++;
+    for (int i = 0; i < stmts->num_stmts; i++) {
+        if (strcmp(stmts->stmts[i].sql, sql) == 0) {
+            stmt = &stmts->stmts[i];
+            stmt->last_used = stmts->clock;
+            break;
+        }
+    }
+
+    if (stmt == NULL) {
+        if (stmts->num_stmts == PG_STMTS_MAX) {
+            struct nosdk_pg_stmt *lru = &stmts->stmts[0];
+            for (int i = 1; i < stmts->num_stmts; i++) {
+                if (stmts->stmts[i].last_used < lru->last_used) {
+                    lru = &stmts->stmts[i];
+                }
+            }
+
+            char query[64];
+            snprintf(query, sizeof(query), "DEALLOCATE %s", lru->name);
+            if (nosdk_pg_pipeline_command(p, query) != 0) {
+                return -1;
+            }
+            nosdk_pg_stmt_forget(stmts, lru->name);
+        }
+
+        stmt = &stmts->stmts[stmts->num_stmts];
+        snprintf(stmt->name, sizeof(stmt->name), "nosdk_%d", stmts->next_id++);
+        stmt->sql = strdup(sql);
+        stmt->last_used = stmts->clock;
+        stmts->num_stmts++;
+
+        if (nosdk_pg_pipeline_queued(
+                p, PQsendPrepare(p->conn, stmt->name, sql, n_params, NULL),
+                stmt->name) != 0) {
+            return -1;
+        }
+    }
+
+    return nosdk_pg_pipeline_queued(
+        p,
+        PQsendQueryPrepared(
+            p->conn, stmt->name, n_params, params, NULL, NULL, 0),
+        NULL);
 }
 
-int table_exists(PGconn *conn, const char *table_name) {
-    const char *query = "SELECT EXISTS ("
-                        "SELECT 1 FROM information_schema.tables "
-                        "WHERE table_schema = 'public' AND table_name = $1"
-                        ")";
+// run a parameterized statement, prepared once per connection. a statement
+// that is not prepared yet is prepared and run in the same round trip.
+PGresult *nosdk_pg_exec(
+    PGconn *conn, const char *sql, int n_params, const char *const *params) {
+    struct nosdk_pg_pipeline p;
+    if (nosdk_pg_pipeline_begin(&p, conn) != 0) {
+        return PQexecParams(conn, sql, n_params, NULL, params, NULL, NULL, 0);
+    }
 
-    const char *params[1] = {table_name};
-    PGresult *res = PQexecParams(conn, query, 1, NULL, params, NULL, NULL, 0);
+    PGresult *res = NULL;
+    nosdk_pg_pipeline_send(&p, sql, n_params, params);
+    nosdk_pg_pipeline_sync(&p, &res);
+    nosdk_pg_pipeline_end(&p);
+    return res;
+}
+
+// call with the tables lock held
+int nosdk_pg_table_find(const char *table_name) {
+    for (int i = 0; i < pg_pool.num_tables; i++) {
+        if (strcmp(pg_pool.tables[i].name, table_name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
 
+bool nosdk_pg_table_known(const char *table_name) {
+    pthread_rwlock_rdlock(&pg_pool.tables_lock);
+    bool known = nosdk_pg_table_find(table_name) >= 0;
+    pthread_rwlock_unlock(&pg_pool.tables_lock);
+    return known;
+}
+
+void nosdk_pg_table_add(const char *table_name, bool string_id) {
+    pthread_rwlock_wrlock(&pg_pool.tables_lock);
+    if (nosdk_pg_table_find(table_name) < 0 &&
+        pg_pool.num_tables < PG_TABLES_MAX) {
+        struct nosdk_pg_table *t = &pg_pool.tables[pg_pool.num_tables];
+        t->name = strdup(table_name);
+        t->string_id = string_id;
+        pg_pool.num_tables++;
+    }
+    pthread_rwlock_unlock(&pg_pool.tables_lock);
+}
+
+void nosdk_pg_table_forget(const char *table_name) {
+    pthread_rwlock_wrlock(&pg_pool.tables_lock);
+    int i = nosdk_pg_table_find(table_name);
+    if (i >= 0) {
+        free(pg_pool.tables[i].name);
+        pg_pool.num_tables--;
+        pg_pool.tables[i] = pg_pool.tables[pg_pool.num_tables];
+    }
+    pthread_rwlock_unlock(&pg_pool.tables_lock);
+}
+
+// cache every table that has the layout created for writes
+int nosdk_pg_tables_load(PGconn *conn) {
+    const char *query = "SELECT table_name, data_type "
+                        "FROM information_schema.columns "
+                        "WHERE table_schema = 'public' AND column_name = 'id'";
+
+    PGresult *res = PQexec(conn, query);
     if (PQresultStatus(res) != PGRES_TUPLES_OK) {
-        fprintf(stderr, "Query failed: %s", PQerrorMessage(conn));
+        fprintf(stderr, "loading tables failed: %s", PQerrorMessage(conn));
         PQclear(res);
         return -1;
     }
 
-    int exists = 0;
-    if (PQntuples(res) > 0) {
-        char *result = PQgetvalue(res, 0, 0);
-        exists = (result[0] == 't');
+    for (int i = 0; i < PQntuples(res); i++) {
+        nosdk_pg_table_add(
+            PQgetvalue(res, i, 0),
+            strcmp(PQgetvalue(res, i, 1), "integer") != 0);
     }
+    nosdk_debugf("cached %d tables\n", PQntuples(res));
 
     PQclear(res);
-    return exists;
+    return 0;
+}
+
+// forget the table if res failed because it does not exist, returns 1 if
+// it did
+int nosdk_pg_undefined_table(PGresult *res, const char *table_name) {
+    char *state = PQresultErrorField(res, PG_DIAG_SQLSTATE);
+    if (state == NULL || strcmp(state, "42P01") != 0) {
+        return 0;
+    }
+
+    nosdk_debugf("table %s is gone\n", table_name);
+    nosdk_pg_table_forget(table_name);
+    return 1;
+}
+
+// the sort key of a page, with missing keys sorting as JSON null
+void nosdk_pg_page_key(struct nosdk_string_buffer *sb, char *order) {
+    nosdk_string_buffer_append(
+        sb, "COALESCE(data->'%s', 'null'::jsonb)", order);
+}
+
+bool nosdk_pg_identifier(const char *s, int len) {
+    for (int i = 0; i < len; i++) {
+        if (!isalnum((unsigned char)s[i]) && s[i] != '_') {
+            return false;
+        }
+    }
+    return len > 0;
+}
+
+// count a use of a filter on key cast to type, or of key as the sort key
+// of a page when type is NULL. only text filters and sort keys, whose
+// expressions hold for any row, are counted unless casts are enabled.
+void nosdk_pg_index_record(
+    const char *table_name, const char *key, int key_len, const char *type) {
+    if (!nosdk_pg_identifier(key, key_len)) {
+        return;
+    }
+    if (type != NULL && strcmp(type, "text") != 0 && !pg_pool.index_casts) {
+        return;
+    }
+
+    pthread_mutex_lock(&pg_pool.index_mutex);
+    struct nosdk_pg_index_key *k = NULL;
+    for (int i = 0; i < pg_pool.num_index_keys; i++) {
+        struct nosdk_pg_index_key *ik = &pg_pool.index_keys[i];
+        if (strcmp(ik->table, table_name) == 0 &&
+            strlen(ik->key) == key_len && memcmp(ik->key, key, key_len) == 0 &&
+            (ik->type == NULL) == (type == NULL) &&
+            (type == NULL || strcmp(ik->type, type) == 0)) {
+            k = ik;
+            break;
+        }
+    }
+
+    if (k == NULL && pg_pool.num_index_keys < PG_INDEX_KEYS_MAX) {
+        k = &pg_pool.index_keys[pg_pool.num_index_keys];
+        k->table = strdup(table_name);
+        k->key = strndup(key, key_len);
+        k->type = type != NULL ? strdup(type) : NULL;
+        k->uses = 0;
+        k->state = INDEX_COUNTING;
+        pg_pool.num_index_keys++;
+    }
+
+    if (k != NULL) {
+        k->uses++;
+        if (k->state == INDEX_COUNTING && k->uses >= pg_pool.index_threshold) {
+            k->state = INDEX_PENDING;
+            pthread_cond_signal(&pg_pool.index_cond);
+        }
+    }
+    pthread_mutex_unlock(&pg_pool.index_mutex);
+}
+
+void nosdk_pg_index_publish() {
+    struct nosdk_metric_set *set = nosdk_metric_set_new("postgres_indexes");
+
+    pthread_mutex_lock(&pg_pool.index_mutex);
+    for (int i = 0; i < pg_pool.num_index_keys; i++) {
+        struct nosdk_pg_index_key *k = &pg_pool.index_keys[i];
+        if (k->state == INDEX_CREATED) {
+            nosdk_metric_set_add(
+                set, "nosdk_pg_auto_index",
+                "Indexes created for frequently filtered or sorted keys", 1,
+                "table=\"%s\",key=\"%s\",type=\"%s\"", k->table, k->key,
+                k->type != NULL ? k->type : "sort");
+        }
+    }
+    nosdk_metric_set_add(
+        set, "nosdk_pg_auto_index_failures",
+        "Automatic index creations that failed", pg_pool.indexes_failed, "");
+    pthread_mutex_unlock(&pg_pool.index_mutex);
+
+    nosdk_metrics_publish(set);
+}
+
+// build the index on the same expression the queries use. concurrently,
+// so writes to the table go on, which rules out the pooled connections
+// and their pipelines.
+int nosdk_pg_create_index(struct nosdk_pg_index_key *k) {
+    uint32_t hash = 2166136261u;
+    const char *parts[3] = {k->table, k->key, k->type != NULL ? k->type : ""};
+    for (int i = 0; i < 3; i++) {
+        for (const char *c = parts[i]; *c != '\0'; c++) {
+            hash ^= (unsigned char)*c;
+            hash *= 16777619u;
+        }
+        hash ^= '/';
+        hash *= 16777619u;
+    }
+
+    char name[64];
+    snprintf(
+        name, sizeof(name), "nosdk_%.20s_%.20s_%08x", k->table, k->key, hash);
+
+    struct nosdk_string_buffer *sql = nosdk_string_buffer_new();
+    nosdk_string_buffer_append(
+        sql, "CREATE INDEX CONCURRENTLY IF NOT EXISTS %s ON %s (", name,
+        k->table);
+    if (k->type != NULL) {
+        nosdk_string_buffer_append(
+            sql, "((data->>'%s')::%s))", k->key, k->type);
+    } else {
+        nosdk_pg_page_key(sql, k->key);
+        nosdk_string_buffer_append(sql, ", id)");
+    }
+
+    PGconn *conn = nosdk_pg_connect();
+    if (conn == NULL) {
+        nosdk_string_buffer_free(sql);
+        return -1;
+    }
+    pthread_mutex_lock(&pg_pool.index_mutex);
+    pg_pool.index_conn = conn;
+    pthread_mutex_unlock(&pg_pool.index_mutex);
+
+    printf("creating index %s: %s\n", name, sql->data);
+    int ret = 0;
+    PGresult *res = PQexec(conn, sql->data);
+    if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+        fprintf(stderr, "index %s failed: %s", name, PQerrorMessage(conn));
+        ret = -1;
+
+        // a failed concurrent build leaves an invalid index behind
+        char drop[128];
+        snprintf(
+            drop, sizeof(drop), "DROP INDEX CONCURRENTLY IF EXISTS %s", name);
+        PQclear(PQexec(conn, drop));
+    }
+    PQclear(res);
+
+    pthread_mutex_lock(&pg_pool.index_mutex);
+    pg_pool.index_conn = NULL;
+    pthread_mutex_unlock(&pg_pool.index_mutex);
+
+    nosdk_pg_disconnect(conn);
+    nosdk_string_buffer_free(sql);
+    return ret;
+}
+
+void *nosdk_pg_index_thread(void *arg) {
+    pthread_mutex_lock(&pg_pool.index_mutex);
+    while (pg_pool.index_running) {
+        struct nosdk_pg_index_key *k = NULL;
+        for (int i = 0; i < pg_pool.num_index_keys; i++) {
+            if (pg_pool.index_keys[i].state == INDEX_PENDING) {
+                k = &pg_pool.index_keys[i];
+                break;
+            }
+        }
+        if (k == NULL) {
+            pthread_cond_wait(&pg_pool.index_cond, &pg_pool.index_mutex);
+            continue;
+        }
+
+        // entries are never removed, k stays valid without the lock
+        pthread_mutex_unlock(&pg_pool.index_mutex);
+        int ret = nosdk_pg_create_index(k);
+        pthread_mutex_lock(&pg_pool.index_mutex);
+
+        k->state = ret == 0 ? INDEX_CREATED : INDEX_FAILED;
+        if (ret != 0) {
+            pg_pool.indexes_failed++;
+        }
+
+        pthread_mutex_unlock(&pg_pool.index_mutex);
+        nosdk_pg_index_publish();
+        pthread_mutex_lock(&pg_pool.index_mutex);
+    }
+    pthread_mutex_unlock(&pg_pool.index_mutex);
+    return NULL;
+}
+
+// started by the first /db request, so processes that never use postgres
+// open no connections and start no threads
+int nosdk_pg_init() {
+    pthread_mutex_lock(&pg_init_mutex);
+    if (pg_pool.initialized) {
+        pthread_mutex_unlock(&pg_init_mutex);
+        return 0;
+    }
+    if (getenv("POSTGRES_DSN") == NULL) {
+        pthread_mutex_unlock(&pg_init_mutex);
+        fprintf(stderr, "POSTGRES_DSN is not set\n");
+        return -1;
+    }
+
+    int result = pthread_mutex_init(&pg_pool.mutex, NULL);
+    if (result != 0) {
+        pthread_mutex_unlock(&pg_init_mutex);
+        fprintf(stderr, "failed to initialize pool mutex: %d\n", result);
+        return -1;
+    }
+    result = pthread_rwlock_init(&pg_pool.tables_lock, NULL);
+    if (result != 0) {
+        pthread_mutex_unlock(&pg_init_mutex);
+        fprintf(stderr, "failed to initialize tables lock: %d\n", result);
+        return -1;
+    }
+
+    pthread_cond_init(&pg_pool.available, NULL);
+    pthread_cond_init(&pg_pool.health_cond, NULL);
+    pthread_mutex_init(&pg_pool.index_mutex, NULL);
+    pthread_cond_init(&pg_pool.index_cond, NULL);
+
+    pg_pool.max_size = nosdk_pg_env_int("NOSDK_PG_POOL_MAX", PG_POOL_MAX);
+    pg_pool.min_size = nosdk_pg_env_int("NOSDK_PG_POOL_MIN", PG_POOL_MIN);
+    if (pg_pool.min_size > pg_pool.max_size) {
+        pg_pool.min_size = pg_pool.max_size;
+    }
+    pg_pool.wait_ms =
+        nosdk_pg_env_int("NOSDK_PG_POOL_WAIT_MS", PG_POOL_WAIT_MS);
+    pg_pool.max_age_ms =
+        nosdk_pg_env_int("NOSDK_PG_CONN_MAX_AGE_MS", PG_CONN_MAX_AGE_MS);
+    pg_pool.health_interval_ms = nosdk_pg_env_int(
+        "NOSDK_PG_HEALTH_INTERVAL_MS", PG_HEALTH_INTERVAL_MS);
+    pg_pool.conns = calloc(pg_pool.max_size, sizeof(struct nosdk_pg_conn));
+    pg_pool.num_tables = 0;
+    pg_pool.index_threshold =
+        nosdk_pg_env_int("NOSDK_PG_INDEX_THRESHOLD", PG_INDEX_THRESHOLD);
+    pg_pool.index_casts = nosdk_pg_env_int("NOSDK_PG_INDEX_CASTS", 0) > 0;
+
+    pg_pool.initialized = true;
+
+    pg_pool.running = true;
+    result = pthread_create(
+        &pg_pool.health_thread, NULL, nosdk_pg_health_thread, NULL);
+    if (result != 0) {
+        fprintf(stderr, "failed to start pool health thread: %d\n", result);
+        pg_pool.running = false;
+    }
+
+    pg_pool.index_running = true;
+    result = pthread_create(
+        &pg_pool.index_thread, NULL, nosdk_pg_index_thread, NULL);
+    if (result != 0) {
+        fprintf(stderr, "failed to start index advisor: %d\n", result);
+        pg_pool.index_running = false;
+    }
+
+    // without a connection yet, tables are cached as they are written to
+    PGconn *conn = nosdk_pg_get_connection();
+    if (conn != NULL) {
+        nosdk_pg_tables_load(conn);
+        nosdk_pg_connection_release(conn);
+    }
+    pthread_mutex_unlock(&pg_init_mutex);
+    return 0;
+}
+
+void nosdk_pg_teardown() {
+    if (!pg_pool.initialized) {
+        return;
+    }
+
+    pthread_mutex_lock(&pg_pool.mutex);
+    bool running = pg_pool.running;
+    pg_pool.running = false;
+    pthread_cond_broadcast(&pg_pool.health_cond);
+    pthread_mutex_unlock(&pg_pool.mutex);
+    if (running) {
+        pthread_join(pg_pool.health_thread, NULL);
+    }
+
+    // an index still being built is cancelled, it is retried next time
+    pthread_mutex_lock(&pg_pool.index_mutex);
+    running = pg_pool.index_running;
+    pg_pool.index_running = false;
+    pthread_cond_broadcast(&pg_pool.index_cond);
+    if (pg_pool.index_conn != NULL) {
+        nosdk_pg_cancel(pg_pool.index_conn);
+    }
+    pthread_mutex_unlock(&pg_pool.index_mutex);
+    if (running) {
+        pthread_join(pg_pool.index_thread, NULL);
+    }
+    for (int i = 0; i < pg_pool.num_index_keys; i++) {
+        free(pg_pool.index_keys[i].table);
+        free(pg_pool.index_keys[i].key);
+        free(pg_pool.index_keys[i].type);
+    }
+    pg_pool.num_index_keys = 0;
+
+    for (int i = 0; i < pg_pool.max_size; i++) {
+        if (pg_pool.conns[i].conn != NULL) {
+            nosdk_pg_disconnect(pg_pool.conns[i].conn);
+        }
+        nosdk_pg_stmts_clear(&pg_pool.conns[i].stmts);
+    }
+    free(pg_pool.conns);
+    pg_pool.conns = NULL;
+    pg_pool.initialized = false;
 }
 
 int create_table_jsonb(
@@ -118,14 +874,14 @@ int create_table_jsonb(
     if (id_type == NULL) {
         snprintf(
             query, sizeof(query),
-            ("CREATE TABLE %s ("
+            ("CREATE TABLE IF NOT EXISTS %s ("
              "id SERIAL PRIMARY KEY,"
              "data JSONB NOT NULL)"),
             table_name);
     } else {
         snprintf(
             query, sizeof(query),
-            ("CREATE TABLE %s ("
+            ("CREATE TABLE IF NOT EXISTS %s ("
              "id VARCHAR(64) PRIMARY KEY,"
              "data JSONB NOT NULL)"),
             table_name);
@@ -179,22 +935,23 @@ char *get_request_path_id(struct nosdk_http_request *req) {
 }
 
 int create_table_for_item(PGconn *conn, char *table_name, char *item) {
-    char *id_val = json_extract_key(item, "id");
+    if (nosdk_pg_table_known(table_name)) {
+        return 0;
+    }
 
-    if (!table_exists(conn, table_name)) {
-        if (id_val == NULL) {
-            free(id_val);
-            return create_table_jsonb(conn, table_name, NULL);
-        } else {
-            free(id_val);
-            return create_table_jsonb(conn, table_name, "string");
-        }
+    char *id_val = json_extract_key(item, "id");
+    int ret = create_table_jsonb(
+        conn, table_name, id_val == NULL ? NULL : "string");
+    if (ret == 0) {
+        nosdk_pg_table_add(table_name, id_val != NULL);
     }
     free(id_val);
-    return 0;
+    return ret;
 }
 
-int nosdk_pg_insert_item(PGconn *conn, char *table_name, char *item) {
+// returns 1 if the insert failed because the table was dropped after it
+// was cached
+int nosdk_pg_insert_item_once(PGconn *conn, char *table_name, char *item) {
     const char *paramValues[2] = {item, NULL};
     char query[128];
     PGresult *res;
@@ -210,7 +967,7 @@ int nosdk_pg_insert_item(PGconn *conn, char *table_name, char *item) {
             query, sizeof(query), "INSERT INTO %s (data) VALUES ($1::jsonb)",
             table_name);
 
-        res = PQexecParams(conn, query, 1, NULL, paramValues, NULL, NULL, 0);
+        res = nosdk_pg_exec(conn, query, 1, paramValues);
 
     } else {
         paramValues[1] = id_value;
@@ -219,14 +976,17 @@ int nosdk_pg_insert_item(PGconn *conn, char *table_name, char *item) {
             query, sizeof(query),
             "INSERT INTO %s (id, data) VALUES ($2, $1::jsonb)", table_name);
 
-        res = PQexecParams(conn, query, 2, NULL, paramValues, NULL, NULL, 0);
+        res = nosdk_pg_exec(conn, query, 2, paramValues);
     }
 
     if (PQresultStatus(res) != PGRES_COMMAND_OK) {
-        fprintf(stderr, "insert failed: %s\n", PQerrorMessage(conn));
+        int ret = nosdk_pg_undefined_table(res, table_name) ? 1 : -1;
+        if (ret != 1) {
+            fprintf(stderr, "insert failed: %s\n", PQerrorMessage(conn));
+        }
         PQclear(res);
         free(id_value);
-        return -1;
+        return ret;
     }
 
     PQclear(res);
@@ -234,6 +994,14 @@ int nosdk_pg_insert_item(PGconn *conn, char *table_name, char *item) {
     return 0;
 }
 
+int nosdk_pg_insert_item(PGconn *conn, char *table_name, char *item) {
+    int ret = nosdk_pg_insert_item_once(conn, table_name, item);
+    if (ret == 1) {
+        ret = nosdk_pg_insert_item_once(conn, table_name, item);
+    }
+    return ret == 0 ? 0 : -1;
+}
+
 int nosdk_pg_update_item(PGconn *conn, char *table_name, char *item) {
     const char *paramValues[2] = {item, NULL};
     char query[128];
@@ -248,8 +1016,7 @@ int nosdk_pg_update_item(PGconn *conn, char *table_name, char *item) {
         query, sizeof(query), "UPDATE %s SET data = $1::jsonb WHERE id = $2",
         table_name);
 
-    PGresult *res =
-        PQexecParams(conn, query, 2, NULL, paramValues, NULL, NULL, 0);
+    PGresult *res = nosdk_pg_exec(conn, query, 2, paramValues);
 
     if (PQresultStatus(res) != PGRES_COMMAND_OK) {
         fprintf(stderr, "insert failed: %s\n", PQerrorMessage(conn));
@@ -263,6 +1030,64 @@ int nosdk_pg_update_item(PGconn *conn, char *table_name, char *item) {
     return 0;
 }
 
+// update every object of a JSON array in one transaction, pipelined so
+// the items do not each wait for a round trip
+int nosdk_pg_update_items(PGconn *conn, char *table_name, char *data) {
+    struct nosdk_pg_pipeline p;
+    if (nosdk_pg_pipeline_begin(&p, conn) != 0) {
+        return -1;
+    }
+
+    char query[128];
+    snprintf(
+        query, sizeof(query), "UPDATE %s SET data = $1::jsonb WHERE id = $2",
+        table_name);
+
+    int ret = nosdk_pg_pipeline_command(&p, "BEGIN");
+
+    struct json_array_iter iter = {
+        .data = data,
+        .data_len = strlen(data),
+    };
+    int start_pos = 0;
+    int len = 0;
+    while (ret == 0 && json_array_next_item(&iter, &start_pos, &len) > 0) {
+        char c = data[start_pos + len];
+        data[start_pos + len] = '\0';
+
+        char *id_value = json_extract_key(&data[start_pos], "id");
+        if (id_value == NULL) {
+            ret = -1;
+        } else {
+            const char *paramValues[2] = {&data[start_pos], id_value};
+            ret = nosdk_pg_pipeline_send(&p, query, 2, paramValues);
+        }
+
+        free(id_value);
+        data[start_pos + len] = c;
+    }
+
+    if (ret == 0) {
+        ret = nosdk_pg_pipeline_command(&p, "COMMIT");
+    }
+    if (ret == 0) {
+        ret = nosdk_pg_pipeline_sync(&p, NULL);
+    } else if (p.num_cmds > 0) {
+        nosdk_pg_pipeline_sync(&p, NULL);
+    }
+
+    // a failed command aborts the rest of its sync, COMMIT included, and
+    // leaves the transaction open. it is rolled back in a sync of its own.
+    if (ret != 0 && (nosdk_pg_pipeline_command(&p, "ROLLBACK") != 0 ||
+                     nosdk_pg_pipeline_sync(&p, NULL) != 0)) {
+        fprintf(stderr, "rollback failed\n");
+    }
+    if (nosdk_pg_pipeline_end(&p) != 0) {
+        ret = -1;
+    }
+    return ret;
+}
+
 char *get_operator(char c) {
     switch (c) {
     case '=':
@@ -295,8 +1120,150 @@ char *val2pgtype(char *val) {
     return "integer";
 }
 
+// take limit, order and after out of the filters, returns 1 if key was
+// one of them
+int nosdk_pg_page_param(
+    struct nosdk_pg_page *page, char *key, int key_len, char *val) {
+    if (key_len == 5 && memcmp(key, "limit", 5) == 0) {
+        page->limit = atoi(val);
+        if (page->limit > PG_PAGE_LIMIT_MAX) {
+            page->limit = PG_PAGE_LIMIT_MAX;
+        }
+        return 1;
+    } else if (key_len == 5 && memcmp(key, "order", 5) == 0) {
+        page->desc = val[0] == '-';
+        snprintf(
+            page->order, sizeof(page->order), "%s", page->desc ? &val[1] : val);
+        return 1;
+    } else if (key_len == 5 && memcmp(key, "after", 5) == 0) {
+        free(page->after);
+        page->after = strdup(val);
+        return 1;
+    } else if (key_len == 6 && memcmp(key, "fields", 6) == 0) {
+        // a projection, see nosdk_pg_fields_parse
+        return 1;
+    }
+    return 0;
+}
+
+// the decoded value of key in a query string, NULL if it is not there
+char *nosdk_pg_query_value(char *query, const char *key) {
+    char *decoded = strdup(query);
+    urldecode2(decoded, decoded);
+
+    char *value = NULL;
+    int key_len = strlen(key);
+    char *p = decoded;
+    while (p != NULL && value == NULL) {
+        p++;
+        if (strncmp(p, key, key_len) == 0 && p[key_len] == '=') {
+            char *end = strchr(p, '&');
+            int len = end != NULL ? end - p : strlen(p);
+            value = strndup(&p[key_len + 1], len - key_len - 1);
+        }
+        p = strchr(p, '&');
+    }
+
+    free(decoded);
+    return value;
+}
+
+// split fields=a,b.c in place into paths, returns the number of fields or
+// -1 if one is not made of identifiers
+int nosdk_pg_fields_parse(char *list, struct nosdk_pg_field *fields) {
+    int n = 0;
+    char *save_list;
+    for (char *f = strtok_r(list, ",", &save_list); f != NULL;
+         f = strtok_r(NULL, ",", &save_list)) {
+        if (n == PG_FIELDS_MAX) {
+            return -1;
+        }
+
+        struct nosdk_pg_field *field = &fields[n++];
+        field->depth = 0;
+        char *save_field;
+        for (char *s = strtok_r(f, ".", &save_field); s != NULL;
+             s = strtok_r(NULL, ".", &save_field)) {
+            if (field->depth == PG_FIELD_DEPTH_MAX ||
+                !nosdk_pg_identifier(s, strlen(s))) {
+                return -1;
+            }
+            field->segments[field->depth++] = s;
+        }
+        if (field->depth == 0) {
+            return -1;
+        }
+    }
+    return n;
+}
+
+// build the object of the fields below depth out of the jsonb value expr.
+// a field wins over deeper ones under it, e.g. b over b.c.
+void nosdk_pg_fields_sql(
+    struct nosdk_string_buffer *sb,
+    struct nosdk_pg_field *fields,
+    int n,
+    int depth,
+    const char *expr) {
+    struct nosdk_pg_field *below[PG_FIELDS_MAX];
+    int printed = 0;
+
+    nosdk_string_buffer_append(sb, "jsonb_build_object(");
+    for (int i = 0; i < n; i++) {
+        char *name = fields[i].segments[depth];
+
+        // every name once, where it is first asked for
+        bool seen = false;
+        for (int j = 0; j < i && !seen; j++) {
+            seen = strcmp(fields[j].segments[depth], name) == 0;
+        }
+        if (seen) {
+            continue;
+        }
+
+        bool whole = false;
+        int m = 0;
+        for (int j = i; j < n; j++) {
+            if (strcmp(fields[j].segments[depth], name) == 0) {
+                whole = whole || fields[j].depth == depth + 1;
+                below[m++] = &fields[j];
+            }
+        }
+
+        nosdk_string_buffer_append(
+            sb, "%s'%s', ", printed > 0 ? ", " : "", name);
+        printed++;
+
+        char child[HTTP_PATH_MAX * 2];
+        snprintf(child, sizeof(child), "%s->'%s'", expr, name);
+        if (whole && depth == 0 && strcmp(name, "id") == 0) {
+            // rows without an id of their own are given the id column's,
+            // as when the whole row is returned
+            nosdk_string_buffer_append(
+                sb, "COALESCE(%s, to_jsonb(id))", child);
+        } else if (whole) {
+            nosdk_string_buffer_append(sb, "%s", child);
+        } else {
+            struct nosdk_pg_field sub[PG_FIELDS_MAX];
+            for (int j = 0; j < m; j++) {
+                sub[j] = *below[j];
+            }
+            nosdk_pg_fields_sql(sb, sub, m, depth + 1, child);
+        }
+    }
+    nosdk_string_buffer_append(sb, ")");
+}
+
+// append the filters of a query string as where clauses, binding their
+// values to paramValues. returns the number bound, or -1 when there are
+// more than max_params.
 int translate_query_string(
-    struct nosdk_string_buffer *sb, char *paramValues[16], char *query) {
+    struct nosdk_string_buffer *sb,
+    char **paramValues,
+    int max_params,
+    char *query,
+    struct nosdk_pg_page *page,
+    char *table_name) {
 
     urldecode2(query, query);
 
@@ -305,8 +1272,8 @@ int translate_query_string(
     int key_len = 0;
     int val_len = 0;
 
-    char key[64];
-    char val[64];
+    char key[HTTP_PATH_MAX];
+    char val[HTTP_PATH_MAX];
     char *operator;
 
     int n_clauses = 0;
@@ -332,11 +1299,21 @@ int translate_query_string(
             }
 
             val[val_len] = '\0';
-            paramValues[n_clauses] = strdup(val);
-            n_clauses++;
-            nosdk_string_buffer_append(
-                sb, " %s (data->>'%.*s')::%s %s $%d", word, key_len, key,
-                val2pgtype(val), operator, n_clauses);
+            if (page == NULL || !nosdk_pg_page_param(page, key, key_len, val)) {
+                if (n_clauses >= max_params) {
+                    for (int j = 0; j < n_clauses; j++) {
+                        free(paramValues[j]);
+                    }
+                    return -1;
+                }
+                paramValues[n_clauses] = strdup(val);
+                n_clauses++;
+                nosdk_string_buffer_append(
+                    sb, " %s (data->>'%.*s')::%s %s $%d", word, key_len, key,
+                    val2pgtype(val), operator, n_clauses);
+                nosdk_pg_index_record(
+                    table_name, key, key_len, val2pgtype(val));
+            }
 
             key_len = 0;
             val_len = 0;
@@ -347,11 +1324,291 @@ int translate_query_string(
     return n_clauses;
 }
 
-void nosdk_pg_handle_post(struct nosdk_http_request *req, PGconn *conn) {
-    char *data = nosdk_http_request_body_alloc(req);
+// append the cursor condition, ordering and limit of a page to the where
+// clauses of n_params filters. returns the new number of parameters, or
+// -1 for an invalid order key or cursor, or more than max_params.
+int nosdk_pg_page_sql(
+    struct nosdk_string_buffer *sb,
+    char **paramValues,
+    int max_params,
+    int n_params,
+    struct nosdk_pg_page *page) {
+    bool by_key = page->order[0] != '\0' && strcmp(page->order, "id") != 0;
+    if (page->order[0] != '\0' &&
+        !nosdk_pg_identifier(page->order, strlen(page->order))) {
+        return -1;
+    }
+    if (page->limit == 0 && page->after == NULL && page->order[0] == '\0') {
+        return n_params;
+    }
+
+    int needed = (page->after != NULL ? 1 + by_key : 0) + (page->limit > 0);
+    if (n_params + needed > max_params) {
+        return -1;
+    }
+
+    char *op = page->desc ? "<" : ">";
+    char *dir = page->desc ? " DESC" : "";
+
+    if (page->after != NULL) {
+        int len;
+        char *cursor = nosdk_base64url_decode(page->after, &len);
+        char *sep = cursor != NULL ? memchr(cursor, '\n', len) : NULL;
+        if (cursor == NULL || (by_key && sep == NULL) ||
+            (!by_key && sep != NULL)) {
+            free(cursor);
+            return -1;
+        }
+
+        char *word = n_params > 0 ? "AND" : "WHERE";
+        if (by_key) {
+            *sep = '\0';
+            paramValues[n_params++] = strdup(sep + 1);
+            paramValues[n_params++] = strdup(cursor);
+            nosdk_string_buffer_append(sb, " %s (", word);
+            nosdk_pg_page_key(sb, page->order);
+            nosdk_string_buffer_append(
+                sb, ", id) %s ($%d::jsonb, $%d)", op, n_params - 1, n_params);
+        } else {
+            paramValues[n_params++] = strdup(cursor);
+            nosdk_string_buffer_append(
+                sb, " %s id %s $%d", word, op, n_params);
+        }
+        free(cursor);
+    }
+
+    nosdk_string_buffer_append(sb, " ORDER BY ");
+    if (by_key) {
+        nosdk_pg_page_key(sb, page->order);
+        nosdk_string_buffer_append(sb, "%s, ", dir);
+    }
+    nosdk_string_buffer_append(sb, "id%s", dir);
+
+    if (page->limit > 0) {
+        char limit[16];
+        snprintf(limit, sizeof(limit), "%d", page->limit);
+        paramValues[n_params++] = strdup(limit);
+        nosdk_string_buffer_append(sb, " LIMIT $%d", n_params);
+    }
+
+    return n_params;
+}
+
+int nosdk_pg_exec_command(PGconn *conn, const char *query) {
+    PGresult *res = PQexec(conn, query);
+    if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+        fprintf(stderr, "%s failed: %s\n", query, PQerrorMessage(conn));
+        PQclear(res);
+        return -1;
+    }
+
+    PQclear(res);
+    return 0;
+}
+
+// append data[0:len] as a field of the COPY text format
+void nosdk_pg_copy_escape(
+    struct nosdk_string_buffer *sb, const char *data, int len) {
+    int run_start = 0;
+    for (int i = 0; i < len; i++) {
+        char c = data[i];
+        if (c != '\\' && c != '\n' && c != '\r' && c != '\t') {
+            continue;
+        }
+
+        nosdk_string_buffer_append(sb, "%.*s", i - run_start, &data[run_start]);
+        run_start = i + 1;
+
+        if (c == '\\') {
+            nosdk_string_buffer_append(sb, "\\\\");
+        } else if (c == '\n') {
+            nosdk_string_buffer_append(sb, "\\n");
+        } else if (c == '\r') {
+            nosdk_string_buffer_append(sb, "\\r");
+        } else {
+            nosdk_string_buffer_append(sb, "\\t");
+        }
+    }
+
+    nosdk_string_buffer_append(sb, "%.*s", len - run_start, &data[run_start]);
+}
+
+int nosdk_pg_copy_flush(struct nosdk_pg_copy *copy) {
+    if (copy->buf->size == 0) {
+        return 0;
+    }
+    if (PQputCopyData(copy->conn, copy->buf->data, copy->buf->size) != 1) {
+        fprintf(stderr, "copy failed: %s\n", PQerrorMessage(copy->conn));
+        return -1;
+    }
+    copy->buf->size = 0;
+    return 0;
+}
+
+int nosdk_pg_copy_start(struct nosdk_pg_copy *copy, int with_id) {
+    char query[128];
+    snprintf(
+        query, sizeof(query), "COPY %s (%s) FROM STDIN", copy->table_name,
+        with_id ? "id, data" : "data");
+
+    PGresult *res = PQexec(copy->conn, query);
+    if (PQresultStatus(res) != PGRES_COPY_IN) {
+        nosdk_pg_undefined_table(res, copy->table_name);
+        fprintf(stderr, "copy failed: %s\n", PQerrorMessage(copy->conn));
+        PQclear(res);
+        return -1;
+    }
+
+    PQclear(res);
+    copy->in_copy = 1;
+    copy->with_id = with_id;
+    return 0;
+}
+
+// finish the running COPY, or abort it with error set
+int nosdk_pg_copy_end(struct nosdk_pg_copy *copy, const char *error) {
+    int ret = 0;
+    if (error == NULL && nosdk_pg_copy_flush(copy) != 0) {
+        error = "flush failed";
+    }
+    copy->in_copy = 0;
+    copy->buf->size = 0;
+
+    if (PQputCopyEnd(copy->conn, error) != 1) {
+        fprintf(stderr, "copy failed: %s\n", PQerrorMessage(copy->conn));
+        ret = -1;
+    }
+
+    PGresult *res;
+    while ((res = PQgetResult(copy->conn)) != NULL) {
+        if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+            if (error == NULL) {
+                fprintf(
+                    stderr, "copy failed: %s\n", PQerrorMessage(copy->conn));
+            }
+            ret = -1;
+        }
+        PQclear(res);
+    }
+
+    return error == NULL ? ret : -1;
+}
+
+int nosdk_pg_copy_row(struct nosdk_pg_copy *copy, char *item) {
+    if (copy->rows == 0 &&
+        create_table_for_item(copy->conn, copy->table_name, item) != 0) {
+        return -1;
+    }
+
+    char *id_value = json_extract_key(item, "id");
+    int with_id = id_value != NULL;
+
+    if (copy->in_copy && copy->with_id != with_id &&
+        nosdk_pg_copy_end(copy, NULL) != 0) {
+        free(id_value);
+        return -1;
+    }
+    if (!copy->in_copy && nosdk_pg_copy_start(copy, with_id) != 0) {
+        free(id_value);
+        return -1;
+    }
+
+    if (with_id) {
+        nosdk_pg_copy_escape(copy->buf, id_value, strlen(id_value));
+        nosdk_string_buffer_append(copy->buf, "\t");
+    }
+    nosdk_pg_copy_escape(copy->buf, item, strlen(item));
+    nosdk_string_buffer_append(copy->buf, "\n");
+    copy->rows++;
+    free(id_value);
+
+    if (copy->buf->size >= PG_COPY_CHUNK) {
+        return nosdk_pg_copy_flush(copy);
+    }
+    return 0;
+}
+
+// insert the objects of a JSON array body in one transaction, copying
+// them in as they are read instead of buffering the whole body
+int nosdk_pg_copy_items(
+    struct nosdk_http_request *req, PGconn *conn, char *table_name) {
+    if (nosdk_pg_exec_command(conn, "BEGIN") != 0) {
+        return -1;
+    }
+
+    struct nosdk_pg_copy copy = {
+        .conn = conn,
+        .table_name = table_name,
+        .buf = nosdk_string_buffer_new(),
+    };
+    struct nosdk_string_buffer *item = nosdk_string_buffer_new();
+    struct json_stream_iter iter = {0};
+    char *chunk = malloc(PG_COPY_CHUNK);
+    int ret = 0;
+    int n;
+
+    while (ret == 0 &&
+           (n = nosdk_http_request_body_read(req, chunk, PG_COPY_CHUNK)) > 0) {
+        int pos = 0;
+        while (pos < n) {
+            int start;
+            int end =
+                json_stream_next_item(&iter, &chunk[pos], n - pos, &start);
+            int from = pos + (start >= 0 ? start : 0);
+
+            // keep the part of an item that continues in the next chunk
+            if (end < 0) {
+                if (start >= 0 || iter.depth > 0) {
+                    nosdk_string_buffer_append(
+                        item, "%.*s", n - from, &chunk[from]);
+                }
+                break;
+            }
 
+            nosdk_string_buffer_append(
+                item, "%.*s", pos + end - from, &chunk[from]);
+            if (nosdk_pg_copy_row(&copy, item->data) != 0) {
+                ret = -1;
+                break;
+            }
+            item->size = 0;
+            item->data[0] = '\0';
+            pos += end;
+        }
+    }
+    if (n < 0 || iter.depth > 0) {
+        ret = -1;
+    }
+
+    if (copy.in_copy &&
+        nosdk_pg_copy_end(&copy, ret == 0 ? NULL : "invalid request") != 0) {
+        ret = -1;
+    }
+    if (nosdk_pg_exec_command(conn, ret == 0 ? "COMMIT" : "ROLLBACK") != 0) {
+        ret = -1;
+    }
+
+    nosdk_debugf("copied %d rows into %s\n", copy.rows, table_name);
+    free(chunk);
+    nosdk_string_buffer_free(item);
+    nosdk_string_buffer_free(copy.buf);
+    return ret;
+}
+
+void nosdk_pg_handle_post(struct nosdk_http_request *req, PGconn *conn) {
     char *table_name = get_table_name(req);
 
+    if (nosdk_http_request_body_peek(req) == '[') {
+        int ret = nosdk_pg_copy_items(req, conn, table_name);
+        free(table_name);
+        nosdk_http_respond(
+            req, ret == 0 ? HTTP_STATUS_OK : HTTP_STATUS_INVALID_REQUEST,
+            "text/plain", NULL, 0);
+        return;
+    }
+
+    char *data = nosdk_http_request_body_alloc(req);
+
     if (data[0] == '{') {
         if (nosdk_pg_insert_item(conn, table_name, data) != 0) {
             free(data);
@@ -360,27 +1617,6 @@ void nosdk_pg_handle_post(struct nosdk_http_request *req, PGconn *conn) {
                 req, HTTP_STATUS_INVALID_REQUEST, "text/plain", NULL, 0);
             return;
         }
-    } else if (data[0] == '[') {
-        struct json_array_iter iter = {
-            .data = data,
-            .data_len = strlen(data),
-        };
-        int start_pos = 0;
-        int len = 0;
-        while (json_array_next_item(&iter, &start_pos, &len) > 0) {
-            // add null terminator. there should always be a , or ] after an
-            // array item so...
-            char c = data[start_pos + len];
-            data[start_pos + len] = '\0';
-            if (nosdk_pg_insert_item(conn, table_name, &data[start_pos]) != 0) {
-                free(data);
-                free(table_name);
-                nosdk_http_respond(
-                    req, HTTP_STATUS_INVALID_REQUEST, "text/plain", NULL, 0);
-                return;
-            }
-            data[start_pos + len] = c;
-        }
     }
 
     free(data);
@@ -392,74 +1628,210 @@ ssize_t writestr(int client_fd, char *s) {
     return write(client_fd, s, strlen(s));
 }
 
+// a GET response, buffered until it outgrows a chunk and streamed after.
+// a page is always buffered, its last row is the cursor to the next one.
+struct nosdk_pg_get_stream {
+    struct nosdk_http_request *req;
+    struct nosdk_string_buffer *sb;
+    int rows;
+    bool streaming;
+    bool paged;
+    struct nosdk_string_buffer *last;
+};
+
+int nosdk_pg_get_flush(struct nosdk_pg_get_stream *s) {
+    if (!s->streaming) {
+        if (nosdk_http_stream_start(
+                s->req, HTTP_STATUS_OK, "application/json") != 0) {
+            return -1;
+        }
+        s->streaming = true;
+    }
+
+    int ret = nosdk_http_stream_write(s->req, s->sb->data, s->sb->size);
+    s->sb->size = 0;
+    s->sb->data[0] = '\0';
+    return ret;
+}
+
+int nosdk_pg_get_row(PGresult *row, void *arg) {
+    struct nosdk_pg_get_stream *s = (struct nosdk_pg_get_stream *)arg;
+
+    if (s->rows > 0) {
+        nosdk_string_buffer_append(s->sb, ",");
+    }
+    char *data = PQgetvalue(row, 0, 0);
+    if (json_has_key(data, "id")) {
+        nosdk_string_buffer_append(s->sb, "%s", data);
+    } else {
+        char *id = PQgetvalue(row, 0, 1);
+        nosdk_string_buffer_append(s->sb, "{\"id\": %s,", id);
+        nosdk_string_buffer_append(s->sb, "%s", &data[1]);
+    }
+    s->rows++;
+
+    if (s->paged) {
+        s->last->size = 0;
+        nosdk_string_buffer_append(s->last, "%s", PQgetvalue(row, 0, 1));
+        if (PQnfields(row) > 2) {
+            nosdk_string_buffer_append(s->last, "\n%s", PQgetvalue(row, 0, 2));
+        }
+    }
+
+    if (!s->paged && s->sb->size >= PG_STREAM_CHUNK) {
+        return nosdk_pg_get_flush(s);
+    }
+    return 0;
+}
+
 void nosdk_pg_handle_get(struct nosdk_http_request *req, PGconn *conn) {
     char *table_name = get_table_name(req);
     char *path_id = get_request_path_id(req);
-    char *paramValues[16] = {0};
+    char *paramValues[PG_PARAMS_MAX] = {0};
     int n_params = 0;
 
-    struct nosdk_string_buffer *qbuf = nosdk_string_buffer_new();
-    struct nosdk_string_buffer *sb = nosdk_string_buffer_new();
+    int ret = 0;
 
-    nosdk_string_buffer_append(qbuf, "SELECT data, id FROM %s", table_name);
+    struct nosdk_string_buffer *qbuf = nosdk_string_buffer_new();
+    struct nosdk_string_buffer *where = nosdk_string_buffer_new();
+    where->data[0] = '\0';
+    struct nosdk_pg_page page = {0};
+    struct nosdk_pg_get_stream s = {
+        .req = req,
+        .sb = nosdk_string_buffer_new(),
+        .last = nosdk_string_buffer_new(),
+    };
 
     char *qstr = strstr(req->path, "?");
 
+    // only the requested fields leave postgres. read before the filters,
+    // which decode the query string in place.
+    char *field_list =
+        qstr != NULL ? nosdk_pg_query_value(qstr, "fields") : NULL;
+    struct nosdk_pg_field fields[PG_FIELDS_MAX];
+    int num_fields = 0;
+    if (field_list != NULL) {
+        num_fields = nosdk_pg_fields_parse(field_list, fields);
+        if (num_fields < 0) {
+            fprintf(stderr, "invalid fields\n");
+            ret = -1;
+        }
+    }
+
     if (path_id != NULL) {
-        nosdk_string_buffer_append(qbuf, " WHERE id = $1");
+        nosdk_string_buffer_append(where, " WHERE id = $1");
         paramValues[0] = strdup(path_id);
         n_params = 1;
-    } else if (qstr != NULL) {
-        n_params = translate_query_string(qbuf, paramValues, qstr);
+    } else {
+        if (qstr != NULL) {
+            n_params = translate_query_string(
+                where, paramValues, PG_PARAMS_MAX, qstr, &page, table_name);
+        }
+        int total = -1;
+        if (n_params >= 0) {
+            total = nosdk_pg_page_sql(
+                where, paramValues, PG_PARAMS_MAX, n_params, &page);
+        } else {
+            // translate_query_string freed what it bound
+            n_params = 0;
+        }
+        if (total < 0) {
+            fprintf(stderr, "too many filters, or invalid order or cursor\n");
+            ret = -1;
+        } else {
+            n_params = total;
+        }
+        s.paged = page.limit > 0;
+    }
+
+    nosdk_string_buffer_append(qbuf, "SELECT ");
+    if (num_fields > 0) {
+        nosdk_pg_fields_sql(qbuf, fields, num_fields, 0, "data");
+        nosdk_string_buffer_append(qbuf, ", id");
+    } else {
+        nosdk_string_buffer_append(qbuf, "data, id");
+    }
+    if (page.order[0] != '\0' && strcmp(page.order, "id") != 0) {
+        nosdk_string_buffer_append(qbuf, ", ");
+        nosdk_pg_page_key(qbuf, page.order);
+        if (ret == 0) {
+            nosdk_pg_index_record(
+                table_name, page.order, strlen(page.order), NULL);
+        }
     }
+    nosdk_string_buffer_append(qbuf, " FROM %s%s", table_name, where->data);
 
     nosdk_debugf("query: %s\n", qbuf->data);
 
-    PGresult *res = PQexecParams(
-        conn, qbuf->data, n_params, NULL, (const char *const *)paramValues,
-        NULL, NULL, 0);
+    if (path_id == NULL) {
+        nosdk_string_buffer_append(s.sb, "[");
+    }
+
+    // rows are written out as they arrive, so memory stays bounded
+    // however many the query returns
+    struct nosdk_pg_pipeline p;
+    if (ret == 0) {
+        ret = nosdk_pg_pipeline_begin(&p, conn);
+    }
+    if (ret == 0) {
+        ret = nosdk_pg_pipeline_send(
+            &p, qbuf->data, n_params, (const char *const *)paramValues);
+        if (nosdk_pg_pipeline_sync_rows(&p, nosdk_pg_get_row, &s) != 0) {
+            ret = -1;
+        }
+        nosdk_pg_pipeline_end(&p);
+    }
     for (int i = 0; i < n_params; i++) {
         free(paramValues[i]);
     }
-    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
-        fprintf(stderr, "select failed: %s", PQerrorMessage(conn));
-        free(table_name);
-        free(path_id);
-        nosdk_http_respond(
-            req, HTTP_STATUS_INVALID_REQUEST, "text/plain", NULL, 0);
-        nosdk_string_buffer_free(sb);
-        nosdk_string_buffer_free(qbuf);
-        PQclear(res);
-        return;
-    }
 
     if (path_id == NULL) {
-        nosdk_string_buffer_append(sb, "[");
+        nosdk_string_buffer_append(s.sb, "]");
     }
-    for (int i = 0; i < PQntuples(res); i++) {
-        char *data = PQgetvalue(res, i, 0);
-        if (json_has_key(data, "id")) {
-            nosdk_string_buffer_append(sb, data);
-        } else {
-            char *id = PQgetvalue(res, i, 1);
-            nosdk_string_buffer_append(sb, "{\"id\": %s,", id);
-            nosdk_string_buffer_append(sb, &data[1]);
+
+    if (ret != 0 && !s.streaming) {
+        fprintf(stderr, "select failed\n");
+        nosdk_http_respond(
+            req, HTTP_STATUS_INVALID_REQUEST, "text/plain", NULL, 0);
+    } else if (ret != 0) {
+        // the status is already sent, an unterminated body marks the error
+        fprintf(stderr, "select failed while streaming\n");
+    } else if (s.streaming) {
+        if (nosdk_pg_get_flush(&s) == 0) {
+            nosdk_http_stream_end(req);
         }
-        if (i < PQntuples(res) - 1) {
-            nosdk_string_buffer_append(sb, ",");
+    } else if (s.paged && s.rows == page.limit) {
+        // a full page, there may be more after its last row
+        struct nosdk_string_buffer *cursor = nosdk_string_buffer_new();
+        cursor->data[0] = '\0';
+        nosdk_base64url_encode(cursor, s.last->data, s.last->size);
+
+        // a page the client could not continue from is refused, order by
+        // a key with shorter values or by id instead
+        if (cursor->size >= HTTP_HEADER_VALUE_MAX) {
+            fprintf(stderr, "page cursor is too long for a header\n");
+            nosdk_http_respond(
+                req, HTTP_STATUS_INVALID_REQUEST, "text/plain", NULL, 0);
+        } else {
+            struct nosdk_http_header header = {.name = "X-Nosdk-Cursor"};
+            memcpy(header.value, cursor->data, cursor->size + 1);
+            nosdk_http_respond_headers(
+                req, HTTP_STATUS_OK, "application/json", &header, 1,
+                s.sb->data, s.sb->size);
         }
+        nosdk_string_buffer_free(cursor);
+    } else {
+        nosdk_http_respond(
+            req, HTTP_STATUS_OK, "application/json", s.sb->data, s.sb->size);
     }
-    if (path_id == NULL) {
-        nosdk_string_buffer_append(sb, "]");
-    }
-
-    PQclear(res);
 
     free(table_name);
     free(path_id);
-    nosdk_http_respond(
-        req, HTTP_STATUS_OK, "application/json", sb->data, sb->size);
-    nosdk_string_buffer_free(sb);
+    free(page.after);
+    free(field_list);
+    nosdk_string_buffer_free(s.sb);
+    nosdk_string_buffer_free(s.last);
+    nosdk_string_buffer_free(where);
     nosdk_string_buffer_free(qbuf);
 }
 
@@ -468,7 +1840,12 @@ void nosdk_pg_handle_put(struct nosdk_http_request *req, PGconn *conn) {
 
     char *table_name = get_table_name(req);
 
-    int ret = nosdk_pg_update_item(conn, table_name, data);
+    int ret;
+    if (data[0] == '[') {
+        ret = nosdk_pg_update_items(conn, table_name, data);
+    } else {
+        ret = nosdk_pg_update_item(conn, table_name, data);
+    }
     if (ret != 0) {
         free(data);
         free(table_name);
@@ -486,7 +1863,7 @@ void nosdk_pg_handle_delete(struct nosdk_http_request *req, PGconn *conn) {
     char *table_name = get_table_name(req);
     char *path_id = get_request_path_id(req);
     struct nosdk_string_buffer *qbuf = nosdk_string_buffer_new();
-    char *paramValues[16] = {0};
+    char *paramValues[PG_PARAMS_MAX] = {0};
     int n_params = 0;
 
     nosdk_string_buffer_append(qbuf, "DELETE FROM %s", table_name);
@@ -498,12 +1875,21 @@ void nosdk_pg_handle_delete(struct nosdk_http_request *req, PGconn *conn) {
         paramValues[0] = strdup(path_id);
         n_params = 1;
     } else if (qstr != NULL) {
-        n_params = translate_query_string(qbuf, paramValues, qstr);
+        n_params = translate_query_string(
+            qbuf, paramValues, PG_PARAMS_MAX, qstr, NULL, table_name);
+    }
+    if (n_params < 0) {
+        fprintf(stderr, "too many filters\n");
+        nosdk_http_respond(
+            req, HTTP_STATUS_INVALID_REQUEST, "text/plain", NULL, 0);
+        free(table_name);
+        free(path_id);
+        nosdk_string_buffer_free(qbuf);
+        return;
     }
 
-    PGresult *res = PQexecParams(
-        conn, qbuf->data, n_params, NULL, (const char *const *)paramValues,
-        NULL, NULL, 0);
+    PGresult *res = nosdk_pg_exec(
+        conn, qbuf->data, n_params, (const char *const *)paramValues);
     for (int i = 0; i < n_params; i++) {
         free(paramValues[i]);
     }
@@ -526,9 +1912,7 @@ void nosdk_pg_handle_delete(struct nosdk_http_request *req, PGconn *conn) {
 }
 
 void nosdk_pg_handler(struct nosdk_http_request *req) {
-    nosdk_pg_init();
-
-    PGconn *conn = nosdk_pg_get_connection();
+    PGconn *conn = nosdk_pg_init() == 0 ? nosdk_pg_get_connection() : NULL;
     if (conn == NULL) {
         nosdk_http_respond(
             req, HTTP_STATUS_INTERNAL_ERROR, "text/plain", NULL, 0);
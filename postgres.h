@@ -4,16 +4,181 @@
 #include <libpq-fe.h>
 #include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 #include "http.h"
+#include "util.h"
 
+// pool sizing and timing defaults, overridden by NOSDK_PG_POOL_MIN,
+// NOSDK_PG_POOL_MAX, NOSDK_PG_POOL_WAIT_MS, NOSDK_PG_CONN_MAX_AGE_MS and
+// NOSDK_PG_HEALTH_INTERVAL_MS
+#define PG_POOL_MIN 2
 #define PG_POOL_MAX 10
+#define PG_POOL_WAIT_MS 2000
+#define PG_CONN_MAX_AGE_MS (30 * 60 * 1000)
+#define PG_HEALTH_INTERVAL_MS 10000
+#define PG_TABLES_MAX 1024
+#define PG_STMTS_MAX 64
+#define PG_PIPELINE_BATCH 256
+
+// rows of a bulk insert are sent to COPY in chunks of about this size
+#define PG_COPY_CHUNK (64 * 1024)
+// selected rows are written out in chunks of about this size, a result
+// that fits in one is sent with a content length instead
+#define PG_STREAM_CHUNK (16 * 1024)
+// the most rows a page may ask for, a page is buffered to carry its cursor
+#define PG_PAGE_LIMIT_MAX 10000
+// the most parameters a /db query binds, filters and paging together
+#define PG_PARAMS_MAX 16
+#define PG_FIELDS_MAX 32
+#define PG_FIELD_DEPTH_MAX 8
+
+// a projected field of a GET, e.g. fields=a,b.c selects {"a", "b"."c"}
+struct nosdk_pg_field {
+    char *segments[PG_FIELD_DEPTH_MAX];
+    int depth;
+};
+
+// keys a table is filtered or sorted by this often get an index, overridden
+// by NOSDK_PG_INDEX_THRESHOLD
+#define PG_INDEX_THRESHOLD 1000
+#define PG_INDEX_KEYS_MAX 256
+
+enum nosdk_pg_index_state {
+    INDEX_COUNTING,
+    INDEX_PENDING,
+    INDEX_CREATED,
+    INDEX_FAILED,
+};
+
+// how often queries use a key of a table, in the form of the expression an
+// index has to match to serve them
+struct nosdk_pg_index_key {
+    char *table;
+    char *key;
+    // the cast of a filter, or NULL for a page's sort key
+    char *type;
+    int uses;
+    enum nosdk_pg_index_state state;
+};
+
+// a table known to exist, and whether its id is a string
+struct nosdk_pg_table {
+    char *name;
+    bool string_id;
+};
+
+// a statement prepared on a connection. its sql is the key: table names,
+// filter keys and operators are part of it, values are always parameters.
+struct nosdk_pg_stmt {
+    char *sql;
+    char name[32];
+    uint64_t last_used;
+};
+
+// the prepared statements of a pooled connection, least recently used
+// first to go. they are dropped with the connection.
+struct nosdk_pg_stmts {
+    struct nosdk_pg_stmt stmts[PG_STMTS_MAX];
+    int num_stmts;
+    uint64_t clock;
+    int next_id;
+};
+
+// a command queued on a pipeline, and the statement it prepares if any
+struct nosdk_pg_pipeline_cmd {
+    char prepared[32];
+};
+
+// statements sent back to back on a connection in pipeline mode. their
+// results are collected in order at a sync, which happens whenever the
+// batch is full so neither side's buffers fill up.
+struct nosdk_pg_pipeline {
+    PGconn *conn;
+    struct nosdk_pg_stmts *stmts;
+    struct nosdk_pg_pipeline_cmd cmds[PG_PIPELINE_BATCH];
+    int num_cmds;
+};
+
+// a pool slot. connecting slots are being (re)connected outside the pool
+// lock and are neither idle nor empty until that finishes.
+struct nosdk_pg_conn {
+    PGconn *conn;
+    bool in_use;
+    bool connecting;
+    int64_t created_ms;
+    struct nosdk_pg_stmts stmts;
+};
+
+// paging controls of a GET, taken out of its query string. pages are
+// ordered by (order key, id) and after is the opaque cursor returned in
+// the X-Nosdk-Cursor header of the page before.
+struct nosdk_pg_page {
+    int limit;
+    char order[64];
+    bool desc;
+    char *after;
+};
+
+// called for every row of a result streamed in single-row mode, a non-zero
+// return cancels the query
+typedef int (*nosdk_pg_row_fn)(PGresult *row, void *arg);
 
 struct nosdk_pg {
-    PGconn *pool[PG_POOL_MAX];
-    int in_use[PG_POOL_MAX];
+    struct nosdk_pg_conn *conns;
+    int min_size;
+    int max_size;
+    int wait_ms;
+    int max_age_ms;
+    int health_interval_ms;
+
+    // signalled when a connection is released or a slot frees up
     pthread_mutex_t mutex;
+    pthread_cond_t available;
     bool initialized;
+
+    // keeps min_size healthy connections open, replacing old ones
+    pthread_t health_thread;
+    pthread_cond_t health_cond;
+    bool running;
+
+    // tables that need not be looked up or created before a write. loaded
+    // at init and added to on first touch, an entry is dropped when
+    // postgres reports the table missing.
+    struct nosdk_pg_table tables[PG_TABLES_MAX];
+    int num_tables;
+    pthread_rwlock_t tables_lock;
+
+    // the index advisor. keys past the threshold are indexed one at a time
+    // by its thread, on a connection of its own.
+    struct nosdk_pg_index_key index_keys[PG_INDEX_KEYS_MAX];
+    int num_index_keys;
+    int index_threshold;
+    int indexes_failed;
+
+    // numeric casts fail on writes of values that don't parse, so filters
+    // on them are only indexed when asked for
+    bool index_casts;
+    pthread_mutex_t index_mutex;
+    pthread_cond_t index_cond;
+    pthread_t index_thread;
+    bool index_running;
+    PGconn *index_conn;
+};
+
+int nosdk_pg_init();
+
+void nosdk_pg_teardown();
+
+// a COPY into a table, started again with another column list whenever
+// an item's id presence differs from the rows before it
+struct nosdk_pg_copy {
+    PGconn *conn;
+    char *table_name;
+    int rows;
+    int in_copy;
+    int with_id;
+    struct nosdk_string_buffer *buf;
 };
 
 void nosdk_pg_handler(struct nosdk_http_request *req);
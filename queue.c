@@ -0,0 +1,169 @@
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "queue.h"
+#include "util.h"
+
+int nosdk_queue_init(struct nosdk_queue *q, size_t capacity) {
+    size_t size = 2;
+    while (size < capacity) {
+        size *= 2;
+    }
+
+    q->cells = malloc(sizeof(struct nosdk_queue_cell) * size);
+    if (q->cells == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < size; i++) {
+        atomic_init(&q->cells[i].seq, i);
+        q->cells[i].data = NULL;
+    }
+    q->mask = size - 1;
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+
+    atomic_init(&q->waiters, 0);
+    pthread_mutex_init(&q->mutex, NULL);
+    pthread_cond_init(&q->cond, NULL);
+
+    return 0;
+}
+
+void nosdk_queue_destroy(struct nosdk_queue *q) {
+    free(q->cells);
+    q->cells = NULL;
+    pthread_mutex_destroy(&q->mutex);
+    pthread_cond_destroy(&q->cond);
+}
+
+// wake parked threads, the lock is only touched when someone is waiting
+void nosdk_queue_wake(struct nosdk_queue *q) {
+    // order the cell update before the waiter check, pairs with the
+    // increment in the wait functions
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&q->waiters) > 0) {
+        pthread_mutex_lock(&q->mutex);
+        pthread_cond_broadcast(&q->cond);
+        pthread_mutex_unlock(&q->mutex);
+    }
+}
+
+int nosdk_queue_try_push(struct nosdk_queue *q, void *data) {
+    size_t pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+
+    while (1) {
+        struct nosdk_queue_cell *cell = &q->cells[pos & q->mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(
+                    &q->head, &pos, pos + 1, memory_order_relaxed,
+                    memory_order_relaxed)) {
+                cell->data = data;
+                atomic_store_explicit(
+                    &cell->seq, pos + 1, memory_order_release);
+                return 0;
+            }
+        } else if (diff < 0) {
+            return -1;
+        } else {
+            pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+        }
+    }
+}
+
+int nosdk_queue_try_pop(struct nosdk_queue *q, void **data) {
+    size_t pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+
+    while (1) {
+        struct nosdk_queue_cell *cell = &q->cells[pos & q->mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(
+                    &q->tail, &pos, pos + 1, memory_order_relaxed,
+                    memory_order_relaxed)) {
+                *data = cell->data;
+                atomic_store_explicit(
+                    &cell->seq, pos + q->mask + 1, memory_order_release);
+                return 0;
+            }
+        } else if (diff < 0) {
+            return -1;
+        } else {
+            pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+        }
+    }
+}
+
+int nosdk_queue_push(struct nosdk_queue *q, void *data) {
+    if (nosdk_queue_try_push(q, data) != 0) {
+        return -1;
+    }
+    nosdk_queue_wake(q);
+    return 0;
+}
+
+int nosdk_queue_pop(struct nosdk_queue *q, void **data) {
+    if (nosdk_queue_try_pop(q, data) != 0) {
+        return -1;
+    }
+    nosdk_queue_wake(q);
+    return 0;
+}
+
+// waiters retry under the mutex and wakers broadcast under it, so a push or
+// pop landing between a failed retry and the wait cannot be missed
+int nosdk_queue_push_wait(struct nosdk_queue *q, void *data, int timeout_ms) {
+    if (nosdk_queue_push(q, data) == 0) {
+        return 0;
+    }
+
+    struct timespec deadline;
+    nosdk_deadline_after_ms(&deadline, timeout_ms);
+
+    int ret = -1;
+    atomic_fetch_add(&q->waiters, 1);
+    pthread_mutex_lock(&q->mutex);
+    while ((ret = nosdk_queue_try_push(q, data)) != 0) {
+        if (pthread_cond_timedwait(&q->cond, &q->mutex, &deadline) != 0) {
+            ret = nosdk_queue_try_push(q, data);
+            break;
+        }
+    }
+    if (ret == 0) {
+        pthread_cond_broadcast(&q->cond);
+    }
+    pthread_mutex_unlock(&q->mutex);
+    atomic_fetch_sub(&q->waiters, 1);
+
+    return ret;
+}
+
+int nosdk_queue_pop_wait(struct nosdk_queue *q, void **data, int timeout_ms) {
+    if (nosdk_queue_pop(q, data) == 0) {
+        return 0;
+    }
+
+    struct timespec deadline;
+    nosdk_deadline_after_ms(&deadline, timeout_ms);
+
+    int ret = -1;
+    atomic_fetch_add(&q->waiters, 1);
+    pthread_mutex_lock(&q->mutex);
+    while ((ret = nosdk_queue_try_pop(q, data)) != 0) {
+        if (pthread_cond_timedwait(&q->cond, &q->mutex, &deadline) != 0) {
+            ret = nosdk_queue_try_pop(q, data);
+            break;
+        }
+    }
+    if (ret == 0) {
+        pthread_cond_broadcast(&q->cond);
+    }
+    pthread_mutex_unlock(&q->mutex);
+    atomic_fetch_sub(&q->waiters, 1);
+
+    return ret;
+}
@@ -0,0 +1,47 @@
+#ifndef _NOSDK_QUEUE_H
+#define _NOSDK_QUEUE_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+// a slot in the ring. seq tells producers and consumers whose turn it is:
+// seq == pos means free for the producer claiming pos, seq == pos + 1 means
+// filled for the consumer claiming pos.
+struct nosdk_queue_cell {
+    atomic_size_t seq;
+    void *data;
+};
+
+// bounded lock-free multi-producer multi-consumer queue of pointers.
+// push and pop never take a lock; the mutex and cond are only used to park
+// threads that wait on an empty or full queue.
+struct nosdk_queue {
+    struct nosdk_queue_cell *cells;
+    size_t mask;
+    atomic_size_t head;
+    atomic_size_t tail;
+
+    atomic_int waiters;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
+
+// capacity is rounded up to a power of two
+int nosdk_queue_init(struct nosdk_queue *q, size_t capacity);
+
+void nosdk_queue_destroy(struct nosdk_queue *q);
+
+// returns -1 if the queue is full
+int nosdk_queue_push(struct nosdk_queue *q, void *data);
+
+// returns -1 if the queue is empty
+int nosdk_queue_pop(struct nosdk_queue *q, void **data);
+
+// block for up to timeout_ms until there is room, returns -1 on timeout
+int nosdk_queue_push_wait(struct nosdk_queue *q, void *data, int timeout_ms);
+
+// block for up to timeout_ms for an item, returns -1 on timeout
+int nosdk_queue_pop_wait(struct nosdk_queue *q, void **data, int timeout_ms);
+
+#endif // _NOSDK_QUEUE_H
@@ -15,9 +15,136 @@ void expect_equal(char *expected, char *s) {
     }
 }
 
+void expect_span(char *expected, char *buf, int start, int len) {
+    char *s = strndup(&buf[start], len);
+    expect_equal(expected, s);
+    free(s);
+}
+
+void test_array_values() {
+    char *buf = "[{\"a\": [1, 2]}, \"x,y\", 3 , null]";
+    struct json_array_iter iter = {.data = buf, .data_len = strlen(buf)};
+    int start, len;
+
+    json_array_next_value(&iter, &start, &len);
+    expect_span("{\"a\": [1, 2]}", buf, start, len);
+    json_array_next_value(&iter, &start, &len);
+    expect_span("\"x,y\"", buf, start, len);
+    json_array_next_value(&iter, &start, &len);
+    expect_span("3", buf, start, len);
+    json_array_next_value(&iter, &start, &len);
+    expect_span("null", buf, start, len);
+
+    if (json_array_next_value(&iter, &start, &len) != 0) {
+        printf("expected end of array\n");
+        exit(1);
+    }
+}
+
+void test_object_get() {
+    char *buf = "{\"_key\": \"k1\", \"_headers\": {\"a\": \"b\"}, "
+                "\"_value\": [1]}";
+    int start, len;
+
+    json_object_get(buf, strlen(buf), "_value", &start, &len);
+    expect_span("[1]", buf, start, len);
+    json_object_get(buf, strlen(buf), "_headers", &start, &len);
+    expect_span("{\"a\": \"b\"}", buf, start, len);
+    json_object_get(buf, strlen(buf), "_key", &start, &len);
+    json_unquote(buf, &start, &len);
+    expect_span("k1", buf, start, len);
+
+    if (json_object_get(buf, strlen(buf), "a", &start, &len) != 0) {
+        printf("nested key found at top level\n");
+        exit(1);
+    }
+}
+
+void test_json_string() {
+    struct nosdk_string_buffer *sb = nosdk_string_buffer_new();
+    nosdk_string_buffer_append_json_string(sb, "a\"b\\c\nd\x01", 8);
+    expect_equal("\"a\\\"b\\\\c\\nd\\u0001\"", sb->data);
+    nosdk_string_buffer_free(sb);
+}
+
+void test_stream_items() {
+    // objects split across pieces, with braces and quotes inside strings
+    char *pieces[] = {"[{\"a\": \"}\\\"\"", ", \"b\": {}}, {\"c", "\": 1}]"};
+    struct json_stream_iter iter = {0};
+    char item[64];
+    int item_len = 0;
+    int items = 0;
+
+    for (int p = 0; p < 3; p++) {
+        char *data = pieces[p];
+        int len = strlen(data);
+        int pos = 0;
+        while (pos < len) {
+            int start;
+            int end =
+                json_stream_next_item(&iter, &data[pos], len - pos, &start);
+            int from = pos + (start >= 0 ? start : 0);
+            int to = end >= 0 ? pos + end : len;
+            if (start >= 0 || iter.depth > 0 || end >= 0) {
+                memcpy(&item[item_len], &data[from], to - from);
+                item_len += to - from;
+            }
+            if (end < 0) {
+                break;
+            }
+
+            item[item_len] = '\0';
+            expect_equal(
+                items == 0 ? "{\"a\": \"}\\\"\", \"b\": {}}" : "{\"c\": 1}",
+                item);
+            items++;
+            item_len = 0;
+            pos += end;
+        }
+    }
+
+    if (items != 2) {
+        printf("expected 2 items, got %d\n", items);
+        exit(1);
+    }
+}
+
+void test_base64url() {
+    char *inputs[] = {"", "f", "fo", "foo", "foob", "7\n\"x?\xff\""};
+    char *encoded[] = {"", "Zg", "Zm8", "Zm9v", "Zm9vYg", "NwoieD__Ig"};
+
+    for (int i = 0; i < 6; i++) {
+        struct nosdk_string_buffer *sb = nosdk_string_buffer_new();
+        sb->data[0] = '\0';
+        nosdk_base64url_encode(sb, inputs[i], strlen(inputs[i]));
+        expect_equal(encoded[i], sb->data);
+
+        int len;
+        char *decoded = nosdk_base64url_decode(sb->data, &len);
+        expect_equal(inputs[i], decoded);
+        free(decoded);
+        nosdk_string_buffer_free(sb);
+    }
+
+    if (nosdk_base64url_decode("a+b=", &(int){0}) != NULL) {
+        printf("expected invalid base64url\n");
+        exit(1);
+    }
+}
+
 int main(int argc, char *argv[]) {
-    expect_equal("a", json_extract_key("{\"id\": \"a\"}", "id"));
-    expect_equal("123", json_extract_key("{\"id\": 123}", "id"));
+    char *id = json_extract_key("{\"id\": \"a\"}", "id");
+    expect_equal("a", id);
+    free(id);
+    id = json_extract_key("{\"id\": 123}", "id");
+    expect_equal("123", id);
+    free(id);
+
+    test_array_values();
+    test_object_get();
+    test_json_string();
+    test_stream_items();
+    test_base64url();
 
     printf("all tests passed.\n");
     return 0;
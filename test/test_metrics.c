@@ -0,0 +1,61 @@
+#include "../metrics.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+int nosdk_debug_flag = 0;
+
+void expect_render(char *expected) {
+    struct nosdk_string_buffer *sb = nosdk_string_buffer_new();
+    nosdk_metrics_render(sb);
+    if (sb->size != (int)strlen(expected) ||
+        memcmp(expected, sb->data, sb->size) != 0) {
+        printf("expected:\n%s\ngot:\n%.*s\n", expected, sb->size, sb->data);
+        exit(1);
+    }
+    nosdk_string_buffer_free(sb);
+}
+
+void test_grouping() {
+    struct nosdk_metric_set *a = nosdk_metric_set_new("a");
+    nosdk_metric_set_add(a, "lag", "Lag", 3, "client=\"a\",partition=\"1\"");
+    nosdk_metric_set_add(a, "depth", "Depth", 10, "client=\"a\"");
+    nosdk_metric_set_add(a, "lag", "Lag", 5, "client=\"a\",partition=\"0\"");
+    nosdk_metrics_publish(a);
+
+    struct nosdk_metric_set *b = nosdk_metric_set_new("b");
+    nosdk_metric_set_add(b, "depth", "Depth", 0.5, "client=\"%s\"", "b");
+    nosdk_metric_set_add(b, "up", "Up", 1, "");
+    nosdk_metrics_publish(b);
+
+    expect_render("# HELP depth Depth\n# TYPE depth gauge\n"
+                  "depth{client=\"a\"} 10\n"
+                  "depth{client=\"b\"} 0.5\n"
+                  "# HELP lag Lag\n# TYPE lag gauge\n"
+                  "lag{client=\"a\",partition=\"0\"} 5\n"
+                  "lag{client=\"a\",partition=\"1\"} 3\n"
+                  "# HELP up Up\n# TYPE up gauge\n"
+                  "up 1\n");
+}
+
+void test_replace() {
+    // a partition that is no longer reported goes away
+    struct nosdk_metric_set *a = nosdk_metric_set_new("a");
+    nosdk_metric_set_add(a, "lag", "Lag", 7, "client=\"a\",partition=\"1\"");
+    nosdk_metrics_publish(a);
+    nosdk_metrics_remove("b");
+
+    expect_render("# HELP lag Lag\n# TYPE lag gauge\n"
+                  "lag{client=\"a\",partition=\"1\"} 7\n");
+
+    nosdk_metrics_remove("a");
+    expect_render("");
+}
+
+int main(int argc, char *argv[]) {
+    test_grouping();
+    test_replace();
+
+    printf("all tests passed.\n");
+    return 0;
+}
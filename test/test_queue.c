@@ -0,0 +1,93 @@
+#include "../queue.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+int nosdk_debug_flag = 0;
+
+#define PRODUCERS 4
+#define CONSUMERS 4
+#define ITEMS_PER_PRODUCER 100000
+
+struct nosdk_queue queue;
+long consumed[CONSUMERS];
+
+void expect(int cond, char *msg) {
+    if (!cond) {
+        printf("%s\n", msg);
+        exit(1);
+    }
+}
+
+void test_bounds() {
+    struct nosdk_queue q;
+    void *item;
+
+    nosdk_queue_init(&q, 3);
+    expect(nosdk_queue_pop(&q, &item) == -1, "pop from empty queue");
+    for (intptr_t i = 1; i <= 4; i++) {
+        expect(nosdk_queue_push(&q, (void *)i) == 0, "push within capacity");
+    }
+    expect(nosdk_queue_push(&q, (void *)5) == -1, "push to full queue");
+    expect(nosdk_queue_push_wait(&q, (void *)5, 10) == -1, "push timeout");
+
+    for (intptr_t i = 1; i <= 4; i++) {
+        expect(nosdk_queue_pop(&q, &item) == 0, "pop within capacity");
+        expect((intptr_t)item == i, "items come out in order");
+    }
+    expect(nosdk_queue_pop_wait(&q, &item, 10) == -1, "pop timeout");
+    nosdk_queue_destroy(&q);
+}
+
+void *producer(void *arg) {
+    intptr_t id = (intptr_t)arg;
+    for (intptr_t i = 0; i < ITEMS_PER_PRODUCER; i++) {
+        intptr_t item = id * ITEMS_PER_PRODUCER + i + 1;
+        expect(
+            nosdk_queue_push_wait(&queue, (void *)item, 5000) == 0,
+            "producer timed out");
+    }
+    return NULL;
+}
+
+void *consumer(void *arg) {
+    intptr_t id = (intptr_t)arg;
+    void *item;
+    while (nosdk_queue_pop_wait(&queue, &item, 200) == 0) {
+        consumed[id] += (intptr_t)item;
+    }
+    return NULL;
+}
+
+void test_threads() {
+    pthread_t producers[PRODUCERS], consumers[CONSUMERS];
+
+    nosdk_queue_init(&queue, 64);
+    for (intptr_t i = 0; i < CONSUMERS; i++) {
+        pthread_create(&consumers[i], NULL, consumer, (void *)i);
+    }
+    for (intptr_t i = 0; i < PRODUCERS; i++) {
+        pthread_create(&producers[i], NULL, producer, (void *)i);
+    }
+    for (int i = 0; i < PRODUCERS; i++) {
+        pthread_join(producers[i], NULL);
+    }
+
+    long total = 0;
+    for (int i = 0; i < CONSUMERS; i++) {
+        pthread_join(consumers[i], NULL);
+        total += consumed[i];
+    }
+
+    long n = (long)PRODUCERS * ITEMS_PER_PRODUCER;
+    expect(total == n * (n + 1) / 2, "every item consumed exactly once");
+    nosdk_queue_destroy(&queue);
+}
+
+int main(int argc, char *argv[]) {
+    test_bounds();
+    test_threads();
+
+    printf("all tests passed.\n");
+    return 0;
+}
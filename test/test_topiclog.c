@@ -0,0 +1,116 @@
+#include "../topiclog.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+int nosdk_debug_flag = 0;
+
+void expect(int cond, char *msg) {
+    if (!cond) {
+        printf("%s\n", msg);
+        exit(1);
+    }
+}
+
+void test_append_read(char *root) {
+    struct nosdk_topiclog *log = nosdk_topiclog_open(root, "orders", 3);
+    expect(log != NULL, "open log");
+    expect(log->num_partitions == 3, "three partitions");
+    expect(nosdk_topiclog_open(root, "orders", 3) == log, "logs are shared");
+
+    char headers[64];
+    char *end = nosdk_topiclog_header_put(headers, "trace", 5, "abc", 3);
+    uint32_t headers_len = end - headers;
+
+    int32_t partition;
+    int64_t offset;
+    expect(
+        nosdk_topiclog_append(
+            log, -1, "k1", 2, headers, headers_len, "hello", 5, &partition,
+            &offset) == 0,
+        "append");
+    expect(offset == 0, "first offset is 0");
+
+    int32_t again;
+    nosdk_topiclog_append(
+        log, -1, "k1", 2, NULL, 0, "world", 5, &again, &offset);
+    expect(again == partition, "same key, same partition");
+    expect(offset == 1, "second offset is 1");
+    expect(nosdk_topiclog_end(log, partition) == 2, "end offset");
+
+    struct nosdk_topiclog_record record;
+    expect(nosdk_topiclog_read(log, partition, 0, &record) == 0, "read");
+    expect(record.value_len == 5, "value length");
+    expect(memcmp(record.value, "hello", 5) == 0, "value");
+    expect(memcmp(record.key, "k1", 2) == 0, "key");
+
+    size_t pos = 0, name_len, value_len;
+    const char *name, *value;
+    expect(
+        nosdk_topiclog_header_next(
+            record.headers, record.headers_len, &pos, &name, &name_len,
+            &value, &value_len),
+        "header present");
+    expect(name_len == 5 && memcmp(name, "trace", 5) == 0, "header name");
+    expect(value_len == 3 && memcmp(value, "abc", 3) == 0, "header value");
+    expect(
+        !nosdk_topiclog_header_next(
+            record.headers, record.headers_len, &pos, &name, &name_len,
+            &value, &value_len),
+        "one header");
+
+    expect(
+        nosdk_topiclog_read(log, partition, 2, &record) == -1,
+        "unwritten offset");
+
+    expect(
+        nosdk_topiclog_committed(log, "g", partition) == -1,
+        "nothing committed");
+    expect(nosdk_topiclog_commit(log, "g", partition, 1) == 0, "commit");
+}
+
+void test_reopen(char *root) {
+    struct nosdk_topiclog *log = nosdk_topiclog_open(root, "orders", 1);
+    expect(log->num_partitions == 3, "partitions kept on reopen");
+
+    int total = 0;
+    int32_t partition = -1;
+    for (int i = 0; i < log->num_partitions; i++) {
+        int64_t end = nosdk_topiclog_end(log, i);
+        if (end > 0) {
+            partition = i;
+        }
+        total += end;
+    }
+    expect(total == 2, "records survive reopen");
+    expect(
+        nosdk_topiclog_committed(log, "g", partition) == 1,
+        "offsets survive reopen");
+
+    struct nosdk_topiclog_record record;
+    expect(nosdk_topiclog_read(log, partition, 1, &record) == 0, "reread");
+    expect(memcmp(record.value, "world", 5) == 0, "reread value");
+
+    int64_t offset;
+    nosdk_topiclog_append(
+        log, partition, NULL, 0, NULL, 0, "again", 5, NULL, &offset);
+    expect(offset == 2, "appends continue after reopen");
+}
+
+int main(int argc, char *argv[]) {
+    char root[] = "/tmp/nosdk-topiclog-XXXXXX";
+    expect(mkdtemp(root) != NULL, "mkdtemp");
+
+    test_append_read(root);
+    nosdk_topiclog_close_all();
+    test_reopen(root);
+    nosdk_topiclog_close_all();
+
+    char cmd[128];
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", root);
+    system(cmd);
+
+    printf("all tests passed.\n");
+    return 0;
+}
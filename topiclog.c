@@ -0,0 +1,694 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "topiclog.h"
+#include "util.h"
+
+struct nosdk_topiclog_mgr {
+    pthread_mutex_t mutex;
+    struct nosdk_topiclog **logs;
+    int num_logs;
+    int capacity;
+
+    pthread_t flusher;
+    int flusher_running;
+    int flush_interval_ms;
+};
+
+struct nosdk_topiclog_mgr topiclog_mgr = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+#define TOPICLOG_ALIGN(n) (((n) + 7) & ~(size_t)7)
+
+int nosdk_topiclog_mkdir(const char *path) {
+    if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "failed to create %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// map a segment file, creating it at its full size if it does not exist
+int nosdk_topiclog_segment_map(
+    struct nosdk_topiclog_segment *seg, const char *dir, int64_t base) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%020" PRId64 ".log", dir, base);
+
+    seg->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (seg->fd < 0) {
+        fprintf(stderr, "failed to open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    if (ftruncate(seg->fd, TOPICLOG_SEGMENT_SIZE) != 0) {
+        fprintf(stderr, "failed to size %s: %s\n", path, strerror(errno));
+        close(seg->fd);
+        return -1;
+    }
+
+    seg->data = mmap(
+        NULL, TOPICLOG_SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+        seg->fd, 0);
+    if (seg->data == MAP_FAILED) {
+        fprintf(stderr, "failed to map %s: %s\n", path, strerror(errno));
+        close(seg->fd);
+        return -1;
+    }
+
+    seg->base = base;
+    seg->size = 0;
+    seg->flushed = 0;
+    seg->positions = NULL;
+    seg->num_records = 0;
+    seg->capacity = 0;
+    return 0;
+}
+
+void nosdk_topiclog_segment_index(
+    struct nosdk_topiclog_segment *seg, uint32_t position) {
+    if (seg->num_records == seg->capacity) {
+        seg->capacity = seg->capacity == 0 ? 1024 : seg->capacity * 2;
+        seg->positions =
+            realloc(seg->positions, sizeof(uint32_t) * seg->capacity);
+    }
+    seg->positions[seg->num_records] = position;
+    seg->num_records++;
+}
+
+// rebuild the index of a segment from its records. a record torn by a
+// crash has no size or the wrong offset and ends the scan, the next
+// append overwrites it.
+void nosdk_topiclog_segment_scan(struct nosdk_topiclog_segment *seg) {
+    size_t pos = 0;
+    while (pos + sizeof(struct nosdk_topiclog_record_head) <=
+           TOPICLOG_SEGMENT_SIZE) {
+        struct nosdk_topiclog_record_head *head =
+            (struct nosdk_topiclog_record_head *)&seg->data[pos];
+        if (head->size < sizeof(struct nosdk_topiclog_record_head) ||
+            pos + head->size > TOPICLOG_SEGMENT_SIZE ||
+            head->offset != seg->base + seg->num_records) {
+            break;
+        }
+        nosdk_topiclog_segment_index(seg, pos);
+        pos += head->size;
+    }
+    seg->size = pos;
+    seg->flushed = pos;
+}
+
+struct nosdk_topiclog_segment *
+nosdk_topiclog_partition_roll(struct nosdk_topiclog_partition *p) {
+    if (p->num_segments == p->capacity) {
+        p->capacity = p->capacity == 0 ? 4 : p->capacity * 2;
+        p->segments = realloc(
+            p->segments, sizeof(struct nosdk_topiclog_segment) * p->capacity);
+    }
+
+    struct nosdk_topiclog_segment *seg = &p->segments[p->num_segments];
+    if (nosdk_topiclog_segment_map(seg, p->dir, p->next) != 0) {
+        return NULL;
+    }
+    p->num_segments++;
+    return seg;
+}
+
+int nosdk_topiclog_compare_base(const void *a, const void *b) {
+    int64_t x = *(const int64_t *)a;
+    int64_t y = *(const int64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+int nosdk_topiclog_partition_open(
+    struct nosdk_topiclog_partition *p, const char *dir) {
+    pthread_mutex_init(&p->mutex, NULL);
+    p->dir = strdup(dir);
+    p->segments = NULL;
+    p->num_segments = 0;
+    p->capacity = 0;
+    p->next = 0;
+
+    if (nosdk_topiclog_mkdir(dir) != 0) {
+        return -1;
+    }
+
+    DIR *d = opendir(dir);
+    if (d == NULL) {
+        return -1;
+    }
+
+    int64_t *bases = NULL;
+    int num_bases = 0;
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        char *end;
+        int64_t base = strtoll(entry->d_name, &end, 10);
+        if (end == entry->d_name || strcmp(end, ".log") != 0) {
+            continue;
+        }
+        bases = realloc(bases, sizeof(int64_t) * (num_bases + 1));
+        bases[num_bases++] = base;
+    }
+    closedir(d);
+
+    if (num_bases > 0) {
+        qsort(bases, num_bases, sizeof(int64_t), nosdk_topiclog_compare_base);
+    }
+
+    for (int i = 0; i < num_bases; i++) {
+        p->next = bases[i];
+        struct nosdk_topiclog_segment *seg = nosdk_topiclog_partition_roll(p);
+        if (seg == NULL) {
+            free(bases);
+            return -1;
+        }
+        nosdk_topiclog_segment_scan(seg);
+        p->next = seg->base + seg->num_records;
+    }
+    free(bases);
+
+    if (p->num_segments == 0 && nosdk_topiclog_partition_roll(p) == NULL) {
+        return -1;
+    }
+
+    return 0;
+}
+
+struct nosdk_topiclog *
+nosdk_topiclog_open(const char *root, const char *name, int partitions) {
+    pthread_mutex_lock(&topiclog_mgr.mutex);
+
+    for (int i = 0; i < topiclog_mgr.num_logs; i++) {
+        if (strcmp(topiclog_mgr.logs[i]->name, name) == 0) {
+            struct nosdk_topiclog *log = topiclog_mgr.logs[i];
+            pthread_mutex_unlock(&topiclog_mgr.mutex);
+            return log;
+        }
+    }
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", root, name);
+    if (nosdk_topiclog_mkdir(root) != 0 || nosdk_topiclog_mkdir(path) != 0) {
+        pthread_mutex_unlock(&topiclog_mgr.mutex);
+        return NULL;
+    }
+
+    // partitions on disk are kept, more are added if asked for
+    int existing = 0;
+    struct stat st;
+    while (1) {
+        char partition_path[PATH_MAX + 16];
+        snprintf(
+            partition_path, sizeof(partition_path), "%s/%d", path, existing);
+        if (stat(partition_path, &st) != 0) {
+            break;
+        }
+        existing++;
+    }
+    if (partitions < existing) {
+        partitions = existing;
+    }
+    if (partitions < 1) {
+        partitions = 1;
+    }
+
+    struct nosdk_topiclog *log = calloc(1, sizeof(struct nosdk_topiclog));
+    log->name = strdup(name);
+    log->dir = strdup(path);
+    log->num_partitions = partitions;
+    log->partitions =
+        calloc(partitions, sizeof(struct nosdk_topiclog_partition));
+    atomic_init(&log->next_partition, 0);
+    atomic_init(&log->waiters, 0);
+    atomic_init(&log->appends, 0);
+    pthread_mutex_init(&log->mutex, NULL);
+    pthread_cond_init(&log->appended, NULL);
+
+    for (int i = 0; i < partitions; i++) {
+        char partition_path[PATH_MAX + 16];
+        snprintf(partition_path, sizeof(partition_path), "%s/%d", path, i);
+        if (nosdk_topiclog_partition_open(
+                &log->partitions[i], partition_path) != 0) {
+            fprintf(stderr, "failed to open partition %s\n", partition_path);
+            pthread_mutex_unlock(&topiclog_mgr.mutex);
+            return NULL;
+        }
+    }
+
+    snprintf(path, sizeof(path), "%s/groups", log->dir);
+    nosdk_topiclog_mkdir(path);
+
+    nosdk_debugf(
+        "opened topic log %s with %d partitions\n", log->dir, partitions);
+
+    if (topiclog_mgr.num_logs == topiclog_mgr.capacity) {
+        topiclog_mgr.capacity =
+            topiclog_mgr.capacity == 0 ? 8 : topiclog_mgr.capacity * 2;
+        topiclog_mgr.logs = realloc(
+            topiclog_mgr.logs,
+            sizeof(struct nosdk_topiclog *) * topiclog_mgr.capacity);
+    }
+    topiclog_mgr.logs[topiclog_mgr.num_logs++] = log;
+
+    pthread_mutex_unlock(&topiclog_mgr.mutex);
+    return log;
+}
+
+uint32_t nosdk_topiclog_hash(const char *key, uint32_t len) {
+    uint32_t hash = 2166136261u;
+    for (uint32_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)key[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+int nosdk_topiclog_append(
+    struct nosdk_topiclog *log,
+    int32_t partition,
+    const char *key,
+    uint32_t key_len,
+    const char *headers,
+    uint32_t headers_len,
+    const char *value,
+    uint32_t value_len,
+    int32_t *partition_out,
+    int64_t *offset_out) {
+    if (partition < 0) {
+        if (key != NULL) {
+            partition = nosdk_topiclog_hash(key, key_len) % log->num_partitions;
+        } else {
+            partition =
+                atomic_fetch_add(&log->next_partition, 1) % log->num_partitions;
+        }
+    } else if (partition >= log->num_partitions) {
+        return -1;
+    }
+
+    size_t size = TOPICLOG_ALIGN(
+        sizeof(struct nosdk_topiclog_record_head) + (size_t)key_len +
+        headers_len + value_len);
+    if (size > TOPICLOG_SEGMENT_SIZE) {
+        return -1;
+    }
+
+    struct nosdk_topiclog_partition *p = &log->partitions[partition];
+    pthread_mutex_lock(&p->mutex);
+
+    struct nosdk_topiclog_segment *seg = &p->segments[p->num_segments - 1];
+    if (seg->size + size > TOPICLOG_SEGMENT_SIZE) {
+        seg = nosdk_topiclog_partition_roll(p);
+        if (seg == NULL) {
+            pthread_mutex_unlock(&p->mutex);
+            return -1;
+        }
+    }
+
+    char *dst = &seg->data[seg->size];
+    struct nosdk_topiclog_record_head *head =
+        (struct nosdk_topiclog_record_head *)dst;
+    head->key_len = key_len;
+    head->offset = p->next;
+    head->timestamp = nosdk_now_ms();
+    head->headers_len = headers_len;
+    head->value_len = value_len;
+
+    dst += sizeof(struct nosdk_topiclog_record_head);
+    if (key_len > 0) {
+        memcpy(dst, key, key_len);
+        dst += key_len;
+    }
+    if (headers_len > 0) {
+        memcpy(dst, headers, headers_len);
+        dst += headers_len;
+    }
+    if (value_len > 0) {
+        memcpy(dst, value, value_len);
+    }
+
+    // the size goes in last, a crash before this leaves no valid record
+    __atomic_store_n(&head->size, (uint32_t)size, __ATOMIC_RELEASE);
+
+    nosdk_topiclog_segment_index(seg, seg->size);
+    seg->size += size;
+
+    if (partition_out != NULL) {
+        *partition_out = partition;
+    }
+    if (offset_out != NULL) {
+        *offset_out = p->next;
+    }
+    p->next++;
+
+    pthread_mutex_unlock(&p->mutex);
+
+    atomic_fetch_add(&log->appends, 1);
+    if (atomic_load(&log->waiters) > 0) {
+        pthread_mutex_lock(&log->mutex);
+        pthread_cond_broadcast(&log->appended);
+        pthread_mutex_unlock(&log->mutex);
+    }
+
+    return 0;
+}
+
+int nosdk_topiclog_read(
+    struct nosdk_topiclog *log,
+    int32_t partition,
+    int64_t offset,
+    struct nosdk_topiclog_record *record) {
+    if (partition < 0 || partition >= log->num_partitions) {
+        return -1;
+    }
+
+    struct nosdk_topiclog_partition *p = &log->partitions[partition];
+    pthread_mutex_lock(&p->mutex);
+
+    if (offset < p->segments[0].base || offset >= p->next) {
+        pthread_mutex_unlock(&p->mutex);
+        return -1;
+    }
+
+    // the last segment whose base is at or below offset
+    int lo = 0, hi = p->num_segments - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (p->segments[mid].base <= offset) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    struct nosdk_topiclog_segment *seg = &p->segments[lo];
+    char *data = &seg->data[seg->positions[offset - seg->base]];
+
+    pthread_mutex_unlock(&p->mutex);
+
+    // written records never change and segments stay mapped, so the
+    // record can be read without the lock
+    struct nosdk_topiclog_record_head *head =
+        (struct nosdk_topiclog_record_head *)data;
+    data += sizeof(struct nosdk_topiclog_record_head);
+
+    record->partition = partition;
+    record->offset = head->offset;
+    record->timestamp = head->timestamp;
+    record->key = head->key_len > 0 ? data : NULL;
+    record->key_len = head->key_len;
+    data += head->key_len;
+    record->headers = data;
+    record->headers_len = head->headers_len;
+    data += head->headers_len;
+    record->value = data;
+    record->value_len = head->value_len;
+
+    return 0;
+}
+
+int64_t nosdk_topiclog_end(struct nosdk_topiclog *log, int32_t partition) {
+    struct nosdk_topiclog_partition *p = &log->partitions[partition];
+    pthread_mutex_lock(&p->mutex);
+    int64_t next = p->next;
+    pthread_mutex_unlock(&p->mutex);
+    return next;
+}
+
+uint64_t nosdk_topiclog_appends(struct nosdk_topiclog *log) {
+    return atomic_load(&log->appends);
+}
+
+void nosdk_topiclog_wait(
+    struct nosdk_topiclog *log, uint64_t seen, int timeout_ms) {
+    struct timespec deadline;
+    nosdk_deadline_after_ms(&deadline, timeout_ms);
+
+    atomic_fetch_add(&log->waiters, 1);
+    pthread_mutex_lock(&log->mutex);
+    while (atomic_load(&log->appends) == seen) {
+        if (pthread_cond_timedwait(&log->appended, &log->mutex, &deadline) !=
+            0) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&log->mutex);
+    atomic_fetch_sub(&log->waiters, 1);
+}
+
+// call with the log mutex held
+struct nosdk_topiclog_group *
+nosdk_topiclog_group(struct nosdk_topiclog *log, const char *name) {
+    for (int i = 0; i < log->num_groups; i++) {
+        if (strcmp(log->groups[i].name, name) == 0) {
+            return &log->groups[i];
+        }
+    }
+
+    if (log->num_groups == TOPICLOG_MAX_GROUPS) {
+        fprintf(stderr, "%s: too many consumer groups\n", log->name);
+        return NULL;
+    }
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/groups/%s", log->dir, name);
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "failed to open %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    struct nosdk_topiclog_group *group = &log->groups[log->num_groups];
+    group->name = strdup(name);
+    group->fd = fd;
+    group->dirty = 0;
+    group->committed = malloc(sizeof(int64_t) * log->num_partitions);
+    for (int i = 0; i < log->num_partitions; i++) {
+        if (pread(fd, &group->committed[i], sizeof(int64_t),
+                  i * sizeof(int64_t)) != sizeof(int64_t)) {
+            group->committed[i] = -1;
+        }
+    }
+    log->num_groups++;
+
+    return group;
+}
+
+int64_t nosdk_topiclog_committed(
+    struct nosdk_topiclog *log, const char *group_name, int32_t partition) {
+    int64_t offset = -1;
+
+    pthread_mutex_lock(&log->mutex);
+    struct nosdk_topiclog_group *group = nosdk_topiclog_group(log, group_name);
+    if (group != NULL && partition >= 0 && partition < log->num_partitions) {
+        offset = group->committed[partition];
+    }
+    pthread_mutex_unlock(&log->mutex);
+
+    return offset;
+}
+
+int nosdk_topiclog_commit(
+    struct nosdk_topiclog *log,
+    const char *group_name,
+    int32_t partition,
+    int64_t offset) {
+    if (partition < 0 || partition >= log->num_partitions) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&log->mutex);
+    struct nosdk_topiclog_group *group = nosdk_topiclog_group(log, group_name);
+    if (group == NULL) {
+        pthread_mutex_unlock(&log->mutex);
+        return -1;
+    }
+
+    group->committed[partition] = offset;
+    group->dirty = 1;
+    ssize_t written = pwrite(
+        group->fd, &offset, sizeof(int64_t), partition * sizeof(int64_t));
+    pthread_mutex_unlock(&log->mutex);
+
+    return written == sizeof(int64_t) ? 0 : -1;
+}
+
+size_t nosdk_topiclog_header_size(size_t name_len, size_t value_len) {
+    return sizeof(uint16_t) + sizeof(uint32_t) + name_len + value_len;
+}
+
+char *nosdk_topiclog_header_put(
+    char *dst,
+    const char *name,
+    size_t name_len,
+    const void *value,
+    size_t value_len) {
+    uint16_t n = (uint16_t)name_len;
+    uint32_t v = (uint32_t)value_len;
+
+    memcpy(dst, &n, sizeof(n));
+    dst += sizeof(n);
+    memcpy(dst, &v, sizeof(v));
+    dst += sizeof(v);
+    memcpy(dst, name, n);
+    dst += n;
+    if (v > 0) {
+        memcpy(dst, value, v);
+    }
+    return dst + v;
+}
+
+int nosdk_topiclog_header_next(
+    const char *headers,
+    size_t headers_len,
+    size_t *pos,
+    const char **name,
+    size_t *name_len,
+    const char **value,
+    size_t *value_len) {
+    uint16_t n;
+    uint32_t v;
+
+    if (*pos + sizeof(n) + sizeof(v) > headers_len) {
+        return 0;
+    }
+    memcpy(&n, &headers[*pos], sizeof(n));
+    memcpy(&v, &headers[*pos + sizeof(n)], sizeof(v));
+
+    size_t start = *pos + sizeof(n) + sizeof(v);
+    if (start + n + v > headers_len) {
+        return 0;
+    }
+
+    *name = &headers[start];
+    *name_len = n;
+    *value = &headers[start + n];
+    *value_len = v;
+    *pos = start + n + v;
+    return 1;
+}
+
+// sync the unflushed tail of every segment. the lock is only held to take
+// the range, appends continue while it is written back.
+void nosdk_topiclog_flush(struct nosdk_topiclog *log) {
+    long page_size = sysconf(_SC_PAGESIZE);
+
+    for (int i = 0; i < log->num_partitions; i++) {
+        struct nosdk_topiclog_partition *p = &log->partitions[i];
+
+        for (int s = 0;; s++) {
+            pthread_mutex_lock(&p->mutex);
+            if (s >= p->num_segments) {
+                pthread_mutex_unlock(&p->mutex);
+                break;
+            }
+            struct nosdk_topiclog_segment *seg = &p->segments[s];
+            char *data = seg->data;
+            size_t start = seg->flushed - seg->flushed % page_size;
+            size_t end = seg->size;
+            seg->flushed = seg->size;
+            pthread_mutex_unlock(&p->mutex);
+
+            if (end > start && msync(&data[start], end - start, MS_SYNC) != 0) {
+                perror("msync");
+            }
+        }
+    }
+
+    pthread_mutex_lock(&log->mutex);
+    for (int i = 0; i < log->num_groups; i++) {
+        if (log->groups[i].dirty) {
+            fdatasync(log->groups[i].fd);
+            log->groups[i].dirty = 0;
+        }
+    }
+    pthread_mutex_unlock(&log->mutex);
+}
+
+void nosdk_topiclog_flush_all() {
+    // opening a log may move the array, so take each one under the lock
+    for (int i = 0;; i++) {
+        pthread_mutex_lock(&topiclog_mgr.mutex);
+        struct nosdk_topiclog *log =
+            i < topiclog_mgr.num_logs ? topiclog_mgr.logs[i] : NULL;
+        pthread_mutex_unlock(&topiclog_mgr.mutex);
+
+        if (log == NULL) {
+            break;
+        }
+        nosdk_topiclog_flush(log);
+    }
+}
+
+void *nosdk_topiclog_flush_thread(void *arg) {
+    while (topiclog_mgr.flusher_running) {
+        usleep(topiclog_mgr.flush_interval_ms * 1000);
+        nosdk_topiclog_flush_all();
+    }
+    return NULL;
+}
+
+int nosdk_topiclog_start_flusher(int interval_ms) {
+    if (topiclog_mgr.flusher_running) {
+        return 0;
+    }
+
+    topiclog_mgr.flush_interval_ms =
+        interval_ms > 0 ? interval_ms : TOPICLOG_FLUSH_INTERVAL_MS;
+    topiclog_mgr.flusher_running = 1;
+    if (pthread_create(
+            &topiclog_mgr.flusher, NULL, nosdk_topiclog_flush_thread, NULL) !=
+        0) {
+        topiclog_mgr.flusher_running = 0;
+        return -1;
+    }
+    return 0;
+}
+
+void nosdk_topiclog_close_all() {
+    if (topiclog_mgr.flusher_running) {
+        topiclog_mgr.flusher_running = 0;
+        pthread_join(topiclog_mgr.flusher, NULL);
+    }
+    nosdk_topiclog_flush_all();
+
+    for (int i = 0; i < topiclog_mgr.num_logs; i++) {
+        struct nosdk_topiclog *log = topiclog_mgr.logs[i];
+
+        for (int p = 0; p < log->num_partitions; p++) {
+            struct nosdk_topiclog_partition *part = &log->partitions[p];
+            for (int s = 0; s < part->num_segments; s++) {
+                munmap(part->segments[s].data, TOPICLOG_SEGMENT_SIZE);
+                close(part->segments[s].fd);
+                free(part->segments[s].positions);
+            }
+            free(part->segments);
+            free(part->dir);
+            pthread_mutex_destroy(&part->mutex);
+        }
+        free(log->partitions);
+
+        for (int g = 0; g < log->num_groups; g++) {
+            close(log->groups[g].fd);
+            free(log->groups[g].name);
+            free(log->groups[g].committed);
+        }
+
+        pthread_mutex_destroy(&log->mutex);
+        pthread_cond_destroy(&log->appended);
+        free(log->name);
+        free(log->dir);
+        free(log);
+    }
+
+    free(topiclog_mgr.logs);
+    topiclog_mgr.logs = NULL;
+    topiclog_mgr.num_logs = 0;
+    topiclog_mgr.capacity = 0;
+}
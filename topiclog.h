@@ -0,0 +1,165 @@
+#ifndef _NOSDK_TOPICLOG_H
+#define _NOSDK_TOPICLOG_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// a file-backed stand-in for a kafka topic. each partition is a sequence
+// of fixed-size, mmap'd segment files that records are appended to; a
+// record is never modified once written. the active segments are synced
+// to disk in batches by a flush thread.
+#define TOPICLOG_SEGMENT_SIZE (64 * 1024 * 1024)
+#define TOPICLOG_FLUSH_INTERVAL_MS 100
+#define TOPICLOG_MAX_GROUPS 16
+
+// on-disk record layout, followed by the key, the encoded headers and the
+// value, padded to 8 bytes. size is written last, a zero size marks the
+// end of the segment's data.
+struct nosdk_topiclog_record_head {
+    uint32_t size;
+    uint32_t key_len;
+    int64_t offset;
+    int64_t timestamp;
+    uint32_t headers_len;
+    uint32_t value_len;
+};
+
+// a record read from the log, pointing into the mapped segment
+struct nosdk_topiclog_record {
+    int32_t partition;
+    int64_t offset;
+    int64_t timestamp;
+    const char *key;
+    uint32_t key_len;
+    const char *headers;
+    uint32_t headers_len;
+    const char *value;
+    uint32_t value_len;
+};
+
+struct nosdk_topiclog_segment {
+    int64_t base;
+    int fd;
+    char *data;
+    size_t size;
+    size_t flushed;
+
+    // byte position of every record, indexed by offset - base
+    uint32_t *positions;
+    int num_records;
+    int capacity;
+};
+
+struct nosdk_topiclog_partition {
+    pthread_mutex_t mutex;
+    char *dir;
+    struct nosdk_topiclog_segment *segments;
+    int num_segments;
+    int capacity;
+    int64_t next;
+};
+
+// committed consumer offsets of a group, one per partition
+struct nosdk_topiclog_group {
+    char *name;
+    int fd;
+    int64_t *committed;
+    int dirty;
+};
+
+struct nosdk_topiclog {
+    char *name;
+    char *dir;
+    struct nosdk_topiclog_partition *partitions;
+    int num_partitions;
+    atomic_uint next_partition;
+
+    // readers waiting for appends, and the groups
+    pthread_mutex_t mutex;
+    pthread_cond_t appended;
+    atomic_int waiters;
+    atomic_uint_fast64_t appends;
+    struct nosdk_topiclog_group groups[TOPICLOG_MAX_GROUPS];
+    int num_groups;
+};
+
+// open a topic under root, creating it or adding partitions as needed.
+// logs are shared, opening the same topic again returns the same log.
+struct nosdk_topiclog *
+nosdk_topiclog_open(const char *root, const char *name, int partitions);
+
+// append a record. with partition -1 the partition is picked by key, or
+// round robin for records without one.
+int nosdk_topiclog_append(
+    struct nosdk_topiclog *log,
+    int32_t partition,
+    const char *key,
+    uint32_t key_len,
+    const char *headers,
+    uint32_t headers_len,
+    const char *value,
+    uint32_t value_len,
+    int32_t *partition_out,
+    int64_t *offset_out);
+
+// read the record at offset, returns -1 if it has not been written yet
+int nosdk_topiclog_read(
+    struct nosdk_topiclog *log,
+    int32_t partition,
+    int64_t offset,
+    struct nosdk_topiclog_record *record);
+
+// the offset the next record appended to the partition will get
+int64_t nosdk_topiclog_end(struct nosdk_topiclog *log, int32_t partition);
+
+// the number of records appended so far, across partitions
+uint64_t nosdk_topiclog_appends(struct nosdk_topiclog *log);
+
+// block for up to timeout_ms until the log has more than seen appends
+void nosdk_topiclog_wait(
+    struct nosdk_topiclog *log, uint64_t seen, int timeout_ms);
+
+// the next offset the group consumes from the partition, -1 if it never
+// committed one
+int64_t nosdk_topiclog_committed(
+    struct nosdk_topiclog *log, const char *group, int32_t partition);
+
+int nosdk_topiclog_commit(
+    struct nosdk_topiclog *log,
+    const char *group,
+    int32_t partition,
+    int64_t offset);
+
+// encoded header block: a u16 name length and a u32 value length, then
+// the name and the value, for every header
+size_t nosdk_topiclog_header_size(size_t name_len, size_t value_len);
+
+char *nosdk_topiclog_header_put(
+    char *dst,
+    const char *name,
+    size_t name_len,
+    const void *value,
+    size_t value_len);
+
+// iterate an encoded header block from *pos, returns 0 at the end
+int nosdk_topiclog_header_next(
+    const char *headers,
+    size_t headers_len,
+    size_t *pos,
+    const char **name,
+    size_t *name_len,
+    const char **value,
+    size_t *value_len);
+
+// sync every segment and group written since the last flush
+void nosdk_topiclog_flush_all();
+
+// start the thread that flushes every interval_ms
+int nosdk_topiclog_start_flusher(int interval_ms);
+
+// stop the flusher, flush and close every log
+void nosdk_topiclog_close_all();
+
+#endif // _NOSDK_TOPICLOG_H
@@ -1,3 +1,10 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
 #include "util.h"
 
 int json_array_next_item(
@@ -38,6 +45,39 @@ int json_array_next_item(
     return start;
 }
 
+int json_stream_next_item(
+    struct json_stream_iter *iter, const char *data, int len, int *start) {
+    *start = -1;
+
+    for (int i = 0; i < len; i++) {
+        char this_char = data[i];
+
+        if (iter->in_str) {
+            if (iter->escaped) {
+                iter->escaped = 0;
+            } else if (this_char == '\\') {
+                iter->escaped = 1;
+            } else if (this_char == '"') {
+                iter->in_str = 0;
+            }
+        } else if (this_char == '"') {
+            iter->in_str = 1;
+        } else if (this_char == '{') {
+            if (iter->depth == 0) {
+                *start = i;
+            }
+            iter->depth++;
+        } else if (this_char == '}' && iter->depth > 0) {
+            iter->depth--;
+            if (iter->depth == 0) {
+                return i + 1;
+            }
+        }
+    }
+
+    return -1;
+}
+
 char *json_extract_key(char *buf, char *key) {
     char cur_str[64];
     int cur_str_pos = 0;
@@ -94,3 +134,261 @@ bool json_has_key(char *buf, char *key) {
     free(value);
     return has;
 }
+
+int json_skip_ws(char *data, int len, int pos) {
+    while (pos < len && isspace((unsigned char)data[pos])) {
+        pos++;
+    }
+    return pos;
+}
+
+// returns the index just past the JSON value starting at pos
+int json_skip_value(char *data, int len, int pos) {
+    int depth = 0;
+    int in_str = 0;
+
+    for (; pos < len; pos++) {
+        char this_char = data[pos];
+
+        if (in_str) {
+            if (this_char == '\\') {
+                pos++;
+            } else if (this_char == '"') {
+                in_str = 0;
+                if (depth == 0) {
+                    return pos + 1;
+                }
+            }
+            continue;
+        }
+
+        if (this_char == '"') {
+            in_str = 1;
+        } else if (this_char == '{' || this_char == '[') {
+            depth++;
+        } else if (this_char == '}' || this_char == ']') {
+            if (depth == 0) {
+                return pos;
+            }
+            depth--;
+            if (depth == 0) {
+                return pos + 1;
+            }
+        } else if (
+            depth == 0 &&
+            (this_char == ',' || isspace((unsigned char)this_char))) {
+            return pos;
+        }
+    }
+
+    return pos;
+}
+
+int json_array_next_value(
+    struct json_array_iter *iter, int *start_pos, int *len) {
+    int pos = json_skip_ws(iter->data, iter->data_len, iter->pos);
+
+    if (pos < iter->data_len &&
+        (iter->data[pos] == '[' || iter->data[pos] == ',')) {
+        pos = json_skip_ws(iter->data, iter->data_len, pos + 1);
+    }
+
+    if (pos >= iter->data_len || iter->data[pos] == ']') {
+        iter->pos = iter->data_len;
+        return 0;
+    }
+
+    int end = json_skip_value(iter->data, iter->data_len, pos);
+    if (end == pos) {
+        iter->pos = iter->data_len;
+        return 0;
+    }
+
+    *start_pos = pos;
+    *len = end - pos;
+    iter->pos = end;
+
+    return 1;
+}
+
+int json_object_next_member(
+    struct json_object_iter *iter,
+    int *key_start,
+    int *key_len,
+    int *value_start,
+    int *value_len) {
+    int pos = json_skip_ws(iter->data, iter->data_len, iter->pos);
+
+    if (pos < iter->data_len &&
+        (iter->data[pos] == '{' || iter->data[pos] == ',')) {
+        pos = json_skip_ws(iter->data, iter->data_len, pos + 1);
+    }
+
+    if (pos >= iter->data_len || iter->data[pos] != '"') {
+        iter->pos = iter->data_len;
+        return 0;
+    }
+
+    int key_end = json_skip_value(iter->data, iter->data_len, pos);
+    *key_start = pos + 1;
+    *key_len = key_end - pos - 2;
+
+    pos = json_skip_ws(iter->data, iter->data_len, key_end);
+    if (pos >= iter->data_len || iter->data[pos] != ':') {
+        iter->pos = iter->data_len;
+        return 0;
+    }
+    pos = json_skip_ws(iter->data, iter->data_len, pos + 1);
+
+    int end = json_skip_value(iter->data, iter->data_len, pos);
+    *value_start = pos;
+    *value_len = end - pos;
+    iter->pos = end;
+
+    return 1;
+}
+
+int json_object_get(
+    char *buf, int len, const char *key, int *value_start, int *value_len) {
+    struct json_object_iter iter = {
+        .data = buf,
+        .data_len = len,
+    };
+    int key_start, key_len;
+    int klen = strlen(key);
+
+    while (json_object_next_member(
+        &iter, &key_start, &key_len, value_start, value_len)) {
+        if (key_len == klen && memcmp(&buf[key_start], key, klen) == 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+void json_unquote(char *buf, int *start, int *len) {
+    if (*len >= 2 && buf[*start] == '"' && buf[*start + *len - 1] == '"') {
+        *start += 1;
+        *len -= 2;
+    }
+}
+
+int nosdk_writev_all(int fd, struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+        ssize_t result = writev(fd, iov, iovcnt);
+        if (result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+
+        while (iovcnt > 0 && result >= (ssize_t)iov->iov_len) {
+            result -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + result;
+            iov->iov_len -= result;
+        }
+    }
+    return 0;
+}
+
+int nosdk_wake_fd_new(int *read_fd, int *write_fd) {
+#ifdef __linux__
+    int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    *read_fd = fd;
+    *write_fd = fd;
+    return 0;
+#else
+    int fds[2];
+    if (pipe(fds) != 0) {
+        return -1;
+    }
+    for (int i = 0; i < 2; i++) {
+        fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+        fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+    }
+    *read_fd = fds[0];
+    *write_fd = fds[1];
+    return 0;
+#endif
+}
+
+void nosdk_wake_signal(int write_fd) {
+    // a full pipe or a saturated counter is already signalled
+    uint64_t one = 1;
+    while (write(write_fd, &one, sizeof(one)) < 0 && errno == EINTR) {
+    }
+}
+
+void nosdk_wake_drain(int read_fd) {
+    uint64_t buf[16];
+    while (read(read_fd, buf, sizeof(buf)) > 0) {
+    }
+}
+
+static const char base64url_chars[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+
+void nosdk_base64url_encode(
+    struct nosdk_string_buffer *sb, const char *data, int len) {
+    const unsigned char *in = (const unsigned char *)data;
+    char out[5];
+
+    for (int i = 0; i < len; i += 3) {
+        uint32_t n = in[i] << 16;
+        int chars = 2;
+        if (i + 1 < len) {
+            n |= in[i + 1] << 8;
+            chars++;
+        }
+        if (i + 2 < len) {
+            n |= in[i + 2];
+            chars++;
+        }
+
+        for (int j = 0; j < chars; j++) {
+            out[j] = base64url_chars[(n >> (18 - j * 6)) & 0x3f];
+        }
+        out[chars] = '\0';
+        nosdk_string_buffer_append(sb, "%s", out);
+    }
+}
+
+char *nosdk_base64url_decode(const char *src, int *len) {
+    int src_len = strlen(src);
+    if (src_len % 4 == 1) {
+        return NULL;
+    }
+
+    char *out = malloc(src_len * 3 / 4 + 1);
+    uint32_t n = 0;
+    int bits = 0;
+    int out_len = 0;
+
+    for (int i = 0; i < src_len; i++) {
+        const char *c = strchr(base64url_chars, src[i]);
+        if (c == NULL) {
+            free(out);
+            return NULL;
+        }
+
+        n = (n << 6) | (uint32_t)(c - base64url_chars);
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            out[out_len++] = (n >> bits) & 0xff;
+        }
+    }
+
+    out[out_len] = '\0';
+    *len = out_len;
+    return out;
+}
@@ -4,9 +4,12 @@
 #include <ctype.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/uio.h>
+#include <time.h>
 
 extern int nosdk_debug_flag;
 
@@ -22,6 +25,25 @@ static inline int nosdk_debugf(const char *format, ...) {
     return result;
 }
 
+// absolute CLOCK_REALTIME deadline ms milliseconds from now, for use with
+// pthread_cond_timedwait
+static inline void nosdk_deadline_after_ms(struct timespec *ts, int ms) {
+    clock_gettime(CLOCK_REALTIME, ts);
+    ts->tv_sec += ms / 1000;
+    ts->tv_nsec += (long)(ms % 1000) * 1000000;
+    if (ts->tv_nsec >= 1000000000) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+
+// wall clock milliseconds, comparable with kafka message timestamps
+static inline int64_t nosdk_now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 struct nosdk_string_buffer {
     char *data;
     int capacity;
@@ -61,6 +83,38 @@ static inline int nosdk_string_buffer_append(
     return 0;
 }
 
+// append data[0:len] as a quoted JSON string, escaping quotes, backslashes
+// and control characters
+static inline void nosdk_string_buffer_append_json_string(
+    struct nosdk_string_buffer *sb, const char *data, int len) {
+    nosdk_string_buffer_append(sb, "\"");
+
+    int run_start = 0;
+    for (int i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)data[i];
+        if (c != '"' && c != '\\' && c >= 0x20) {
+            continue;
+        }
+
+        nosdk_string_buffer_append(sb, "%.*s", i - run_start, &data[run_start]);
+        run_start = i + 1;
+
+        if (c == '"' || c == '\\') {
+            nosdk_string_buffer_append(sb, "\\%c", c);
+        } else if (c == '\n') {
+            nosdk_string_buffer_append(sb, "\\n");
+        } else if (c == '\r') {
+            nosdk_string_buffer_append(sb, "\\r");
+        } else if (c == '\t') {
+            nosdk_string_buffer_append(sb, "\\t");
+        } else {
+            nosdk_string_buffer_append(sb, "\\u%04x", c);
+        }
+    }
+
+    nosdk_string_buffer_append(sb, "%.*s\"", len - run_start, &data[run_start]);
+}
+
 static inline void nosdk_string_buffer_free(struct nosdk_string_buffer *sb) {
     free(sb->data);
     free(sb);
@@ -115,4 +169,67 @@ char *json_extract_key(char *buf, char *key);
 
 bool json_has_key(char *buf, char *key);
 
+// step through the values of a JSON array of any type, returning 1 and
+// setting the start index and length of the next value, or 0 at the end
+int json_array_next_value(
+    struct json_array_iter *iter, int *start_pos, int *len);
+
+// an iterator over the members of a JSON object
+struct json_object_iter {
+    char *data;
+    int data_len;
+    int pos;
+};
+
+// returns 1 and sets the key (without quotes) and raw value spans of
+// the next member, or 0 at the end of the object
+int json_object_next_member(
+    struct json_object_iter *iter,
+    int *key_start,
+    int *key_len,
+    int *value_start,
+    int *value_len);
+
+// an iterator over the objects of a JSON array that arrives in pieces,
+// the scan state carries over from one piece to the next
+struct json_stream_iter {
+    int depth;
+    int in_str;
+    int escaped;
+};
+
+// scan data[0:len] for the end of the next top-level object, returns the
+// index just past it or -1 if the piece ends first. start is set to the
+// index the object begins at, or -1 if it began in an earlier piece.
+int json_stream_next_item(
+    struct json_stream_iter *iter, const char *data, int len, int *start);
+
+// narrow a raw value span to the contents of a JSON string, leaving
+// non-string values untouched. escapes are not decoded.
+void json_unquote(char *buf, int *start, int *len);
+
+// find the raw value span for a top-level key of the JSON object in
+// buf[0:len], returns 1 if the key is present
+int json_object_get(
+    char *buf, int len, const char *key, int *value_start, int *value_len);
+
+// url-safe base64 without padding, for opaque tokens in query strings
+void nosdk_base64url_encode(
+    struct nosdk_string_buffer *sb, const char *data, int len);
+
+// decode into a new NUL-terminated string, NULL if src is not base64url
+char *nosdk_base64url_decode(const char *src, int *len);
+
+// write every byte of the iovecs, returns -1 if the reader went away. the
+// iovecs are advanced in place.
+int nosdk_writev_all(int fd, struct iovec *iov, int iovcnt);
+
+// a descriptor that polls readable once signalled, until drained. an
+// eventfd where available, otherwise a pipe whose ends differ.
+int nosdk_wake_fd_new(int *read_fd, int *write_fd);
+
+void nosdk_wake_signal(int write_fd);
+
+void nosdk_wake_drain(int read_fd);
+
 #endif // _NOSDK_UTIL_H